@@ -0,0 +1,252 @@
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <linux/limits.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_replace.c"
+
+
+// Offline microbenchmark for the rewrite engines. No ptrace involved.
+//
+// Loads a corpus of recorded paths and the same rule configuration the tracer would use, then times every engine in RuleSetEngines[] over the corpus and checks that they all produce byte-identical output.
+//
+// Build and run:
+//		$ gcc -O2 -o intercept-files-bench intercept-files-bench.c
+//		$ _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_RULES_FILE=rules.tsv ./intercept-files-bench paths.txt
+//
+// A log from `_PATH_INTERCEPTOR_DEBUG=2 intercept-files ...` works as a corpus too, with `--log`.
+
+
+static const char* HELP_TEXT = "\n"
+"Usage:\n"
+"	$ %s [--log] [--iterations N] CORPUS\n"
+"\n"
+"CORPUS has one path per line, or with --log, is an intercept-files log recorded with _PATH_INTERCEPTOR_DEBUG=2 or higher.\n"
+"Rules are configured with the same environment variables as intercept-files.\n"
+"\n";
+
+
+////// Allocation counting:
+
+// Count heap allocations by wrapping glibc's allocator. Anything in the rewrite path that calls malloc(), including inside regexec(), shows up here.
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long bench_allocations;
+
+void* malloc(size_t size) {
+	bench_allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+	bench_allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	bench_allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+
+////// Corpus:
+
+typedef struct {
+	char** paths;
+	size_t* lengths;
+	size_t length;
+} Corpus_t;
+
+static void corpusAdd(Corpus_t* corpus, const char* path, size_t path_len) {
+	if (!path_len || path_len >= PATH_MAX)
+		return;
+	if (!(corpus->length & (corpus->length + 1))) {
+		// Grow at every power of two.
+		size_t cap = (corpus->length + 1) * 2;
+		corpus->paths = (char**)realloc(corpus->paths, sizeof(char*) * cap);
+		corpus->lengths = (size_t*)realloc(corpus->lengths, sizeof(size_t) * cap);
+	}
+	corpus->paths[corpus->length] = strndup(path, path_len);
+	corpus->lengths[corpus->length] = path_len;
+	corpus->length++;
+}
+
+static void corpusLoad(Corpus_t* corpus, const char* corpus_filepath, int is_log) {
+	// In logs, take paths from "Path interception requested:" lines, which intercept_path() writes for every path it sees.
+	static const char* log_marker = "Path interception requested: ";
+
+	FILE* f = fopen(corpus_filepath, "r");
+	if (!f) {
+		perror(corpus_filepath);
+		exit(1);
+	}
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	while ((line_len = getline(&line, &line_cap, f)) >= 0) {
+		if (line_len && line[line_len - 1] == '\n')
+			line[--line_len] = '\0';
+		if (!is_log) {
+			corpusAdd(corpus, line, line_len);
+			continue;
+		}
+		char* path = strstr(line, log_marker);
+		if (path) {
+			path += strlen(log_marker);
+			corpusAdd(corpus, path, line + line_len - path);
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+
+////// Benchmark:
+
+static inline unsigned long long now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_ull(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_engine(const RuleSetEngineEntry_t* engine, const RuleSet_t* ruleset, const Corpus_t* corpus, int iterations, unsigned long long* per_path_ns) {
+	char output[PATH_MAX];
+	unsigned long hits = 0;
+
+	// Warm-up, which also counts hits.
+	for (size_t i = 0; i < corpus->length; i++) {
+		if (engine->replace(ruleset, corpus->paths[i], corpus->lengths[i], output, PATH_MAX) != PATH_REPLACER_NO_MATCH)
+			hits++;
+	}
+
+	// Throughput, without per-call timer overhead.
+	unsigned long allocations_before = bench_allocations;
+	unsigned long long start = now_ns();
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		for (size_t i = 0; i < corpus->length; i++) {
+			engine->replace(ruleset, corpus->paths[i], corpus->lengths[i], output, PATH_MAX);
+		}
+	}
+	unsigned long long elapsed = now_ns() - start;
+	unsigned long allocations = bench_allocations - allocations_before;
+	double calls = (double)corpus->length * iterations;
+
+	// Distribution, timing each call individually.
+	for (size_t i = 0; i < corpus->length; i++) {
+		unsigned long long call_start = now_ns();
+		engine->replace(ruleset, corpus->paths[i], corpus->lengths[i], output, PATH_MAX);
+		per_path_ns[i] = now_ns() - call_start;
+	}
+	qsort(per_path_ns, corpus->length, sizeof(unsigned long long), compare_ull);
+
+	printf("%-10s %12.1f %10llu %10llu %10llu %12.3f %9.2f%%\n",
+		engine->name,
+		elapsed / calls,
+		per_path_ns[corpus->length / 2],
+		per_path_ns[corpus->length * 99 / 100],
+		per_path_ns[corpus->length - 1],
+		allocations / calls,
+		100.0 * hits / corpus->length
+	);
+}
+
+static unsigned long check_engines(const RuleSet_t* ruleset, const Corpus_t* corpus) {
+	// Every engine has to agree with the first one (plain POSIX regex) on every path, including on whether it matched at all.
+	char expected[PATH_MAX];
+	char output[PATH_MAX];
+	unsigned long mismatches = 0;
+	for (size_t i = 0; i < corpus->length; i++) {
+		ssize_t expected_len = RuleSetEngines[0].replace(ruleset, corpus->paths[i], corpus->lengths[i], expected, PATH_MAX);
+		for (int e = 1; e < RuleSetEngines_l; e++) {
+			ssize_t output_len = RuleSetEngines[e].replace(ruleset, corpus->paths[i], corpus->lengths[i], output, PATH_MAX);
+			if (output_len == expected_len && (expected_len == PATH_REPLACER_NO_MATCH || memcmp(output, expected, expected_len + 1) == 0))
+				continue;
+			if (mismatches < 10) {
+				fprintf(stderr, "MISMATCH (%s vs %s):\n\t%s\n\t→\t%s\n\t→\t%s\n",
+					RuleSetEngines[0].name,
+					RuleSetEngines[e].name,
+					corpus->paths[i],
+					expected_len == PATH_REPLACER_NO_MATCH ? "(no match)" : expected,
+					output_len == PATH_REPLACER_NO_MATCH ? "(no match)" : output
+				);
+			}
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
+
+
+int main(int argc, char** argv) {
+	int is_log = 0;
+	int iterations = 100;
+	const char* corpus_filepath = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--log") == 0) {
+			is_log = 1;
+		} else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterations = strtol(argv[++i], NULL, 10);
+		} else if (!corpus_filepath && argv[i][0] != '-') {
+			corpus_filepath = argv[i];
+		} else {
+			corpus_filepath = NULL;
+			break;
+		}
+	}
+	if (!corpus_filepath || iterations < 1) {
+		fprintf(stderr, HELP_TEXT, argv[0]);
+		return 1;
+	}
+
+	Corpus_t corpus = { NULL, NULL, 0 };
+	corpusLoad(&corpus, corpus_filepath, is_log);
+	if (!corpus.length) {
+		fprintf(stderr, "No paths in corpus:\n\t%s\n", corpus_filepath);
+		return 1;
+	}
+
+	RuleSet_t ruleset;
+	ruleSetInit(&ruleset);
+	ruleSetLoadEnv(&ruleset);
+	if (!ruleset.length) {
+		fprintf(stderr, "No rules. Set _PATH_INTERCEPTOR_MATCH_REGEX and _PATH_INTERCEPTOR_REPLACEMENT_STRING, or _PATH_INTERCEPTOR_RULES_FILE.\n");
+		return 1;
+	}
+
+	int literal_rules = 0;
+	for (int i = 0; i < ruleset.length; i++) {
+		literal_rules += ruleset.rules[i].is_literal_prefix;
+	}
+	printf("%zu paths, %i rules (%i literal prefixes), %i iterations.\n\n", corpus.length, ruleset.length, literal_rules, iterations);
+
+	unsigned long mismatches = check_engines(&ruleset, &corpus);
+
+	unsigned long long* per_path_ns = (unsigned long long*)malloc(sizeof(unsigned long long) * corpus.length);
+	printf("%-10s %12s %10s %10s %10s %12s %10s\n", "engine", "mean_ns", "p50_ns", "p99_ns", "max_ns", "allocs/path", "hits");
+	for (int e = 0; e < RuleSetEngines_l; e++) {
+		bench_engine(&RuleSetEngines[e], &ruleset, &corpus, iterations, per_path_ns);
+	}
+	free(per_path_ns);
+
+	if (mismatches) {
+		printf("\n%lu MISMATCHES between engines.\n", mismatches);
+		return 2;
+	}
+	printf("\nAll engines agree on every path.\n");
+	return 0;
+}
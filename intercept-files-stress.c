@@ -0,0 +1,388 @@
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+// Scale and soak harness for `intercept-files`.
+//
+// Runs a tree of processes and threads that churn through clone, fork, vfork, exec and exit while hammering path syscalls, under the tracer, for a fixed duration. Then reports the tracer's own counters (see interceptor_stats.c) for each tree size, so we can see how it scales.
+//
+// Build and run:
+//		$ gcc -O2 -o intercept-files intercept-files.c
+//		$ gcc -O2 -pthread -o intercept-files-stress intercept-files-stress.c
+//		$ ./intercept-files-stress --tracer ./intercept-files --procs 8,64,256 --threads 4 --duration 10
+//
+// Paths used by the workers all start with STRESS_PATH_PREFIX, and the tracer is configured to rewrite that prefix, so every path syscall also goes through the rewrite engine.
+
+
+static const char* HELP_TEXT = "\n"
+"Usage:\n"
+"	$ %s [OPTIONS]\n"
+"\n"
+"Options:\n"
+"	--tracer PATH		intercept-files binary to run under. \"./intercept-files\" by default.\n"
+"	--procs N[,N...]	Total processes in each tree. One run per value. \"16,64,256\" by default.\n"
+"	--threads N		Long-lived path syscall threads per process. \"4\" by default.\n"
+"	--fanout N		Children per process in the tree, at most 64. \"4\" by default.\n"
+"	--duration S		Seconds each run lasts. \"5\" by default.\n"
+"\n";
+
+#define STRESS_PATH_PREFIX "/tmp/intercept-files-stress-A"
+#define STRESS_PATH_REPLACEMENT "/tmp/intercept-files-stress-B"
+#define STRESS_MAX_FANOUT 64
+
+
+////// Worker side, running under the tracer:
+
+typedef struct {
+	int procs;
+	int threads;
+	int fanout;
+	double duration;
+} StressConfig_t;
+
+static double now_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double _worker_deadline;
+
+static void path_syscalls(int seed) {
+	// One round of mixed path syscalls. Most fail with ENOENT, which is also what most real-world probes do.
+	char path[128];
+	char link_target[128];
+	struct stat st;
+	snprintf(path, sizeof(path), STRESS_PATH_PREFIX "/%i/file", seed % 64);
+	stat(path, &st);
+	lstat(path, &st);
+	access(path, R_OK);
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0)
+		close(fd);
+	fd = openat(AT_FDCWD, STRESS_PATH_PREFIX, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0)
+		close(fd);
+	readlink(path, link_target, sizeof(link_target));
+}
+
+static void* path_thread(void* arg) {
+	int seed = (int)(long)arg;
+	while (now_seconds() < _worker_deadline) {
+		path_syscalls(seed++);
+	}
+	return NULL;
+}
+
+static void* short_thread(void* arg) {
+	path_syscalls((int)(long)arg);
+	return NULL;
+}
+
+static void churn_once(int round) {
+	// One of each kind of task creation, each of which exits almost immediately.
+	pid_t pid;
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, short_thread, (void*)(long)round) == 0)
+		pthread_join(thread, NULL);
+
+	if ((pid = fork()) == 0) {
+		path_syscalls(round);
+		_exit(0);
+	} else if (pid > 0) {
+		waitpid(pid, NULL, 0);
+	}
+
+	if ((pid = vfork()) == 0) {
+		execl("/bin/true", "true", (char*)NULL);
+		_exit(127);
+	} else if (pid > 0) {
+		waitpid(pid, NULL, 0);
+	}
+}
+
+static void run_worker(const StressConfig_t* config, int index) {
+	// Process `index` of a heap-shaped tree: its children are index*fanout+1 … index*fanout+fanout.
+	pid_t children[STRESS_MAX_FANOUT];
+	int children_l = 0;
+
+	for (int c = 1; c <= config->fanout && children_l < STRESS_MAX_FANOUT; c++) {
+		int child_index = index * config->fanout + c;
+		if (child_index >= config->procs)
+			break;
+		pid_t pid = fork();
+		if (pid == 0) {
+			children_l = 0;
+			index = child_index;
+			c = 0;
+			// Restart the loop as the child, to spawn its own subtree.
+			continue;
+		}
+		if (pid > 0)
+			children[children_l++] = pid;
+	}
+
+	pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * config->threads);
+	int threads_l = 0;
+	for (int t = 0; t < config->threads; t++) {
+		if (pthread_create(&threads[threads_l], NULL, path_thread, (void*)(long)(index * 1000 + t)) == 0)
+			threads_l++;
+	}
+
+	for (int round = 0; now_seconds() < _worker_deadline; round++) {
+		churn_once(index + round);
+	}
+
+	for (int t = 0; t < threads_l; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+	for (int c = 0; c < children_l; c++) {
+		waitpid(children[c], NULL, 0);
+	}
+	if (index != 0)
+		exit(0);
+}
+
+
+////// Driver side:
+
+typedef struct {
+	double elapsed_s;
+	double tracer_user_s;
+	double tracer_sys_s;
+	long tracer_maxrss_kb;
+	unsigned long stops;
+	double stops_per_s;
+	unsigned long new_tasks;
+	unsigned long path_rewrites;
+	unsigned long unexpected_pids;
+	long peak_live_tasks;
+	long pidmap_capacity;
+	int found;
+} StressResult_t;
+
+static void read_stats(const char* stats_filepath, StressResult_t* result) {
+	// Just the keys we report. Later lines win, so a stale file from an earlier run wouldn't matter either.
+	memset(result, 0, sizeof(*result));
+	FILE* f = fopen(stats_filepath, "r");
+	if (!f)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		char* value = strchr(line, '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		#define _READ_STAT(KEY, CONVERT) \
+			if (strcmp(line, #KEY) == 0) { \
+				result->KEY = CONVERT(value, NULL); \
+				result->found = 1; \
+			}
+		_READ_STAT(elapsed_s, strtod);
+		_READ_STAT(tracer_user_s, strtod);
+		_READ_STAT(tracer_sys_s, strtod);
+		_READ_STAT(stops_per_s, strtod);
+		#undef _READ_STAT
+		#define _READ_STAT(KEY) \
+			if (strcmp(line, #KEY) == 0) { \
+				result->KEY = strtol(value, NULL, 10); \
+			}
+		_READ_STAT(tracer_maxrss_kb);
+		_READ_STAT(stops);
+		_READ_STAT(new_tasks);
+		_READ_STAT(path_rewrites);
+		_READ_STAT(unexpected_pids);
+		_READ_STAT(peak_live_tasks);
+		_READ_STAT(pidmap_capacity);
+		#undef _READ_STAT
+	}
+	fclose(f);
+}
+
+static int run_once(const char* tracer, const char* self, const StressConfig_t* config, StressResult_t* result) {
+	char stats_filepath[] = "/tmp/intercept-files-stress-stats-XXXXXX";
+	int stats_fd = mkstemp(stats_filepath);
+	if (stats_fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(stats_fd);
+
+	char procs_s[32], threads_s[32], fanout_s[32], duration_s[32];
+	snprintf(procs_s, sizeof(procs_s), "%i", config->procs);
+	snprintf(threads_s, sizeof(threads_s), "%i", config->threads);
+	snprintf(fanout_s, sizeof(fanout_s), "%i", config->fanout);
+	snprintf(duration_s, sizeof(duration_s), "%f", config->duration);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		setenv("_PATH_INTERCEPTOR_THREADS", "1", 1);
+		setenv("_PATH_INTERCEPTOR_DEBUG", "0", 0);
+		// "Unexpected PID" detaches are counted in the stats file either way. Set it to see the log too.
+		setenv("_PATH_INTERCEPTOR_MATCH_REGEX", "^" STRESS_PATH_PREFIX, 1);
+		setenv("_PATH_INTERCEPTOR_REPLACEMENT_STRING", STRESS_PATH_REPLACEMENT, 1);
+		setenv("_PATH_INTERCEPTOR_STATS_FILE", stats_filepath, 1);
+		execl(tracer, tracer, self, "--worker", procs_s, threads_s, fanout_s, duration_s, (char*)NULL);
+		perror(tracer);
+		_exit(127);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+
+	read_stats(stats_filepath, result);
+	unlink(stats_filepath);
+
+	if (!result->found) {
+		fprintf(stderr, "No stats from tracer (wait status %i). Is --tracer built with interceptor_stats.c?\n", status);
+		return 1;
+	}
+	return 0;
+}
+
+static void print_header() {
+	printf("%8s %8s %10s %10s %12s %12s %10s %12s %12s %10s\n",
+		"procs",
+		"threads",
+		"wall_s",
+		"tracer_s",
+		"peak_rss_kb",
+		"tasks",
+		"peak_live",
+		"pidmap_cap",
+		"stops/s",
+		"unexpect"
+	);
+}
+
+static void print_result(const StressConfig_t* config, const StressResult_t* result) {
+	printf("%8i %8i %10.2f %10.2f %12li %12lu %10li %12li %12.0f %10lu\n",
+		config->procs,
+		config->threads,
+		result->elapsed_s,
+		result->tracer_user_s + result->tracer_sys_s,
+		result->tracer_maxrss_kb,
+		result->new_tasks,
+		result->peak_live_tasks,
+		result->pidmap_capacity,
+		result->stops_per_s,
+		result->unexpected_pids
+	);
+	fflush(stdout);
+}
+
+
+int main(int argc, char** argv) {
+	StressConfig_t config = {
+		.procs = 16,
+		.threads = 4,
+		.fanout = 4,
+		.duration = 5,
+	};
+
+	if (argc == 6 && strcmp(argv[1], "--worker") == 0) {
+		config.procs = strtol(argv[2], NULL, 10);
+		config.threads = strtol(argv[3], NULL, 10);
+		config.fanout = strtol(argv[4], NULL, 10);
+		config.duration = strtod(argv[5], NULL);
+		if (config.fanout < 1)
+			config.fanout = 1;
+		_worker_deadline = now_seconds() + config.duration;
+		run_worker(&config, 0);
+		return 0;
+	}
+
+	const char* tracer = "./intercept-files";
+	const char* procs_list = "16,64,256";
+
+	for (int i = 1; i < argc; i++) {
+		#define _OPTION(NAME) (strcmp(argv[i], NAME) == 0 && i + 1 < argc)
+		if (_OPTION("--tracer")) {
+			tracer = argv[++i];
+		} else if (_OPTION("--procs")) {
+			procs_list = argv[++i];
+		} else if (_OPTION("--threads")) {
+			config.threads = strtol(argv[++i], NULL, 10);
+		} else if (_OPTION("--fanout")) {
+			config.fanout = strtol(argv[++i], NULL, 10);
+		} else if (_OPTION("--duration")) {
+			config.duration = strtod(argv[++i], NULL);
+		} else {
+			fprintf(stderr, HELP_TEXT, argv[0]);
+			return 1;
+		}
+		#undef _OPTION
+	}
+	if (config.fanout < 1 || config.fanout > STRESS_MAX_FANOUT) {
+		fprintf(stderr, "--fanout has to be between 1 and %i.\n", STRESS_MAX_FANOUT);
+		return 1;
+	}
+
+	char self[4096];
+	ssize_t self_l = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (self_l < 0) {
+		perror("/proc/self/exe");
+		return 1;
+	}
+	self[self_l] = '\0';
+
+	print_header();
+
+	StressResult_t first_result;
+	StressConfig_t first_config;
+	StressResult_t last_result;
+	StressConfig_t last_config;
+	StressResult_t result;
+	int runs = 0;
+	int failures = 0;
+
+	for (const char* p = procs_list; *p; ) {
+		char* end;
+		config.procs = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		p = *end == ',' ? end + 1 : end;
+		if (config.procs < 1)
+			continue;
+
+		if (run_once(tracer, self, &config, &result)) {
+			failures++;
+			continue;
+		}
+		print_result(&config, &result);
+		if (!runs) {
+			first_result = result;
+			first_config = config;
+		}
+		last_result = result;
+		last_config = config;
+		// A failed run leaves `result` zeroed, so the summary only compares successful ones.
+		runs++;
+	}
+
+	if (runs > 1) {
+		// How the tracer's cost grew relative to the tree, against the smallest run.
+		double task_ratio = (double)last_result.new_tasks / (first_result.new_tasks ? first_result.new_tasks : 1);
+		printf("\nScaling from %i to %i processes:\n", first_config.procs, last_config.procs);
+		printf("\ttasks created:\t×%.2f\n", task_ratio);
+		printf("\ttracer CPU:\t×%.2f\n", (last_result.tracer_user_s + last_result.tracer_sys_s) / (first_result.tracer_user_s + first_result.tracer_sys_s + 1e-9));
+		printf("\tpeak RSS:\t×%.2f\n", (double)last_result.tracer_maxrss_kb / (first_result.tracer_maxrss_kb ? first_result.tracer_maxrss_kb : 1));
+		printf("\tstops/s:\t×%.2f\n", last_result.stops_per_s / (first_result.stops_per_s + 1e-9));
+	}
+
+	return failures ? 1 : 0;
+}
@@ -13,6 +13,7 @@
 // #include "interceptor_debug.c"
 
 #include "interceptor_trace.c"
+#include "interceptor_daemon.c"
 
 #include "interceptor_replace.c"
 
@@ -24,6 +25,9 @@ static const char* HELP_TEXT = "\n"
 "\n"
 "Usage:\n"
 "	$ intercept-files <COMMAND> [COMMAND ARGS...]\n"
+"	$ _PATH_INTERCEPTOR_DAEMON=serve intercept-files\n"
+"	$ _PATH_INTERCEPTOR_DAEMON=client intercept-files <COMMAND> [COMMAND ARGS...]\n"
+"	$ _PATH_INTERCEPTOR_REPLAY=<FILE> intercept-files\n"
 "\n"
 "Control with environment variables:\n"
 "\n"
@@ -34,6 +38,33 @@ static const char* HELP_TEXT = "\n"
 "		A POSIX Extended Regular Expression string to match against intercepted pathnames.\n"
 "	_PATH_INTERCEPTOR_REPLACEMENT_STRING\n"
 "		A string with which to replace matched sections of intercepted pathnames.\n"
+"	_PATH_INTERCEPTOR_RULES_FILE\n"
+"		Filepath of additional rules, one \"REGEX<TAB>REPLACEMENT\" per line. Lines starting with \"#\" are ignored. Rules are tried in order after _PATH_INTERCEPTOR_MATCH_REGEX, and the first match wins. REPLACEMENT can also be a TAB-separated list of candidates, of which the first that exists is used, or the last if none do. Only candidates that make the path absolute are checked, relative ones are skipped unless they're last. A line starting with \"@overlay<TAB>\" makes an overlay rule: listing a directory it rewrites shows the entries of the original directory too, with the target's winning, as long as the FD came from open() or openat() with an absolute path. Give the original as the last candidate, so the entries only it has can be opened.\n"
+"	_PATH_INTERCEPTOR_PATH_CACHE_SIZE\n"
+"		Number of entries in the cache of path metadata, which says which candidate paths exist and backs _PATH_INTERCEPTOR_EMULATE, kept up to date with inotify. Changes at the target of a symlink, in another directory than the link, aren't seen. \"4096\" by default. \"0\" to stat() every candidate every time.\n"
+"	_PATH_INTERCEPTOR_OVERLAY_CACHE_SIZE\n"
+"		Number of merged directory listings for overlay rules to keep, each until either directory's mtime changes. \"64\" by default.\n"
+"	_PATH_INTERCEPTOR_EMULATE\n"
+"		\"1\" to answer stat(), lstat(), newfstatat(), statx(), readlink(), readlinkat(), existence checks with access() and faccessat(), and open() and openat() calls that would fail for a missing path, for rewritten absolute paths from the path cache, without the kernel. Saves the kernel's path lookup on slow or deep filesystems, at the cost of ignoring changes the cache can't see, such as renamed parent directories or changes at symlink targets. Positive results for directories always go to the kernel. Unset by default.\n"
+"	_PATH_INTERCEPTOR_PREFETCH\n"
+"		\"1\" to read the ELF headers of every newly executed program, and look up the paths its dynamic loader is about to search for libraries on a background thread, so the path cache is warm when the loader gets there. Helps fallback rules and _PATH_INTERCEPTOR_EMULATE with programs that have long RUNPATHs, like Nix builds. Raise _PATH_INTERCEPTOR_PATH_CACHE_SIZE to match. Unset by default.\n"
+"	_PATH_INTERCEPTOR_PATCH\n"
+"		\"1\" to trace the command through a seccomp filter, so only the syscalls that take paths stop the tracer, and to patch call sites that keep making them to rewrite paths inside the traced process instead, without stopping at all. Call sites are only patched if every rule is a literal prefix with a single replacement, calls made from them skip logging and the stats. Calls that _PATH_INTERCEPTOR_EMULATE answers are never patched. Not compatible with handoffs, recording or replaying, or daemon mode, which all trace normally. Stops are handled on the tracer thread, so _PATH_INTERCEPTOR_MATCH_THREADS is ignored. x86-64 only. Unset by default.\n"
+"	_PATH_INTERCEPTOR_PATCH_THRESHOLD\n"
+"		Number of times a call site has to stop the tracer before _PATH_INTERCEPTOR_PATCH patches it. \"16\" by default.\n"
+"	_PATH_INTERCEPTOR_ENGINE\n"
+"		Rewrite engine. \"literal\" (default) matches rules that are just \"^\" and literal characters without the regex engine. \"regex\" uses POSIX regexes for everything.\n"
+"\n"
+"	_PATH_INTERCEPTOR_MATCH_THREADS\n"
+"		Number of matcher threads for pipelined mode, in which the tracer thread only reads paths and resumes tracees, and the rewrite engine runs on the matcher threads. Useful with many expensive rules. \"0\" (default) to match on the tracer thread.\n"
+"\n"
+"	_PATH_INTERCEPTOR_IO_URING_SQPOLL\n"
+"		Set to \"strip\" to remove IORING_SETUP_SQPOLL from io_uring rings at setup, so the paths in their submissions can be intercepted. Otherwise SQPOLL rings are only reported, since their SQEs are submitted by a kernel thread that never stops.\n"
+"\n"
+"	_PATH_INTERCEPTOR_DAEMON\n"
+"		\"serve\" to run as a daemon that traces commands sent to it over a Unix socket, keeping compiled rules and caches between them. \"client\" to send the command to that daemon and exit with its exit code, or trace it here if no daemon is running. Unset by default. The daemon's configuration applies to every command, and the client's environment is only passed on to the command.\n"
+"	_PATH_INTERCEPTOR_DAEMON_SOCKET\n"
+"		Filepath of the daemon socket. Default is \"$XDG_RUNTIME_DIR/intercept-files.sock\", or \"/tmp/intercept-files-UID.sock\" without XDG_RUNTIME_DIR.\n"
 "\n"
 "	_PATH_INTERCEPTOR_LOG_PREFIX\n"
 "		Prefix to prepend to log messages. Default is \"STATUS: \".\n"
@@ -41,6 +72,39 @@ static const char* HELP_TEXT = "\n"
 "		Integer specifying detail level of log messages. \"1\" by default, for status messsages. Higher values for increasingly detailed debug messages. \"0\" to disable.\n"
 "	_PATH_INTERCEPTOR_LOG_FILE\n"
 "		Filepath to which to append log messages. If unset, log messages are sent to STDERR instead.\n"
+"\n"
+"	_PATH_INTERCEPTOR_LOG_MODE\n"
+"		\"sampled\" to log each distinct rewrite (by rule and original path) only the first time and then once per _PATH_INTERCEPTOR_LOG_SAMPLE_RATE repeats, plus periodic summaries of call rates, errors and the most rewritten paths. \"all\" (default) logs every rewrite.\n"
+"	_PATH_INTERCEPTOR_LOG_SAMPLE_RATE\n"
+"		In sampled log mode, log every Nth repeat of a rewrite. \"1000\" by default. \"0\" to only log the first.\n"
+"	_PATH_INTERCEPTOR_LOG_SUMMARY_INTERVAL\n"
+"		In sampled log mode, seconds between summaries. \"10\" by default. \"0\" to disable them.\n"
+"	_PATH_INTERCEPTOR_LOG_SAMPLE_TABLE_SIZE\n"
+"		In sampled log mode, number of distinct rewrites to keep count of. Beyond that, the least recently seen are forgotten, and logged as new when they come back. \"4096\" by default, and for anything below 1.\n"
+"\n"
+"	_PATH_INTERCEPTOR_MANIFEST\n"
+"		Filepath to which to write a manifest of the paths the command used when the tracer exits, for working out what to bundle with it. Each distinct combination of original path, kind of syscall (\"open\", \"stat\", \"access\", \"readlink\", \"exec\", \"chdir\" or \"modify\"), whether it was rewritten, and whether the syscall succeeded is listed once, sorted by path. Call sites patched by _PATH_INTERCEPTOR_PATCH would be missed, so it only filters syscalls when this is set. Paths in io_uring requests aren't listed. Unset by default.\n"
+"	_PATH_INTERCEPTOR_MANIFEST_FORMAT\n"
+"		\"json\" (default) for a JSON array of objects with \"path\", \"class\", \"rewritten\" and \"success\" keys. \"nul\" for one \"CLASS<TAB>rewritten|original<TAB>ok|failed<TAB>PATH\" record per path, each terminated by a NUL byte, for paths that aren't valid UTF-8.\n"
+"	_PATH_INTERCEPTOR_STATS_FILE\n"
+"		Filepath to which to append tracer counters (stops, rewrites, tasks, tracer CPU and peak RSS) as \"key=value\" lines on exit. Unset by default.\n"
+"\n"
+"	_PATH_INTERCEPTOR_RECORD\n"
+"		Filepath to which to record every ptrace and waitpid call of the tracer and its result, for _PATH_INTERCEPTOR_REPLAY. Stops are handled inline while recording. Not available in daemon mode. Unset by default.\n"
+"	_PATH_INTERCEPTOR_REPLAY\n"
+"		Filepath of a recording to feed through the tracer instead of running a command, to profile or regression-test the tracer with the same input every time. Every write and resume is checked against the recording, and replay stops with an error at the first difference. Rules, and for fallback rules and emulation the files they look at, have to match the recording. Unset by default.\n"
+"\n"
+"	_PATH_INTERCEPTOR_HANDOFF_EXEC\n"
+"		Binary to hand the tracees over to on SIGUSR2, E.G. an upgraded `intercept-files`. It gets the same environment, so it reads the rules again. Default is this binary as it was when the tracer started. The old tracer stays to relay the exit code. The new tracer needs to be allowed to trace processes that aren't its descendants, so with kernel.yama.ptrace_scope=1 it needs CAP_SYS_PTRACE. If it can't take over, the old tracer carries on. Not available in daemon mode or while recording or replaying.\n"
+"	_PATH_INTERCEPTOR_HANDOFF_TIMEOUT\n"
+"		Seconds to wait for the new tracer to start and take over, and for every tracee to stop for a handoff, before cancelling it. \"10\" by default.\n"
+"\n"
+"	_PATH_INTERCEPTOR_AFFINITY\n"
+"		\"adaptive\" (or \"1\") to periodically move the tracer onto the CPUs sharing a last-level cache with the tracee that causes the most stops. Unset by default.\n"
+"	_PATH_INTERCEPTOR_AFFINITY_INTERVAL\n"
+"		Number of stops between adaptive affinity decisions. \"4096\" by default.\n"
+"	_PATH_INTERCEPTOR_PRIORITY\n"
+"		Nice value to run the tracer at, E.G. \"-10\". Negative values need CAP_SYS_NICE or a sufficient RLIMIT_NICE. Unset by default.\n"
 "\n";
 
 
@@ -61,33 +125,88 @@ static const char* HELP_TEXT = "\n"
 // _PATH_INTERCEPTOR_DEBUG=1 _PATH_INTERCEPTOR_LOG_FILE='' _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_LOG_PREFIX="INTERCEPT: " _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B ./intercept-files parallel stat ::: ABF ABG ABH
 // Possibly different type of forking. Recursive forking too, I think.
 
+// ./intercept-files-stress --tracer ./intercept-files --procs 16,64,256 --threads 4 --duration 10
+// Scale and soak. Hundreds of processes and threads cloning, forking, v-forking, exec-ing and exiting at once. Reports tracer CPU, peak RSS, PID mapping size, stop throughput and "Unexpected PID" detaches per tree size. See intercept-files-stress.c.
+
+// _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_RULES_FILE=rules.tsv ./intercept-files-bench paths.txt
+// Rewrite engine speed and agreement on a recorded path corpus, without ptrace. See intercept-files-bench.c.
+
+// _PATH_INTERCEPTOR_DAEMON=serve _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B ./intercept-files & sleep 1; for i in $(seq 100); do _PATH_INTERCEPTOR_DAEMON=client ./intercept-files bash -c 'stat Abc; exit 3'; echo $?; done; kill %1
+// Daemon mode. Every command should print the stat of B and exit with 3, and the daemon log should show a single regex compilation.
+// _PATH_INTERCEPTOR_DAEMON=serve ./intercept-files & sleep 1; _PATH_INTERCEPTOR_DAEMON=client ./intercept-files sleep 1234 & sleep 1; kill -9 %2; sleep 1; ps -eo stat,cmd | grep 'sleep 1234'; _PATH_INTERCEPTOR_DAEMON=client ./intercept-files sleep 1235 & sleep 1; kill %3; wait %3; echo $?; ps -eo stat,cmd | grep 'sleep 1235'; kill %1
+// Daemon clients going away. The first command should get a SIGHUP, the second the forwarded SIGTERM so the client exits with 15, and the daemon should reap both, so neither is left behind stopped or as a zombie.
+// _PATH_INTERCEPTOR_DAEMON=serve ./intercept-files & sleep 1; socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/intercept-files.sock & sleep 1; time _PATH_INTERCEPTOR_DAEMON=client ./intercept-files true; kill %2 %1
+// A client that connects and never sends anything. The second command shouldn't wait on it.
+
+// for a in 0 adaptive; do echo "AFFINITY=$a"; time _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_AFFINITY=$a _PATH_INTERCEPTOR_AFFINITY_INTERVAL=1024 _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B ./intercept-files perl -e 'for (1..200000) { stat "Abc" }'; done
+// Stop latency benchmark, comparing default scheduling against adaptive affinity. One process hammering a single path syscall, so the wall time is almost all stop round-trips. Add _PATH_INTERCEPTOR_PRIORITY=-5 (with CAP_SYS_NICE) to compare the priority boost too. Only meaningful on multi-socket or multi-CCX machines, and best run with some unrelated load to push the tracer around.
+
+// mkdir -p /tmp/B; ln -sf f /tmp/B/l; for e in 0 1; do : > /tmp/B/f; _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_EMULATE=$e _PATH_INTERCEPTOR_MATCH_REGEX=^/A/ _PATH_INTERCEPTOR_REPLACEMENT_STRING=/tmp/B/ ./intercept-files sh -c 'stat /A/f /A/l /A/nope; stat -L /A/l; readlink /A/l; test -e /A/f && echo yes; echo more >> /tmp/B/f; stat -c %s /A/f'; done
+// Syscall emulation. Both runs should print the same apart from timestamps, including the new size after the append.
+
+// _PATH_INTERCEPTOR_LOG_MODE=sampled _PATH_INTERCEPTOR_LOG_SAMPLE_RATE=10000 _PATH_INTERCEPTOR_LOG_SUMMARY_INTERVAL=1 _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B ./intercept-files perl -e 'for (1..200000) { stat "Abc"; stat "Ab".($_ % 300) }'
+// Sampled logging. Each of the 301 paths should be logged once, "Abc" again every 10000 times, and a summary should follow every second, with "Abc" on top.
+
+// _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B _PATH_INTERCEPTOR_RECORD=rec.bin ./intercept-files bash -c 'for i in $(seq 100); do (stat Abc); done; exit 3'; time _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B _PATH_INTERCEPTOR_REPLAY=rec.bin ./intercept-files; echo $?
+// Record and replay. The replay should exit with 3 in a fraction of the live run's time. With a different REPLACEMENT_STRING, it should stop at the first write, reporting the divergence.
+
+// _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_MATCH_REGEX=^A _PATH_INTERCEPTOR_REPLACEMENT_STRING=B ./intercept-files bash -c 'for i in $(seq 50); do stat -c %n Abc; (stat -c %n Abd) & sleep 0.1; done; wait; exit 3' & sleep 1; kill -USR2 $!; sleep 2; kill -USR2 $(pgrep -P $! intercept-files); wait $!; echo $?
+// Handoff, twice in a row. Run next to files Bbc and Bbd. Every stat should succeed, the log should show each new tracer taking over, and the first tracer should exit with 3.
+
+// mkdir -p /tmp/B/lib; echo 'int f(){return 0;}' > /tmp/f.c; gcc -shared -fPIC -o /tmp/B/lib/libf.so /tmp/f.c; echo 'int f(); int main(){return f();}' > /tmp/m.c; gcc -o /tmp/m /tmp/m.c -L/tmp/B/lib -lf -Wl,--enable-new-dtags,-rpath,$(seq -s: -f /A/d%g 30):/A/lib; for p in 0 1; do rm -f stats.txt; _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_PREFETCH=$p _PATH_INTERCEPTOR_EMULATE=1 _PATH_INTERCEPTOR_STATS_FILE=stats.txt _PATH_INTERCEPTOR_MATCH_REGEX=^/A/ _PATH_INTERCEPTOR_REPLACEMENT_STRING=/tmp/B/ ./intercept-files /tmp/m; echo $?; grep -E "path_cache|prefetch" stats.txt; done
+// Loader prefetch. Both runs should exit with 0. With prefetching, the path cache should see about as many hits as lookups the loader made, and barely more misses than without.
+
+// printf '#include <sys/stat.h>\nint main(){struct stat st; int ok = 0; for (int i = 0; i < 100000; i++) ok += stat("/A/x", &st) == 0; return ok != 100000;}' > /tmp/s.c; gcc -o /tmp/s /tmp/s.c; mkdir -p /tmp/B; touch /tmp/B/x; for p in 0 1; do rm -f stats.txt; _PATH_INTERCEPTOR_DEBUG=0 _PATH_INTERCEPTOR_PATCH=$p _PATH_INTERCEPTOR_STATS_FILE=stats.txt _PATH_INTERCEPTOR_MATCH_REGEX=^/A/ _PATH_INTERCEPTOR_REPLACEMENT_STRING=/tmp/B/ ./intercept-files /tmp/s; echo $?; grep -E "^stops=|patched" stats.txt; done
+// Call site patching. Both runs should exit with 0. With patching, there should be under a hundred stops instead of 200000, and a patched site.
+
+// mkdir -p /tmp/B; echo hi > /tmp/B/x; _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_MANIFEST=manifest.json _PATH_INTERCEPTOR_MATCH_REGEX=^/A/ _PATH_INTERCEPTOR_REPLACEMENT_STRING=/tmp/B/ ./intercept-files sh -c 'for i in 1 2 3; do cat /A/x /A/nope; done'; grep '"/A/' manifest.json
+// Manifest. Should show /A/x and /A/nope once each as rewritten "open" entries, the first successful and the second not, among the unrewritten paths sh and cat looked at.
+
+// mkdir -p /tmp/S/d /tmp/T/d; touch /tmp/S/d/a /tmp/S/d/b /tmp/T/d/b /tmp/T/d/c; printf '@overlay\t^/tmp/S/\t/tmp/T/\t/tmp/S/\n' > overlay.rules; _PATH_INTERCEPTOR_THREADS=1 _PATH_INTERCEPTOR_RULES_FILE=overlay.rules ./intercept-files sh -c 'ls /tmp/S/d; ls -l /tmp/S/d/a'
+// Overlay listing. Should list a, b and c once each, and find a through the last candidate.
+
 
 int main(int argc, char **argv)
 {
 	pid_t pid;
 	int status;
 
+	if (strcmp(daemon_mode(), "serve") == 0) {
+		daemonServe(intercept_path);
+		return 0;
+	}
+
+	if (trace_replay_file()) {
+		process_signals(traceReplayOpen(), intercept_path);
+		return 0;
+	}
+
+	if (handoff_fd() >= 0) {
+		process_signals(handoffReceive(intercept_path), intercept_path);
+		return 0;
+	}
+
 	if (argc < 2) {
 		fprintf(stderr, HELP_TEXT, argv[0]);
 		return 1;
 	}
 
+	if (strcmp(daemon_mode(), "client") == 0) {
+		int exit_code = daemonClient(argv + 1);
+		if (exit_code >= 0)
+			return exit_code;
+		LOG_PRINT("No daemon running. Tracing the command here instead.\n");
+	}
+
 	if ((pid = fork()) == 0) {
 		ptrace(PTRACE_TRACEME, 0, 0, 0);
 		kill(getpid(), SIGSTOP);
+		if (patch_usable())
+			patchInstallFilter();
 		return execvp(argv[1], argv + 1);
 	} else {
-		long ptrace_options = PTRACE_O_TRACESYSGOOD;
-		if (do_trace_threads()) {
-			ptrace_options |=
-				PTRACE_O_TRACECLONE |
-				// PTRACE_O_TRACEEXEC |
-				PTRACE_O_TRACEFORK |
-				PTRACE_O_TRACEVFORK
-			;
-		}
 		waitpid(pid, &status, 0);
-		ptrace(PTRACE_SETOPTIONS, pid, 0, ptrace_options);
+		ptrace(PTRACE_SETOPTIONS, pid, 0, tracee_ptrace_options());
 		process_signals(pid, intercept_path);
 		return 0;
 	}
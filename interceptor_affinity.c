@@ -0,0 +1,209 @@
+#ifndef INTERCEPTOR_AFFINITY_C_INCL
+#define INTERCEPTOR_AFFINITY_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_pidmap.c"
+
+
+////// Tracer CPU placement:
+
+// Every stop is a context switch from the tracee to us and back. If the scheduler parks us on a different core complex than the busiest tracee, each wakeup drags its cache lines across the LLC boundary.
+// So in adaptive mode we count stops per PID, and every so often move ourselves onto the CPUs that share a last-level cache with whichever tracee has been stopping the most.
+
+static inline int affinity_adaptive() {
+	GET_AND_CACHE_ENV(affinity_flag, "_PATH_INTERCEPTOR_AFFINITY");
+	return (affinity_flag && (strcmp(affinity_flag, "1") == 0 || strcmp(affinity_flag, "adaptive") == 0));
+}
+
+static inline long affinity_interval() {
+	GET_AND_CACHE_ENV(interval_s, "_PATH_INTERCEPTOR_AFFINITY_INTERVAL");
+	long interval = env_long(interval_s, 4096);
+	return interval > 0 ? interval : 4096;
+}
+
+static PidMap_t _affinity_stop_counts;
+static int _affinity_initialized;
+static long _affinity_window_stops;
+static int _affinity_current_cpu = -1;
+// Any CPU in the set we last pinned ourselves to. Just used to avoid re-pinning to the same complex every window.
+
+
+static int _affinityTaskCpu(pid_t pid) {
+	// Field 39 of /proc/<pid>/stat is the CPU the task last ran on. Field 2 can contain spaces and parentheses, so skip to the last ')'.
+	char stat_path[64];
+	char buf[1024];
+	snprintf(stat_path, sizeof(stat_path), "/proc/%i/stat", pid);
+	FILE* f = fopen(stat_path, "r");
+	if (!f)
+		return -1;
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+	char* p = strrchr(buf, ')');
+	if (!p)
+		return -1;
+	// p+2 is field 3.
+	p += 2;
+	for (int field = 3; field < 39; field++) {
+		p = strchr(p, ' ');
+		if (!p)
+			return -1;
+		p++;
+	}
+	return strtol(p, NULL, 10);
+}
+
+static int _affinityParseCpuList(const char* list, cpu_set_t* set) {
+	// Parse sysfs cpulist format, E.G. "0-7,16-23". Returns the number of CPUs set.
+	int count = 0;
+	CPU_ZERO(set);
+	const char* p = list;
+	while (*p && *p != '\n') {
+		char* end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p)
+			break;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			p = end;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+			count++;
+		}
+		if (*p == ',')
+			p++;
+	}
+	return count;
+}
+
+static int _affinityCoreComplex(int cpu, cpu_set_t* set) {
+	// Find the CPUs sharing the highest-level cache with `cpu`. Falls back to just `cpu` itself.
+	int best_level = -1;
+	char best_list[256] = "";
+	for (int index = 0; index < 16; index++) {
+		char path[128];
+		char line[256];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/level", cpu, index);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			break;
+		int level = fgets(line, sizeof(line), f) ? strtol(line, NULL, 10) : -1;
+		fclose(f);
+		if (level <= best_level)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/shared_cpu_list", cpu, index);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(line, sizeof(line), f)) {
+			best_level = level;
+			strcpy(best_list, line);
+		}
+		fclose(f);
+	}
+	if (best_level < 0 || !_affinityParseCpuList(best_list, set)) {
+		CPU_ZERO(set);
+		CPU_SET(cpu, set);
+	}
+	return best_level;
+}
+
+static void _affinityRebalance() {
+	pid_t busiest_pid = -1;
+	int busiest_stops = 0;
+	for (int i = 0; i < _affinity_stop_counts.length; i++) {
+		PidMapEntry_t* entry = &_affinity_stop_counts._entries[i];
+		if (!entry->_valid)
+			continue;
+		if (entry->value > busiest_stops) {
+			busiest_pid = entry->key;
+			busiest_stops = entry->value;
+		}
+		entry->value = 0;
+	}
+	if (busiest_pid < 0)
+		return;
+
+	int cpu = _affinityTaskCpu(busiest_pid);
+	if (cpu < 0) {
+		DEBUG_PRINT("Could not find CPU of busiest tracee %i.\n", busiest_pid);
+		return;
+	}
+
+	cpu_set_t complex;
+	if (_affinity_current_cpu >= 0 && cpu == _affinity_current_cpu)
+		return;
+	int cache_level = _affinityCoreComplex(cpu, &complex);
+	if (_affinity_current_cpu >= 0 && CPU_ISSET(_affinity_current_cpu, &complex))
+		return;
+
+	if (sched_setaffinity(0, sizeof(complex), &complex) != 0) {
+		LOG_PRINT("ERROR: Could not set tracer CPU affinity:\n\t%s\n", strerror(errno));
+		return;
+	}
+	_affinity_current_cpu = cpu;
+	DEBUG_PRINT("Moved tracer next to busiest tracee (PID %i, %i stops, CPU %i, L%i shared CPUs).\n",
+		busiest_pid,
+		busiest_stops,
+		cpu,
+		cache_level
+	);
+}
+
+
+static void affinityInit() {
+	// Also applies the optional priority boost, which doesn't depend on adaptive mode.
+	GET_AND_CACHE_ENV(priority_s, "_PATH_INTERCEPTOR_PRIORITY");
+	if (priority_s && strlen(priority_s)) {
+		int nice_value = strtol(priority_s, NULL, 0);
+		// Plain nice values only. SCHED_FIFO/RR could let a runaway tracer lock up the machine, and we don't need it.
+		if (setpriority(PRIO_PROCESS, 0, nice_value) != 0) {
+			LOG_PRINT("ERROR: Could not set tracer priority to nice %i:\n\t%s\n\tRaising priority needs CAP_SYS_NICE or a sufficient RLIMIT_NICE.\n", nice_value, strerror(errno));
+		} else {
+			LOG_PRINT("Set tracer priority:\n\tnice %i\n", nice_value);
+		}
+	}
+	if (affinity_adaptive()) {
+		pidMapInit(&_affinity_stop_counts);
+		_affinity_initialized = 1;
+		LOG_PRINT("Adaptive tracer CPU affinity enabled:\n\tevery %li stops\n", affinity_interval());
+	}
+}
+
+static inline void affinityNoteStop(pid_t pid) {
+	if (!_affinity_initialized)
+		return;
+	if (pidMapHas(&_affinity_stop_counts, pid)) {
+		pidMapSet(&_affinity_stop_counts, pid, pidMapGet(&_affinity_stop_counts, pid) + 1);
+	} else {
+		pidMapSet(&_affinity_stop_counts, pid, 1);
+	}
+	if (++_affinity_window_stops >= affinity_interval()) {
+		_affinity_window_stops = 0;
+		_affinityRebalance();
+	}
+}
+
+static inline void affinityForget(pid_t pid) {
+	if (!_affinity_initialized)
+		return;
+	if (pidMapHas(&_affinity_stop_counts, pid))
+		pidMapRemove(&_affinity_stop_counts, pid);
+}
+
+#endif
@@ -0,0 +1,496 @@
+#ifndef INTERCEPTOR_BACKEND_C_INCL
+#define INTERCEPTOR_BACKEND_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_memory.c"
+#include "interceptor_pipeline.c"
+
+
+////// Tracing backends:
+
+// Everything the event loop and the hooks do to tracees goes through `trace_backend`, so the loop can run against something other than live ptrace.
+// "live" is ptrace() and waitpid(). With _PATH_INTERCEPTOR_RECORD, every call to it and its result are also appended to a file. _PATH_INTERCEPTOR_REPLAY feeds such a file back through the same loop without any tracees, so the loop, PID map and rewrite engine can be profiled at full speed with the same input every time.
+// Replay checks every write and resume against the recording, and stops at the first difference, so a recording is also a regression test. Anything the tracer looks up itself, like the files behind fallback rules and emulation, has to be the same as when recording.
+// Recording and replay handle stops inline, since the order of pipelined resumes depends on timing. Daemon mode can't be recorded.
+
+typedef struct {
+	const char* name;
+	pid_t (*wait)(pid_t pid, int* wstatus, int options);
+	// waitpid(), blocking unless `options` has WNOHANG.
+	long (*peek_user)(pid_t pid, int reg);
+	// Register `reg` (ORIG_RAX, RDI etc.). Like PTRACE_PEEKUSER, -1 with `errno` set on failure.
+	int (*poke_user)(pid_t pid, int reg, unsigned long value);
+	int (*get_regs)(pid_t pid, struct user_regs_struct* regs);
+	int (*set_regs)(pid_t pid, const struct user_regs_struct* regs);
+	int (*read_memory)(pid_t pid, unsigned long addr, void* buf, size_t len);
+	int (*read_string)(pid_t pid, unsigned long addr, char* buf, size_t cap, size_t* len);
+	int (*write_memory)(pid_t pid, unsigned long addr, const void* buf, size_t len);
+	int (*resume)(pid_t pid, int request, int sig);
+	// `request` is PTRACE_SYSCALL, PTRACE_CONT or PTRACE_DETACH.
+	int (*get_event_msg)(pid_t pid, unsigned long* msg);
+	pid_t (*tgid)(pid_t pid);
+	// Thread group of `pid`.
+	// All but wait(), peek_user() and tgid() return `errno` on failure, 0 otherwise.
+} TraceBackend_t;
+
+
+//// Live:
+
+static void (*_trace_live_complete)(SyscallJob_t* job);
+// Finishes pipelined jobs while waiting. See pipelineWaitPid().
+
+static pid_t _traceLiveWait(pid_t pid, int* wstatus, int options) {
+	if (pipeline_polling())
+		return pipelineWaitPid(pid, wstatus, options, _trace_live_complete);
+	return waitpid(pid, wstatus, options);
+}
+
+static long _traceLivePeekUser(pid_t pid, int reg) {
+	return ptrace(PTRACE_PEEKUSER, pid, sizeof(long)*reg, 0);
+}
+
+static int _traceLivePokeUser(pid_t pid, int reg, unsigned long value) {
+	return ptrace(PTRACE_POKEUSER, pid, sizeof(long)*reg, value) == 0 ? 0 : errno;
+}
+
+static int _traceLiveGetRegs(pid_t pid, struct user_regs_struct* regs) {
+	return ptrace(PTRACE_GETREGS, pid, 0, regs) == 0 ? 0 : errno;
+}
+
+static int _traceLiveSetRegs(pid_t pid, const struct user_regs_struct* regs) {
+	return ptrace(PTRACE_SETREGS, pid, 0, regs) == 0 ? 0 : errno;
+}
+
+static int _traceLiveResume(pid_t pid, int request, int sig) {
+	return ptrace((enum __ptrace_request)request, pid, 0, sig) == 0 ? 0 : errno;
+}
+
+static int _traceLiveGetEventMsg(pid_t pid, unsigned long* msg) {
+	return ptrace(PTRACE_GETEVENTMSG, pid, 0, msg) == 0 ? 0 : errno;
+}
+
+static pid_t _traceLiveTgid(pid_t pid) {
+	char status_path[64];
+	char line[256];
+	pid_t tgid = pid;
+	snprintf(status_path, sizeof(status_path), "/proc/%i/status", pid);
+	FILE* f = fopen(status_path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "Tgid:", 5) == 0) {
+				tgid = strtol(line + 5, NULL, 10);
+				break;
+			}
+		}
+		fclose(f);
+	}
+	return tgid;
+}
+
+static const TraceBackend_t trace_backend_live = {
+	.name = "live",
+	.wait = _traceLiveWait,
+	.peek_user = _traceLivePeekUser,
+	.poke_user = _traceLivePokeUser,
+	.get_regs = _traceLiveGetRegs,
+	.set_regs = _traceLiveSetRegs,
+	.read_memory = read_tracee_memory,
+	.read_string = read_tracee_string,
+	.write_memory = write_tracee_memory,
+	.resume = _traceLiveResume,
+	.get_event_msg = _traceLiveGetEventMsg,
+	.tgid = _traceLiveTgid,
+};
+
+static const TraceBackend_t* trace_backend = &trace_backend_live;
+
+
+//// Recording format:
+
+// A _TraceRecordHeader_t, then one _TraceRecord_t per call, each followed by `data_len` bytes. Native byte order, since recordings are replayed on the machine they're made on.
+
+#define _TRACE_RECORD_MAGIC 0x31434552534649ULL
+// "IFSREC1".
+
+typedef struct {
+	uint64_t magic;
+	int32_t main_pid;
+	int32_t _pad;
+} _TraceRecordHeader_t;
+
+typedef enum {
+	_TRACE_OP_WAIT = 1,
+	_TRACE_OP_PEEK_USER,
+	_TRACE_OP_POKE_USER,
+	_TRACE_OP_GET_REGS,
+	_TRACE_OP_SET_REGS,
+	_TRACE_OP_READ_MEMORY,
+	_TRACE_OP_READ_STRING,
+	_TRACE_OP_WRITE_MEMORY,
+	_TRACE_OP_RESUME,
+	_TRACE_OP_GET_EVENT_MSG,
+	_TRACE_OP_TGID,
+} _TraceOp_t;
+
+static const char* _TraceOpNames[] = { "?", "wait", "peek_user", "poke_user", "get_regs", "set_regs", "read_memory", "read_string", "write_memory", "resume", "get_event_msg", "tgid" };
+
+typedef struct {
+	uint32_t op;
+	int32_t pid;
+	int64_t arg;
+	int64_t arg2;
+	// Inputs: the register, address or request, and the value, length or signal, depending on the op. See the _traceRecord*() functions.
+	int64_t result;
+	int32_t err;
+	// `errno` after the call, for the ops that set it.
+	uint32_t data_len;
+	// Bytes read or written, registers, or the wait status.
+} _TraceRecord_t;
+
+static inline const char* trace_record_file() {
+	GET_AND_CACHE_ENV(record_s, "_PATH_INTERCEPTOR_RECORD");
+	return (record_s && strlen(record_s)) ? record_s : NULL;
+}
+
+static inline const char* trace_replay_file() {
+	GET_AND_CACHE_ENV(replay_s, "_PATH_INTERCEPTOR_REPLAY");
+	return (replay_s && strlen(replay_s)) ? replay_s : NULL;
+}
+
+
+//// Recording:
+
+static FILE* _trace_record_file;
+
+static void _traceRecord(_TraceOp_t op, pid_t pid, int64_t arg, int64_t arg2, int64_t result, int err, const void* data, size_t data_len) {
+	_TraceRecord_t record = {
+		.op = op,
+		.pid = pid,
+		.arg = arg,
+		.arg2 = arg2,
+		.result = result,
+		.err = err,
+		.data_len = data_len,
+	};
+	if (fwrite(&record, sizeof(record), 1, _trace_record_file) != 1 || (data_len && fwrite(data, data_len, 1, _trace_record_file) != 1)) {
+		LOG_PRINT("ERROR: Could not write to the recording:\n\t%s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static pid_t _traceRecordWait(pid_t pid, int* wstatus, int options) {
+	pid_t changed_pid = trace_backend_live.wait(pid, wstatus, options);
+	_traceRecord(_TRACE_OP_WAIT, pid, options, 0, changed_pid, errno, wstatus, sizeof(*wstatus));
+	return changed_pid;
+}
+
+static long _traceRecordPeekUser(pid_t pid, int reg) {
+	errno = 0;
+	long value = trace_backend_live.peek_user(pid, reg);
+	int err = errno;
+	_traceRecord(_TRACE_OP_PEEK_USER, pid, reg, 0, value, err, NULL, 0);
+	errno = err;
+	return value;
+}
+
+static int _traceRecordPokeUser(pid_t pid, int reg, unsigned long value) {
+	int result = trace_backend_live.poke_user(pid, reg, value);
+	_traceRecord(_TRACE_OP_POKE_USER, pid, reg, value, result, 0, NULL, 0);
+	return result;
+}
+
+static int _traceRecordGetRegs(pid_t pid, struct user_regs_struct* regs) {
+	int result = trace_backend_live.get_regs(pid, regs);
+	_traceRecord(_TRACE_OP_GET_REGS, pid, 0, 0, result, 0, regs, result ? 0 : sizeof(*regs));
+	return result;
+}
+
+static int _traceRecordSetRegs(pid_t pid, const struct user_regs_struct* regs) {
+	int result = trace_backend_live.set_regs(pid, regs);
+	_traceRecord(_TRACE_OP_SET_REGS, pid, 0, 0, result, 0, regs, sizeof(*regs));
+	return result;
+}
+
+static int _traceRecordReadMemory(pid_t pid, unsigned long addr, void* buf, size_t len) {
+	int result = trace_backend_live.read_memory(pid, addr, buf, len);
+	_traceRecord(_TRACE_OP_READ_MEMORY, pid, addr, len, result, 0, buf, result ? 0 : len);
+	return result;
+}
+
+static int _traceRecordReadString(pid_t pid, unsigned long addr, char* buf, size_t cap, size_t* len) {
+	int result = trace_backend_live.read_string(pid, addr, buf, cap, len);
+	_traceRecord(_TRACE_OP_READ_STRING, pid, addr, cap, result, 0, buf, *len);
+	return result;
+}
+
+static int _traceRecordWriteMemory(pid_t pid, unsigned long addr, const void* buf, size_t len) {
+	int result = trace_backend_live.write_memory(pid, addr, buf, len);
+	_traceRecord(_TRACE_OP_WRITE_MEMORY, pid, addr, len, result, 0, buf, len);
+	return result;
+}
+
+static int _traceRecordResume(pid_t pid, int request, int sig) {
+	int result = trace_backend_live.resume(pid, request, sig);
+	_traceRecord(_TRACE_OP_RESUME, pid, request, sig, result, 0, NULL, 0);
+	return result;
+}
+
+static int _traceRecordGetEventMsg(pid_t pid, unsigned long* msg) {
+	int result = trace_backend_live.get_event_msg(pid, msg);
+	_traceRecord(_TRACE_OP_GET_EVENT_MSG, pid, 0, *msg, result, 0, NULL, 0);
+	return result;
+}
+
+static pid_t _traceRecordTgid(pid_t pid) {
+	pid_t tgid = trace_backend_live.tgid(pid);
+	_traceRecord(_TRACE_OP_TGID, pid, 0, 0, tgid, 0, NULL, 0);
+	return tgid;
+}
+
+static const TraceBackend_t trace_backend_record = {
+	.name = "record",
+	.wait = _traceRecordWait,
+	.peek_user = _traceRecordPeekUser,
+	.poke_user = _traceRecordPokeUser,
+	.get_regs = _traceRecordGetRegs,
+	.set_regs = _traceRecordSetRegs,
+	.read_memory = _traceRecordReadMemory,
+	.read_string = _traceRecordReadString,
+	.write_memory = _traceRecordWriteMemory,
+	.resume = _traceRecordResume,
+	.get_event_msg = _traceRecordGetEventMsg,
+	.tgid = _traceRecordTgid,
+};
+
+
+//// Replay:
+
+static const char* _trace_replay;
+static size_t _trace_replay_len;
+static size_t _trace_replay_pos;
+static size_t _trace_replay_records;
+static int _trace_replay_diverged;
+// The whole recording is mapped, so replay doesn't measure file reads.
+
+static const _TraceRecord_t* _traceReplayNext(_TraceOp_t op, pid_t pid, int64_t arg, const void** data) {
+	// Take the next record, which has to be `op` on `pid` with `arg`. Exits otherwise, since the loop has diverged from the recording and nothing after can be trusted.
+	if (_trace_replay_pos + sizeof(_TraceRecord_t) > _trace_replay_len) {
+		LOG_PRINT("ERROR: Replay ran past the end of the recording, after %zu records, asking for %s (PID %i).\n", _trace_replay_records, _TraceOpNames[op], pid);
+		_trace_replay_diverged = 1;
+		exit(1);
+	}
+	const _TraceRecord_t* record = (const _TraceRecord_t*)(_trace_replay + _trace_replay_pos);
+	if (record->op != op || record->pid != pid || record->arg != arg) {
+		LOG_PRINT("ERROR: Replay diverged from the recording at record %zu:\n\trecorded %s (PID %i, %#lx)\n\treplayed %s (PID %i, %#lx)\n",
+			_trace_replay_records,
+			record->op < sizeof(_TraceOpNames) / sizeof(_TraceOpNames[0]) ? _TraceOpNames[record->op] : "?",
+			record->pid,
+			(long)record->arg,
+			_TraceOpNames[op],
+			pid,
+			(long)arg
+		);
+		_trace_replay_diverged = 1;
+		exit(1);
+	}
+	if (_trace_replay_pos + sizeof(_TraceRecord_t) + record->data_len > _trace_replay_len) {
+		LOG_PRINT("ERROR: Replay ran past the end of the recording at record %zu: %s (PID %i) has %u bytes of data, but only %zu are left.\n", _trace_replay_records, _TraceOpNames[op], pid, record->data_len, _trace_replay_len - _trace_replay_pos - sizeof(_TraceRecord_t));
+		_trace_replay_diverged = 1;
+		exit(1);
+	}
+	*data = _trace_replay + _trace_replay_pos + sizeof(_TraceRecord_t);
+	_trace_replay_pos += sizeof(_TraceRecord_t) + record->data_len;
+	_trace_replay_records++;
+	return record;
+}
+
+static void _traceReplayCheck(const _TraceRecord_t* record, int same, const char* what) {
+	if (!same) {
+		LOG_PRINT("ERROR: Replay diverged from the recording at record %zu:\n\t%s (PID %i, %#lx) with different %s\n",
+			_trace_replay_records - 1,
+			_TraceOpNames[record->op],
+			record->pid,
+			(long)record->arg,
+			what
+		);
+		_trace_replay_diverged = 1;
+		exit(1);
+	}
+}
+
+static pid_t _traceReplayWait(pid_t pid, int* wstatus, int options) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_WAIT, pid, options, &data);
+	_traceReplayCheck(record, record->data_len == sizeof(*wstatus), "status size");
+	memcpy(wstatus, data, sizeof(*wstatus));
+	errno = record->err;
+	return record->result;
+}
+
+static long _traceReplayPeekUser(pid_t pid, int reg) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_PEEK_USER, pid, reg, &data);
+	errno = record->err;
+	return record->result;
+}
+
+static int _traceReplayPokeUser(pid_t pid, int reg, unsigned long value) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_POKE_USER, pid, reg, &data);
+	_traceReplayCheck(record, record->arg2 == (int64_t)value, "value");
+	return record->result;
+}
+
+static int _traceReplayGetRegs(pid_t pid, struct user_regs_struct* regs) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_GET_REGS, pid, 0, &data);
+	if (record->data_len == sizeof(*regs))
+		memcpy(regs, data, sizeof(*regs));
+	return record->result;
+}
+
+static int _traceReplaySetRegs(pid_t pid, const struct user_regs_struct* regs) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_SET_REGS, pid, 0, &data);
+	_traceReplayCheck(record, record->data_len == sizeof(*regs) && memcmp(data, regs, sizeof(*regs)) == 0, "registers");
+	return record->result;
+}
+
+static int _traceReplayReadMemory(pid_t pid, unsigned long addr, void* buf, size_t len) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_READ_MEMORY, pid, addr, &data);
+	_traceReplayCheck(record, record->arg2 == (int64_t)len && record->data_len <= len, "length");
+	memcpy(buf, data, record->data_len);
+	return record->result;
+}
+
+static int _traceReplayReadString(pid_t pid, unsigned long addr, char* buf, size_t cap, size_t* len) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_READ_STRING, pid, addr, &data);
+	_traceReplayCheck(record, record->arg2 == (int64_t)cap && record->data_len < cap, "capacity");
+	memcpy(buf, data, record->data_len);
+	buf[record->data_len] = '\0';
+	*len = record->data_len;
+	return record->result;
+}
+
+static int _traceReplayWriteMemory(pid_t pid, unsigned long addr, const void* buf, size_t len) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_WRITE_MEMORY, pid, addr, &data);
+	_traceReplayCheck(record, record->data_len == len && memcmp(data, buf, len) == 0, "data");
+	return record->result;
+}
+
+static int _traceReplayResume(pid_t pid, int request, int sig) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_RESUME, pid, request, &data);
+	_traceReplayCheck(record, record->arg2 == sig, "signal");
+	return record->result;
+}
+
+static int _traceReplayGetEventMsg(pid_t pid, unsigned long* msg) {
+	const void* data;
+	const _TraceRecord_t* record = _traceReplayNext(_TRACE_OP_GET_EVENT_MSG, pid, 0, &data);
+	*msg = record->arg2;
+	return record->result;
+}
+
+static pid_t _traceReplayTgid(pid_t pid) {
+	const void* data;
+	return _traceReplayNext(_TRACE_OP_TGID, pid, 0, &data)->result;
+}
+
+static const TraceBackend_t trace_backend_replay = {
+	.name = "replay",
+	.wait = _traceReplayWait,
+	.peek_user = _traceReplayPeekUser,
+	.poke_user = _traceReplayPokeUser,
+	.get_regs = _traceReplayGetRegs,
+	.set_regs = _traceReplaySetRegs,
+	.read_memory = _traceReplayReadMemory,
+	.read_string = _traceReplayReadString,
+	.write_memory = _traceReplayWriteMemory,
+	.resume = _traceReplayResume,
+	.get_event_msg = _traceReplayGetEventMsg,
+	.tgid = _traceReplayTgid,
+};
+
+static void _traceReplayDone() {
+	LOG_PRINT("Replayed %zu records.\n", _trace_replay_records);
+	if (!_trace_replay_diverged && _trace_replay_pos != _trace_replay_len)
+		LOG_PRINT("ERROR: The tracer finished before the recording did, with %zu bytes left.\n", _trace_replay_len - _trace_replay_pos);
+}
+
+
+//// Setup:
+
+static pid_t traceReplayOpen() {
+	// Switch to the replay backend. Returns the main target's PID from the recording.
+	const char* replay_filepath = trace_replay_file();
+	int fd = open(replay_filepath, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(_TraceRecordHeader_t)) {
+		LOG_PRINT("ERROR: Could not open recording:\n\t%s\n", replay_filepath);
+		exit(1);
+	}
+	_trace_replay = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	const _TraceRecordHeader_t* header = (const _TraceRecordHeader_t*)_trace_replay;
+	if (_trace_replay == MAP_FAILED || header->magic != _TRACE_RECORD_MAGIC) {
+		LOG_PRINT("ERROR: Not a recording:\n\t%s\n", replay_filepath);
+		exit(1);
+	}
+	_trace_replay_len = st.st_size;
+	_trace_replay_pos = sizeof(_TraceRecordHeader_t);
+	trace_backend = &trace_backend_replay;
+	atexit(_traceReplayDone);
+	LOG_PRINT("Replaying recording:\n\t%s\n", replay_filepath);
+	return header->main_pid;
+}
+
+static void traceBackendInit(pid_t child, void (*complete)(SyscallJob_t* job)) {
+	// Pick the backend for process_signals(). `complete` finishes pipelined jobs for the live one.
+	_trace_live_complete = complete;
+	if (trace_backend != &trace_backend_live || !trace_record_file())
+		return;
+	if (!child) {
+		LOG_PRINT("ERROR: Daemon mode can't be recorded.\n");
+		exit(1);
+	}
+	_trace_record_file = fopen(trace_record_file(), "w");
+	if (!_trace_record_file) {
+		LOG_PRINT("ERROR: Could not open recording file:\n\t%s\n\t%s\n", trace_record_file(), strerror(errno));
+		exit(1);
+	}
+	setvbuf(_trace_record_file, NULL, _IOFBF, 1 << 20);
+	// Flushed by exit(), which is how process_signals() ends.
+	_TraceRecordHeader_t header = { .magic = _TRACE_RECORD_MAGIC, .main_pid = child };
+	fwrite(&header, sizeof(header), 1, _trace_record_file);
+	trace_backend = &trace_backend_record;
+	LOG_PRINT("Recording to:\n\t%s\n", trace_record_file());
+}
+
+static inline int trace_backend_pipelinable() {
+	// Whether pipelined mode can be used. See the top of this file.
+	return trace_backend == &trace_backend_live;
+}
+
+#endif
@@ -16,4 +16,12 @@ static inline int do_trace_threads() {
 	return (threads_flag && strcmp(threads_flag, "1") == 0);
 }
 
+static inline long env_long(const char* value, long default_value) {
+	// For integer-valued environment variables. Unset and empty both mean the default.
+	if (value && strlen(value)) {
+		return strtol(value, NULL, 0);
+	}
+	return default_value;
+}
+
 #endif
@@ -0,0 +1,506 @@
+#ifndef INTERCEPTOR_DAEMON_C_INCL
+#define INTERCEPTOR_DAEMON_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <linux/limits.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_replace.h"
+#include "interceptor_trace.c"
+
+
+////// Daemon mode:
+
+// Every `intercept-files` run pays for process startup, parsing the rules, compiling regexes and starting with cold caches. Build scripts can launch thousands of them.
+// With _PATH_INTERCEPTOR_DAEMON=serve, one tracer listens on a Unix socket instead, and keeps all of that between commands.
+// With _PATH_INTERCEPTOR_DAEMON=client, `intercept-files` just sends its command line, environment, working directory and stdio to the daemon, waits, and exits with whatever the command exited with.
+// The daemon forks the command itself and traces it in the same loop as everything else, so each command costs about a fork and an exec.
+// Rules and all other _PATH_INTERCEPTOR_* configuration come from the daemon's environment. The client's environment is only passed to the command.
+
+#define _DAEMON_MAGIC 0x49464431
+// "IFD1". Bump along with DaemonRequestHeader_t.
+
+typedef struct {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t payload_len;
+	// Followed by `payload_len` bytes: the working directory, then `argc` arguments, then `envc` environment entries, all NUL-terminated.
+	// Stdin, stdout and stderr come along with the header through SCM_RIGHTS.
+} DaemonRequestHeader_t;
+
+#define _DAEMON_MAX_PAYLOAD (16 * 1024 * 1024)
+
+// After the request, the client can send single bytes with signal numbers to forward to the command. The daemon answers with one int32_t, the exit code.
+
+typedef struct {
+	int _valid;
+	pid_t pid;
+	int client_fd;
+	// -1 once the client's gone.
+} DaemonCommand_t;
+
+typedef struct {
+	int _valid;
+	int client_fd;
+	DaemonRequestHeader_t header;
+	size_t header_got;
+	int stdio_fds[3];
+	// -1 until they come along with the header.
+	char* payload;
+	size_t payload_got;
+} DaemonRequest_t;
+// A client that's connected, but hasn't sent all of its request yet.
+
+static DaemonCommand_t* _daemon_commands;
+static int _daemon_commands_l;
+static DaemonRequest_t* _daemon_requests;
+static int _daemon_requests_l;
+static int _daemon_listen_fd = -1;
+
+static inline const char* daemon_mode() {
+	GET_AND_CACHE_ENV(daemon_s, "_PATH_INTERCEPTOR_DAEMON");
+	return daemon_s ? daemon_s : "";
+}
+
+static const char* daemon_socket_path() {
+	GET_AND_CACHE_ENV(socket_s, "_PATH_INTERCEPTOR_DAEMON_SOCKET");
+	static char default_path[PATH_MAX];
+	if (socket_s && strlen(socket_s))
+		return socket_s;
+	if (!default_path[0]) {
+		const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+		if (runtime_dir && strlen(runtime_dir)) {
+			snprintf(default_path, sizeof(default_path), "%s/intercept-files.sock", runtime_dir);
+		} else {
+			snprintf(default_path, sizeof(default_path), "/tmp/intercept-files-%u.sock", getuid());
+		}
+	}
+	return default_path;
+}
+
+static int _daemonSocketAddress(struct sockaddr_un* addr) {
+	const char* socket_path = daemon_socket_path();
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+		LOG_PRINT("ERROR: Daemon socket path is too long:\n\t%s\n", socket_path);
+		return 0;
+	}
+	strcpy(addr->sun_path, socket_path);
+	return 1;
+}
+
+static int _daemonReadAll(int fd, void* buf, size_t len) {
+	char* p = (char*)buf;
+	while (len) {
+		ssize_t got = read(fd, p, len);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return 0;
+		p += got;
+		len -= got;
+	}
+	return 1;
+}
+
+static int _daemonWriteAll(int fd, const void* buf, size_t len) {
+	const char* p = (const char*)buf;
+	while (len) {
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return 0;
+		p += sent;
+		len -= sent;
+	}
+	return 1;
+}
+
+
+//// Server:
+
+static DaemonCommand_t* _daemonFindCommand(pid_t pid, int client_fd) {
+	// Look up by either.
+	for (int i = 0; i < _daemon_commands_l; i++) {
+		DaemonCommand_t* command = &_daemon_commands[i];
+		if (command->_valid && ((pid && command->pid == pid) || (client_fd >= 0 && command->client_fd == client_fd)))
+			return command;
+	}
+	return NULL;
+}
+
+static DaemonCommand_t* _daemonNewCommand() {
+	for (int i = 0; i < _daemon_commands_l; i++) {
+		if (!_daemon_commands[i]._valid)
+			return &_daemon_commands[i];
+	}
+	_daemon_commands = (DaemonCommand_t*)realloc(_daemon_commands, sizeof(DaemonCommand_t) * (_daemon_commands_l + 1));
+	return &_daemon_commands[_daemon_commands_l++];
+}
+
+static void _daemonDropClient(DaemonCommand_t* command) {
+	pipelineUnwatchFd(command->client_fd);
+	close(command->client_fd);
+	command->client_fd = -1;
+}
+
+static void _daemonTaskExited(pid_t pid, int exit_code) {
+	// tracer_task_exit_hook. Relay the exit code if `pid` is a command's main process.
+	DaemonCommand_t* command = _daemonFindCommand(pid, -1);
+	if (!command)
+		return;
+	LOG_PRINT("Daemon command finished:\n\t%i %i\n", pid, exit_code);
+	if (command->client_fd >= 0) {
+		int32_t code = exit_code;
+		_daemonWriteAll(command->client_fd, &code, sizeof(code));
+		_daemonDropClient(command);
+	}
+	command->_valid = 0;
+}
+
+static void _daemonClientReady(int client_fd, short revents) {
+	// Forwarded signals, or the client going away.
+	DaemonCommand_t* command = _daemonFindCommand(0, client_fd);
+	if (!command) {
+		pipelineUnwatchFd(client_fd);
+		close(client_fd);
+		return;
+	}
+	unsigned char sig;
+	ssize_t got = (revents & POLLIN) ? read(client_fd, &sig, 1) : 0;
+	if (got < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (got == 1) {
+		DEBUG_PRINT("Forwarding signal %i to daemon command %i.\n", sig, command->pid);
+		kill(-command->pid, sig);
+		return;
+	}
+	// Like a terminal closing on it.
+	LOG_PRINT("Daemon client went away. Hanging up on command:\n\t%i\n", command->pid);
+	kill(-command->pid, SIGHUP);
+	_daemonDropClient(command);
+}
+
+static DaemonRequest_t* _daemonFindRequest(int client_fd) {
+	for (int i = 0; i < _daemon_requests_l; i++) {
+		if (_daemon_requests[i]._valid && _daemon_requests[i].client_fd == client_fd)
+			return &_daemon_requests[i];
+	}
+	return NULL;
+}
+
+static DaemonRequest_t* _daemonNewRequest(int client_fd) {
+	DaemonRequest_t* request = NULL;
+	for (int i = 0; i < _daemon_requests_l && !request; i++) {
+		if (!_daemon_requests[i]._valid)
+			request = &_daemon_requests[i];
+	}
+	if (!request) {
+		_daemon_requests = (DaemonRequest_t*)realloc(_daemon_requests, sizeof(DaemonRequest_t) * (_daemon_requests_l + 1));
+		request = &_daemon_requests[_daemon_requests_l++];
+	}
+	*request = (DaemonRequest_t){ ._valid = 1, .client_fd = client_fd, .stdio_fds = { -1, -1, -1 } };
+	return request;
+}
+
+static void _daemonFreeRequest(DaemonRequest_t* request) {
+	// Leaves `client_fd` alone.
+	for (int i = 0; i < 3; i++) {
+		if (request->stdio_fds[i] >= 0)
+			close(request->stdio_fds[i]);
+	}
+	free(request->payload);
+	request->_valid = 0;
+}
+
+static int _daemonReadRequest(DaemonRequest_t* request) {
+	// Reads whatever's arrived without blocking. 1 once the whole request is in, 0 if there's more to come, -1 if it's malformed or the client went away.
+	while (request->header_got < sizeof(request->header)) {
+		char control[CMSG_SPACE(sizeof(int) * 3)];
+		struct iovec iov = { .iov_base = (char*)&request->header + request->header_got, .iov_len = sizeof(request->header) - request->header_got };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		ssize_t got = recvmsg(request->client_fd, &msg, MSG_CMSG_CLOEXEC);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && errno == EAGAIN)
+			return 0;
+		if (got <= 0 || (msg.msg_flags & MSG_CTRUNC))
+			return -1;
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			int fds_l = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (fds_l != 3 || request->stdio_fds[0] >= 0) {
+				for (int i = 0; i < fds_l; i++)
+					close(((int*)CMSG_DATA(cmsg))[i]);
+				return -1;
+			}
+			memcpy(request->stdio_fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+		}
+		request->header_got += got;
+	}
+	if (!request->payload) {
+		const DaemonRequestHeader_t* header = &request->header;
+		if (header->magic != _DAEMON_MAGIC || request->stdio_fds[0] < 0 || header->payload_len > _DAEMON_MAX_PAYLOAD || !header->argc)
+			return -1;
+		request->payload = (char*)malloc(header->payload_len + 1);
+	}
+	while (request->payload_got < request->header.payload_len) {
+		ssize_t got = read(request->client_fd, request->payload + request->payload_got, request->header.payload_len - request->payload_got);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && errno == EAGAIN)
+			return 0;
+		if (got <= 0)
+			return -1;
+		request->payload_got += got;
+	}
+	request->payload[request->header.payload_len] = '\0';
+	return 1;
+}
+
+static pid_t _daemonSpawn(const DaemonRequestHeader_t* header, const int* stdio_fds, char* payload) {
+	// Split the payload into the working directory, argv and envp.
+	char** strings = (char**)malloc(sizeof(char*) * (header->argc + 1 + header->envc + 1));
+	char* end = payload + header->payload_len;
+	char* cwd = payload;
+	char* p = cwd + strlen(cwd) + 1;
+	uint32_t strings_l = header->argc + header->envc;
+	for (uint32_t i = 0; i < strings_l; i++) {
+		if (p >= end) {
+			free(strings);
+			return -1;
+		}
+		strings[i < header->argc ? i : i + 1] = p;
+		p += strlen(p) + 1;
+	}
+	char** argv = strings;
+	char** envp = strings + header->argc + 1;
+	argv[header->argc] = NULL;
+	envp[header->envc] = NULL;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		sigset_t all_signals;
+		sigfillset(&all_signals);
+		sigprocmask(SIG_UNBLOCK, &all_signals, NULL);
+		for (int i = 0; i < 3; i++)
+			dup2(stdio_fds[i], i);
+		setpgid(0, 0);
+		// Own process group, so forwarded signals reach the whole command like they would from a terminal.
+		if (chdir(cwd) != 0) {
+			fprintf(stderr, "intercept-files: %s: %s\n", cwd, strerror(errno));
+			_exit(127);
+		}
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		kill(getpid(), SIGSTOP);
+		execvpe(argv[0], argv, envp);
+		fprintf(stderr, "intercept-files: %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	free(strings);
+	return pid;
+}
+
+static void _daemonStart(DaemonRequest_t* request) {
+	int client_fd = request->client_fd;
+	pid_t pid = _daemonSpawn(&request->header, request->stdio_fds, request->payload);
+	_daemonFreeRequest(request);
+	if (pid < 0) {
+		LOG_PRINT("ERROR: Could not start daemon command.\n");
+		int32_t code = 127;
+		_daemonWriteAll(client_fd, &code, sizeof(code));
+		close(client_fd);
+		return;
+	}
+
+	start_tracee(pid);
+	LOG_PRINT("Starting daemon command:\n\t%i\n", pid);
+
+	DaemonCommand_t* command = _daemonNewCommand();
+	command->_valid = 1;
+	command->pid = pid;
+	command->client_fd = client_fd;
+	pipelineWatchFd(client_fd, _daemonClientReady);
+}
+
+static void _daemonRequestReady(int client_fd, short revents) {
+	// More of a request. Everything else keeps being traced while a slow client takes its time.
+	DaemonRequest_t* request = _daemonFindRequest(client_fd);
+	if (!request) {
+		pipelineUnwatchFd(client_fd);
+		close(client_fd);
+		return;
+	}
+	int done = _daemonReadRequest(request);
+	if (done == 0)
+		return;
+	pipelineUnwatchFd(client_fd);
+	if (done < 0) {
+		LOG_PRINT("ERROR: Malformed daemon request. Dropping client.\n");
+		_daemonFreeRequest(request);
+		close(client_fd);
+		return;
+	}
+	_daemonStart(request);
+}
+
+static void _daemonAccept(int listen_fd, short revents) {
+	int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client_fd < 0)
+		return;
+
+	struct ucred peer;
+	socklen_t peer_len = sizeof(peer);
+	if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 || peer.uid != getuid()) {
+		LOG_PRINT("ERROR: Rejecting daemon client from another user.\n");
+		close(client_fd);
+		return;
+	}
+
+	_daemonNewRequest(client_fd);
+	pipelineWatchFd(client_fd, _daemonRequestReady);
+}
+
+static void daemonServe(PathReplacer_t replacer) {
+	// Never returns.
+	struct sockaddr_un addr;
+	if (!_daemonSocketAddress(&addr))
+		exit(1);
+
+	_daemon_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connect(_daemon_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		LOG_PRINT("ERROR: A daemon is already listening on:\n\t%s\n", addr.sun_path);
+		exit(1);
+	}
+	close(_daemon_listen_fd);
+	unlink(addr.sun_path);
+	// Nobody's listening, so whatever's there is left over from a daemon that was killed.
+
+	_daemon_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	mode_t orig_umask = umask(0077);
+	int bind_return = bind(_daemon_listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(orig_umask);
+	if (bind_return != 0 || listen(_daemon_listen_fd, 64) != 0) {
+		LOG_PRINT("ERROR: Could not listen on daemon socket:\n\t%s\n\t%s\n", addr.sun_path, strerror(errno));
+		exit(1);
+	}
+	fcntl(_daemon_listen_fd, F_SETFL, O_NONBLOCK);
+
+	LOG_PRINT("Daemon listening on:\n\t%s\n", addr.sun_path);
+
+	tracer_task_exit_hook = _daemonTaskExited;
+	pipelineWatchFd(_daemon_listen_fd, _daemonAccept);
+	process_signals(0, replacer);
+}
+
+
+//// Client:
+
+static int _daemon_client_fd = -1;
+
+static void _daemonClientForwardSignal(int sig) {
+	unsigned char sig_byte = sig;
+	send(_daemon_client_fd, &sig_byte, 1, MSG_NOSIGNAL);
+}
+
+static int daemonClient(char** argv) {
+	// Returns the command's exit code, or -1 if there's no daemon to talk to.
+	extern char** environ;
+
+	struct sockaddr_un addr;
+	if (!_daemonSocketAddress(&addr))
+		return -1;
+	_daemon_client_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connect(_daemon_client_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		DEBUG_PRINT("No daemon listening on %s: %s\n", addr.sun_path, strerror(errno));
+		close(_daemon_client_fd);
+		return -1;
+	}
+
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		LOG_PRINT("ERROR: Could not get working directory for daemon:\n\t%s\n", strerror(errno));
+		exit(1);
+	}
+
+	DaemonRequestHeader_t header = { .magic = _DAEMON_MAGIC };
+	size_t payload_len = strlen(cwd) + 1;
+	for (char** arg = argv; *arg; arg++, header.argc++)
+		payload_len += strlen(*arg) + 1;
+	for (char** env = environ; *env; env++, header.envc++)
+		payload_len += strlen(*env) + 1;
+	header.payload_len = payload_len;
+
+	char* payload = (char*)malloc(payload_len);
+	char* p = payload;
+	#define _APPEND_STRING(S) \
+		{ size_t _len = strlen(S) + 1; memcpy(p, S, _len); p += _len; }
+	_APPEND_STRING(cwd);
+	for (char** arg = argv; *arg; arg++)
+		_APPEND_STRING(*arg);
+	for (char** env = environ; *env; env++)
+		_APPEND_STRING(*env);
+	#undef _APPEND_STRING
+
+	int stdio_fds[3] = { 0, 1, 2 };
+	char control[CMSG_SPACE(sizeof(stdio_fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(stdio_fds));
+	memcpy(CMSG_DATA(cmsg), stdio_fds, sizeof(stdio_fds));
+
+	if (sendmsg(_daemon_client_fd, &msg, MSG_NOSIGNAL) != sizeof(header) || !_daemonWriteAll(_daemon_client_fd, payload, payload_len)) {
+		LOG_PRINT("ERROR: Could not send command to daemon:\n\t%s\n", strerror(errno));
+		exit(1);
+	}
+	free(payload);
+
+	// The command isn't in our process group, so pass on what the terminal and others send us.
+	struct sigaction forward = { .sa_handler = _daemonClientForwardSignal, .sa_flags = SA_RESTART };
+	sigaction(SIGINT, &forward, NULL);
+	sigaction(SIGTERM, &forward, NULL);
+	sigaction(SIGHUP, &forward, NULL);
+	sigaction(SIGQUIT, &forward, NULL);
+
+	int32_t code;
+	if (!_daemonReadAll(_daemon_client_fd, &code, sizeof(code))) {
+		LOG_PRINT("ERROR: Daemon went away before the command finished.\n");
+		return 1;
+	}
+	return code;
+}
+
+#endif
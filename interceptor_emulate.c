@@ -0,0 +1,199 @@
+#ifndef INTERCEPTOR_EMULATE_C_INCL
+#define INTERCEPTOR_EMULATE_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_memory.c"
+#include "interceptor_pathcache.c"
+#include "interceptor_replace.h"
+#include "interceptor_stats.c"
+#include "interceptor_trace_types.h"
+
+
+////// Syscall emulation:
+
+// Dynamic loaders, Qt and Chromium probe huge numbers of paths with access(), stat() and friends, and most of those probes just fail. Each costs two stops plus the rewrite, and then the kernel's own lookup.
+// With _PATH_INTERCEPTOR_EMULATE=1, the tracer answers the most common of these itself for rewritten paths, from the metadata cache in interceptor_pathcache.c. At the syscall-enter-stop, the result struct is written into the tracee, and the syscall number is set to -1 along with the return value. The kernel skips syscall -1 without touching RAX, so the syscall-exit-stop has nothing left to do.
+// The stops themselves can't be avoided, since PTRACE_SYSEMU can't be chosen per syscall. What goes away is the kernel's own path walk, which is what matters on deep trees and slow filesystems. So everything here is kept to a couple of ptrace() calls.
+// Only absolute rewritten paths are emulated, and only flag combinations whose answer doesn't depend on anything but the path. Positive stat results for directories go to the kernel, since the cache can't see changes inside them.
+// open() and openat() can only be answered when they'd fail for a missing path, which is what most of the loader's library search does. See interceptor_prefetch.c.
+
+static inline int emulate_enabled() {
+	GET_AND_CACHE_ENV(emulate_s, "_PATH_INTERCEPTOR_EMULATE");
+	return (emulate_s && strcmp(emulate_s, "1") == 0);
+}
+
+
+static void _emulateStatFromStatx(const struct statx* statxbuf, struct stat* statbuf) {
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_dev = makedev(statxbuf->stx_dev_major, statxbuf->stx_dev_minor);
+	statbuf->st_ino = statxbuf->stx_ino;
+	statbuf->st_nlink = statxbuf->stx_nlink;
+	statbuf->st_mode = statxbuf->stx_mode;
+	statbuf->st_uid = statxbuf->stx_uid;
+	statbuf->st_gid = statxbuf->stx_gid;
+	statbuf->st_rdev = makedev(statxbuf->stx_rdev_major, statxbuf->stx_rdev_minor);
+	statbuf->st_size = statxbuf->stx_size;
+	statbuf->st_blksize = statxbuf->stx_blksize;
+	statbuf->st_blocks = statxbuf->stx_blocks;
+	statbuf->st_atim.tv_sec = statxbuf->stx_atime.tv_sec;
+	statbuf->st_atim.tv_nsec = statxbuf->stx_atime.tv_nsec;
+	statbuf->st_mtim.tv_sec = statxbuf->stx_mtime.tv_sec;
+	statbuf->st_mtim.tv_nsec = statxbuf->stx_mtime.tv_nsec;
+	statbuf->st_ctim.tv_sec = statxbuf->stx_ctime.tv_sec;
+	statbuf->st_ctim.tv_nsec = statxbuf->stx_ctime.tv_nsec;
+}
+
+static int _emulateAccess(const char* path, size_t path_len, unsigned long mode, unsigned long flags, long* result) {
+	// Only existence checks. Permission checks depend on the tracee's credentials.
+	if (mode != F_OK || (flags & ~(AT_SYMLINK_NOFOLLOW | AT_EACCESS)))
+		return 0;
+	int _errno = pathCacheStatx(path, path_len, !!(flags & AT_SYMLINK_NOFOLLOW), NULL);
+	*result = -_errno;
+	return 1;
+}
+
+static int _emulateStat(pid_t pid, const char* path, size_t path_len, unsigned long statbuf_addr, unsigned long flags, long* result) {
+	if (flags & ~(AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT))
+		return 0;
+	struct statx statxbuf;
+	int _errno = pathCacheStatx(path, path_len, !!(flags & AT_SYMLINK_NOFOLLOW), &statxbuf);
+	if (!_errno) {
+		if (S_ISDIR(statxbuf.stx_mode))
+			return 0;
+		struct stat statbuf;
+		_emulateStatFromStatx(&statxbuf, &statbuf);
+		if (trace_backend->write_memory(pid, statbuf_addr, &statbuf, sizeof(statbuf)) != 0)
+			return 0;
+	}
+	*result = -_errno;
+	return 1;
+}
+
+static int _emulateStatx(pid_t pid, const char* path, size_t path_len, unsigned long flags, unsigned long mask, unsigned long statxbuf_addr, long* result) {
+	// AT_STATX_FORCE_SYNC and AT_STATX_DONT_SYNC ask for something other than what's cached.
+	if ((flags & ~(AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT)) || (mask & ~_PATH_CACHE_STATX_MASK))
+		return 0;
+	struct statx statxbuf;
+	int _errno = pathCacheStatx(path, path_len, !!(flags & AT_SYMLINK_NOFOLLOW), &statxbuf);
+	if (!_errno) {
+		if (S_ISDIR(statxbuf.stx_mode))
+			return 0;
+		if (trace_backend->write_memory(pid, statxbuf_addr, &statxbuf, sizeof(statxbuf)) != 0)
+			return 0;
+	}
+	*result = -_errno;
+	return 1;
+}
+
+static int _emulateReadlink(pid_t pid, const char* path, size_t path_len, unsigned long buf_addr, unsigned long bufsiz, long* result) {
+	if ((int)bufsiz <= 0)
+		return 0;
+	char target[PATH_MAX];
+	size_t target_len = 0;
+	int _errno = pathCacheReadlink(path, path_len, target, bufsiz < PATH_MAX ? bufsiz : PATH_MAX, &target_len);
+	if (!_errno) {
+		if (trace_backend->write_memory(pid, buf_addr, target, target_len) != 0)
+			return 0;
+		*result = target_len;
+		return 1;
+	}
+	*result = -_errno;
+	return 1;
+}
+
+static int _emulateOpen(const char* path, size_t path_len, unsigned long flags, long* result) {
+	// Only failures. Opening for real has to be done in the tracee.
+	if (flags & (O_CREAT | __O_TMPFILE))
+		return 0;
+	int _errno = pathCacheStatx(path, path_len, !!(flags & O_NOFOLLOW), NULL);
+	if (_errno != ENOENT && _errno != ENOTDIR)
+		return 0;
+	*result = -_errno;
+	return 1;
+}
+
+static int emulate_syscall(SyscallJob_t* job) {
+	// Answer the syscall at `job`'s syscall-enter-stop without the kernel, if it's one we can. Returns 1 if it was.
+	// Must run on the tracer thread, after the paths have been matched. If it was, they needn't be written back.
+	if (!job->call.emulation || !emulate_enabled() || job->args_l < 1)
+		return 0;
+	SyscallJobArg_t* arg = &job->args[0];
+	if (arg->read_errno != 0 || arg->new_file_len == PATH_REPLACER_NO_MATCH || arg->arena.new_file[0] != '/')
+		return 0;
+
+	const char* path = arg->arena.new_file;
+	size_t path_len = arg->new_file_len;
+	pid_t pid = job->pid;
+	struct user_regs_struct regs;
+	long result;
+	int emulated = 0;
+
+	if (trace_backend->get_regs(pid, &regs) != 0)
+		return 0;
+
+	switch (job->call.emulation) {
+		case EMULATE_ACCESS:
+			emulated = _emulateAccess(path, path_len, regs.rsi, 0, &result);
+			break;
+		case EMULATE_FACCESSAT:
+			emulated = _emulateAccess(path, path_len, regs.rdx, 0, &result);
+			break;
+		case EMULATE_FACCESSAT2:
+			emulated = _emulateAccess(path, path_len, regs.rdx, regs.r10, &result);
+			break;
+		case EMULATE_STAT:
+			emulated = _emulateStat(pid, path, path_len, regs.rsi, 0, &result);
+			break;
+		case EMULATE_LSTAT:
+			emulated = _emulateStat(pid, path, path_len, regs.rsi, AT_SYMLINK_NOFOLLOW, &result);
+			break;
+		case EMULATE_NEWFSTATAT:
+			emulated = _emulateStat(pid, path, path_len, regs.rdx, regs.r10, &result);
+			break;
+		case EMULATE_STATX:
+			emulated = _emulateStatx(pid, path, path_len, regs.rdx, regs.r10, regs.r8, &result);
+			break;
+		case EMULATE_READLINK:
+			emulated = _emulateReadlink(pid, path, path_len, regs.rsi, regs.rdx, &result);
+			break;
+		case EMULATE_READLINKAT:
+			emulated = _emulateReadlink(pid, path, path_len, regs.rdx, regs.r10, &result);
+			break;
+		case EMULATE_OPEN:
+			emulated = _emulateOpen(path, path_len, regs.rsi, &result);
+			break;
+		case EMULATE_OPENAT:
+			emulated = _emulateOpen(path, path_len, regs.rdx, &result);
+			break;
+		default:
+			break;
+	}
+	if (!emulated)
+		return 0;
+
+	regs.orig_rax = -1;
+	regs.rax = result;
+	if (trace_backend->set_regs(pid, &regs) != 0)
+		return 0;
+	interceptor_stats.emulated_calls++;
+	DEBUG_PRINT("Emulating syscall '%s' (%i): %s → %li\n", job->call.name, pid, path, result);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,515 @@
+#ifndef INTERCEPTOR_HANDOFF_C_INCL
+#define INTERCEPTOR_HANDOFF_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+
+#include "interceptor_affinity.c"
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_io_uring.c"
+#include "interceptor_patch.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_replace.h"
+#include "interceptor_stats.c"
+
+
+////// Tracer handoff:
+
+// The tracer is the parent of every tracee, so upgrading `intercept-files` or its rules used to mean restarting whatever it traces.
+// On SIGUSR2, the tracer starts _PATH_INTERCEPTOR_HANDOFF_EXEC (by default its own binary, as it was at startup) with the same environment, and one end of a socketpair in _PATH_INTERCEPTOR_HANDOFF_FD. The new tracer loads its rules and says it's ready. Then the old one:
+// 1. Sends every task a SIGSTOP with tkill(), and keeps handling their stops until each is held at the signal-delivery-stop for it. That's always between syscalls, so every path syscall is handled by exactly one tracer.
+// 2. Detaches them all with SIGSTOP, which leaves each process in a group-stop, and sends the list of tasks and io_uring rings.
+// 3. Waits while the new tracer PTRACE_SEIZEs every task, sends SIGCONT and resumes them. If that fails, takes them back itself.
+// 4. Stays around as the main target's parent, to relay its exit code.
+// Everything else, like the path cache, is rebuilt by the new tracer as it goes. Working directories and file descriptors are the tracees' own, so they don't move.
+// The new tracer isn't an ancestor of the tracees, so with Yama's kernel.yama.ptrace_scope at 1 (the default on many distributions) it needs CAP_SYS_PTRACE. Without it, the handoff fails and the old tracer carries on.
+// Not available in daemon mode, or while recording or replaying.
+
+#define _HANDOFF_VERSION "intercept-files handoff 1"
+// First line of the task list. Bump when its lines change meaning.
+
+static inline const char* handoff_exec_path() {
+	GET_AND_CACHE_ENV(exec_s, "_PATH_INTERCEPTOR_HANDOFF_EXEC");
+	static char self_path[PATH_MAX];
+	if (exec_s && strlen(exec_s))
+		return exec_s;
+	if (!self_path[0]) {
+		// Resolved once at startup, so a binary replaced by a rename is picked up under its name.
+		ssize_t self_path_len = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+		if (self_path_len > 0)
+			self_path[self_path_len] = '\0';
+	}
+	return self_path;
+}
+
+static inline long handoff_timeout() {
+	GET_AND_CACHE_ENV(timeout_s, "_PATH_INTERCEPTOR_HANDOFF_TIMEOUT");
+	return env_long(timeout_s, 10);
+}
+
+static inline int handoff_fd() {
+	// Set for a new tracer by the one handing off to it. -1 otherwise.
+	GET_AND_CACHE_ENV(fd_s, "_PATH_INTERCEPTOR_HANDOFF_FD");
+	return env_long(fd_s, -1);
+}
+
+typedef struct {
+	pid_t pid;
+	pid_t tgid;
+	int in_syscall;
+	int gone;
+} _HandoffTask_t;
+
+static volatile sig_atomic_t handoff_signaled;
+// Set by the signal handler, for process_signals() to call handoffCheck().
+static volatile sig_atomic_t _handoff_requested;
+static volatile sig_atomic_t _handoff_expired;
+
+static int handoff_freezing;
+static PidMap_t _handoff_held;
+// Tasks stopped at the SIGSTOP we sent.
+static int _handoff_fd = -1;
+static pid_t _handoff_successor;
+static long _handoff_ptrace_options;
+static _HandoffTask_t* _handoff_tasks;
+static int _handoff_tasks_l;
+
+
+static void _handoffSignal(int sig) {
+	if (sig == SIGUSR2)
+		_handoff_requested = 1;
+	else
+		_handoff_expired = 1;
+	handoff_signaled = 1;
+}
+
+static void handoffInit(pid_t child, long ptrace_options) {
+	// Listen for handoff requests, if this tracer can hand off.
+	// Not with _PATH_INTERCEPTOR_PATCH, since the next tracer wouldn't know about the seccomp filter or the patched call sites.
+	_handoff_ptrace_options = ptrace_options;
+	if (!child || !trace_backend_pipelinable() || trace_record_file() || patch_filtered)
+		return;
+	handoff_exec_path();
+	pidMapInit(&_handoff_held);
+	struct sigaction handler = { .sa_handler = _handoffSignal };
+	// No SA_RESTART, so waiting for the next stop gets interrupted. A request that lands just before waitpid() is only seen at the next stop.
+	sigaddset(&handler.sa_mask, SIGUSR2);
+	sigaddset(&handler.sa_mask, SIGALRM);
+	sigaction(SIGUSR2, &handler, NULL);
+	sigaction(SIGALRM, &handler, NULL);
+}
+
+
+//// Messages:
+
+// Lines of text, so tracers of different versions can tell what they don't understand.
+// New → old: "ready" once the rules are loaded, then "adopted" once it has every task.
+// Old → new: _HANDOFF_VERSION, "main PID", one "task PID TGID IN_SYSCALL" per task, ioUringHandoffSend()'s lines, and "end".
+
+static int _handoffReadLine(int fd, char* line, size_t cap) {
+	// One line, without the "\n". Byte by byte, since the messages are short and nothing else may be read ahead.
+	size_t len = 0;
+	line[0] = '\0';
+	while (len + 1 < cap) {
+		char c;
+		ssize_t got = read(fd, &c, 1);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return 0;
+		if (c == '\n')
+			break;
+		line[len++] = c;
+		line[len] = '\0';
+	}
+	return 1;
+}
+
+static void _handoffSetTimeout(int fd) {
+	struct timeval timeout = { .tv_sec = handoff_timeout() };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static inline int _handoffExitCode(int status) {
+	// What process_signals() would exit with.
+	return WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status);
+}
+
+
+//// Adopting:
+
+static int _handoffAdopt(_HandoffTask_t* tasks, int tasks_l, pid_t child) {
+	// PTRACE_SEIZE every task, which are all in a group-stop, then continue them. Returns 0, or `errno` of the first one that couldn't be seized, in which case they're all left in their group-stop.
+	// Tasks that turn out to be gone are marked. Exits if that's `child`.
+	for (int i = 0; i < tasks_l; i++) {
+		pid_t pid = tasks[i].pid;
+		if (ptrace(PTRACE_SEIZE, pid, 0, _handoff_ptrace_options) != 0) {
+			int _errno = errno;
+			if (_errno == ESRCH) {
+				tasks[i].gone = 1;
+				continue;
+			}
+			LOG_PRINT("ERROR: Could not seize task %i:\n\t%s\n", pid, strerror(_errno));
+			for (int d = 0; d < i; d++) {
+				if (!tasks[d].gone)
+					ptrace(PTRACE_DETACH, tasks[d].pid, 0, 0);
+			}
+			return _errno;
+		}
+		int status = 0;
+		while (waitpid(pid, &status, __WALL) < 0 && errno == EINTR);
+		// Seizing a task in a group-stop makes it report a PTRACE_EVENT_STOP.
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			LOG_PRINT("Gone during handoff:\n\t%i\n", pid);
+			if (pid == child) {
+				LOG_PRINT("Main target gone during handoff.\n");
+				exit(_handoffExitCode(status));
+			}
+			tasks[i].gone = 1;
+		}
+	}
+	for (int i = 0; i < tasks_l; i++) {
+		if (!tasks[i].gone)
+			kill(tasks[i].tgid, SIGCONT);
+	}
+	for (int i = 0; i < tasks_l; i++) {
+		if (!tasks[i].gone)
+			trace_backend->resume(tasks[i].pid, PTRACE_SYSCALL, 0);
+	}
+	return 0;
+}
+
+static pid_t handoffReceive(PathReplacer_t replacer) {
+	// New tracer, before process_signals(). Loads the rules, says it's ready and reads the task list. Returns the main target.
+	// Broken rules exit right here, before the old tracer has stopped anything.
+	int fd = handoff_fd();
+	char path_buf[PATH_MAX];
+	replacer("/", 1, path_buf, sizeof(path_buf));
+	if (dprintf(fd, "ready\n") < 0) {
+		LOG_PRINT("ERROR: Lost the tracer handing off to us.\n");
+		exit(1);
+	}
+
+	char line[256];
+	pid_t child = 0;
+	// No timeout. If the old tracer gives up, it kills us.
+	if (!_handoffReadLine(fd, line, sizeof(line)) || strcmp(line, _HANDOFF_VERSION) != 0) {
+		LOG_PRINT("ERROR: Unsupported handoff from the old tracer:\n\t%s\n", line);
+		exit(1);
+	}
+	while (1) {
+		if (!_handoffReadLine(fd, line, sizeof(line))) {
+			LOG_PRINT("ERROR: Lost the tracer handing off to us.\n");
+			exit(1);
+		}
+		if (strcmp(line, "end") == 0)
+			break;
+		_HandoffTask_t task = { 0 };
+		if (sscanf(line, "task %i %i %i", &task.pid, &task.tgid, &task.in_syscall) == 3) {
+			_handoff_tasks = (_HandoffTask_t*)realloc(_handoff_tasks, sizeof(_HandoffTask_t) * (_handoff_tasks_l + 1));
+			_handoff_tasks[_handoff_tasks_l++] = task;
+			continue;
+		}
+		if (sscanf(line, "main %i", &child) == 1 || ioUringHandoffReceive(line))
+			continue;
+		DEBUG_PRINT("Ignoring handoff line: %s\n", line);
+	}
+	LOG_PRINT("Taking over %i tasks from the old tracer.\n", _handoff_tasks_l);
+	return child;
+}
+
+static void handoffAdopt(pid_t child, void (*adopted)(pid_t pid, int in_syscall)) {
+	// New tracer, from process_signals() after handoffInit(). Seizes what handoffReceive() got, hands each task to `adopted`, and tells the old tracer.
+	int fd = handoff_fd();
+	int _errno = _handoffAdopt(_handoff_tasks, _handoff_tasks_l, child);
+	if (_errno) {
+		dprintf(fd, "failed %s\n", strerror(_errno));
+		if (_errno == EPERM)
+			LOG_PRINT("ERROR: Not allowed to trace the old tracer's tasks. With kernel.yama.ptrace_scope=1, handoff needs CAP_SYS_PTRACE.\n");
+		LOG_PRINT("ERROR: Leaving the tasks to the old tracer.\n");
+		exit(1);
+	}
+	for (int i = 0; i < _handoff_tasks_l; i++) {
+		if (!_handoff_tasks[i].gone)
+			adopted(_handoff_tasks[i].pid, _handoff_tasks[i].in_syscall);
+	}
+	dprintf(fd, "adopted\n");
+	close(fd);
+	free(_handoff_tasks);
+	_handoff_tasks = NULL;
+	_handoff_tasks_l = 0;
+}
+
+
+//// Handing off:
+
+static void _handoffDropSuccessor() {
+	close(_handoff_fd);
+	_handoff_fd = -1;
+	if (_handoff_successor) {
+		kill(_handoff_successor, SIGKILL);
+		while (waitpid(_handoff_successor, NULL, 0) < 0 && errno == EINTR);
+		// Once it's reaped, nothing is attached to it anymore.
+		_handoff_successor = 0;
+	}
+}
+
+static int _handoffSpawn() {
+	// Start the new tracer and wait until it's ready. Returns 0 if it didn't get there.
+	extern char** environ;
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		LOG_PRINT("ERROR: Could not create handoff socket:\n\t%s\n", strerror(errno));
+		return 0;
+	}
+
+	// Everything is allocated before fork(), since a matcher thread could be holding malloc()'s lock.
+	const char* exec_path = handoff_exec_path();
+	char* argv[] = { (char*)exec_path, NULL };
+	char fd_env[64];
+	snprintf(fd_env, sizeof(fd_env), "_PATH_INTERCEPTOR_HANDOFF_FD=%i", fds[1]);
+	int envc = 0;
+	for (char** env = environ; *env; env++)
+		envc++;
+	char** envp = (char**)malloc(sizeof(char*) * (envc + 2));
+	int e = 0;
+	for (char** env = environ; *env; env++) {
+		if (strncmp(*env, "_PATH_INTERCEPTOR_HANDOFF_FD=", strlen("_PATH_INTERCEPTOR_HANDOFF_FD=")) != 0)
+			envp[e++] = *env;
+	}
+	envp[e++] = fd_env;
+	envp[e] = NULL;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		sigset_t all_signals;
+		sigfillset(&all_signals);
+		sigprocmask(SIG_UNBLOCK, &all_signals, NULL);
+		// Pipelined mode blocks SIGCHLD.
+		fcntl(fds[1], F_SETFD, 0);
+		execve(exec_path, argv, envp);
+		fprintf(stderr, "intercept-files: %s: %s\n", exec_path, strerror(errno));
+		_exit(127);
+	}
+	free(envp);
+	close(fds[1]);
+	if (pid < 0) {
+		LOG_PRINT("ERROR: Could not start new tracer:\n\t%s\n", strerror(errno));
+		close(fds[0]);
+		return 0;
+	}
+	_handoff_fd = fds[0];
+	_handoff_successor = pid;
+	_handoffSetTimeout(_handoff_fd);
+
+	char line[64];
+	if (!_handoffReadLine(_handoff_fd, line, sizeof(line)) || strcmp(line, "ready") != 0) {
+		LOG_PRINT("ERROR: New tracer did not start. Cancelling handoff.\n");
+		_handoffDropSuccessor();
+		return 0;
+	}
+	return 1;
+}
+
+static int _handoffZombie(pid_t pid) {
+	// A thread group leader that exits before its threads stays a zombie until they're all gone, and never stops for us.
+	char stat_path[64];
+	char stat[512];
+	snprintf(stat_path, sizeof(stat_path), "/proc/%i/stat", pid);
+	FILE* f = fopen(stat_path, "r");
+	if (!f)
+		return 1;
+	size_t stat_len = fread(stat, 1, sizeof(stat) - 1, f);
+	fclose(f);
+	stat[stat_len] = '\0';
+	char* state = strrchr(stat, ')');
+	// After the command name, which can contain anything.
+	return state && (state[2] == 'Z' || state[2] == 'X');
+}
+
+static int _handoffFrozen(PidMap_t* tasks) {
+	pidmap_index_t i = 0;
+	int pid, in_syscall;
+	for (; pidMapIterate(tasks, &i, &pid, &in_syscall); i++) {
+		if (!pidMapHas(&_handoff_held, pid) && !_handoffZombie(pid))
+			return 0;
+	}
+	return 1;
+}
+
+static void _handoffUnfreeze(PidMap_t* tasks) {
+	// Let go of held tasks, without handing them off. SIGSTOPs still on their way get swallowed by process_signals() like any signal.
+	pidmap_index_t i = 0;
+	int pid, held;
+	for (; pidMapIterate(&_handoff_held, &i, &pid, &held); i++) {
+		if (pidMapHas(tasks, pid))
+			trace_backend->resume(pid, PTRACE_SYSCALL, 0);
+		pidMapRemove(&_handoff_held, pid);
+	}
+	alarm(0);
+	handoff_freezing = 0;
+}
+
+static void _handoffBegin(PidMap_t* tasks) {
+	LOG_PRINT("Handoff requested. Starting new tracer:\n\t%s\n", handoff_exec_path());
+	if (!_handoffSpawn())
+		return;
+	LOG_PRINT("New tracer ready. Stopping tasks:\n\t%i\n", _handoff_successor);
+	handoff_freezing = 1;
+	alarm(handoff_timeout());
+	pidmap_index_t i = 0;
+	int pid, in_syscall;
+	for (; pidMapIterate(tasks, &i, &pid, &in_syscall); i++)
+		syscall(SYS_tkill, pid, SIGSTOP);
+}
+
+static void _handoffRelay(pid_t child) {
+	// Old tracer, once the new one has everything. Never returns.
+	// Until the new tracer exits, reaps whatever's still attached to us, like zombie thread group leaders. Then exits with the main target's exit code if we're its parent, or like the new tracer otherwise.
+	LOG_PRINT("Handed off to new tracer %i. Staying to relay the exit code.\n", _handoff_successor);
+	close(_handoff_fd);
+	int status = 0;
+	int exit_code = 1;
+	int child_exited = 0;
+	while (1) {
+		pid_t pid = waitpid(-1, &status, __WALL);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		if (pid < 0)
+			break;
+		if (pid == child && (WIFEXITED(status) || WIFSIGNALED(status))) {
+			exit_code = _handoffExitCode(status);
+			child_exited = 1;
+		}
+		if (pid == _handoff_successor) {
+			if (WIFSIGNALED(status))
+				LOG_PRINT("ERROR: New tracer killed by signal %i. Its tasks go on untraced.\n", WTERMSIG(status));
+			if (!child_exited)
+				exit_code = _handoffExitCode(status);
+			break;
+		}
+	}
+	if (!child_exited) {
+		while ((status = 0, waitpid(child, &status, 0)) < 0 && errno == EINTR);
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			exit_code = _handoffExitCode(status);
+	}
+	exit(exit_code);
+}
+
+static void _handoffFinish(pid_t child, PidMap_t* tasks) {
+	// Every task is held between syscalls. Detach them into a group-stop, so none can run until the new tracer has seized it.
+	alarm(0);
+	_HandoffTask_t* list = (_HandoffTask_t*)malloc(sizeof(_HandoffTask_t) * tasks->length);
+	int list_l = 0;
+	dprintf(_handoff_fd, _HANDOFF_VERSION "\nmain %i\n", child);
+	pidmap_index_t i = 0;
+	int pid, in_syscall;
+	for (; pidMapIterate(tasks, &i, &pid, &in_syscall); i++) {
+		if (!pidMapHas(&_handoff_held, pid))
+			continue;
+			// Zombies stay with us. See _handoffRelay().
+		_HandoffTask_t task = { .pid = pid, .tgid = trace_backend->tgid(pid), .in_syscall = !!in_syscall };
+		list[list_l++] = task;
+		trace_backend->resume(pid, PTRACE_DETACH, SIGSTOP);
+		dprintf(_handoff_fd, "task %i %i %i\n", task.pid, task.tgid, task.in_syscall);
+	}
+	ioUringHandoffSend(_handoff_fd);
+	dprintf(_handoff_fd, "end\n");
+
+	char line[256];
+	if (_handoffReadLine(_handoff_fd, line, sizeof(line)) && strcmp(line, "adopted") == 0) {
+		free(list);
+		_handoffRelay(child);
+	}
+
+	LOG_PRINT("ERROR: New tracer did not take over:\n\t%s\n\tTaking %i tasks back.\n", line, list_l);
+	_handoffDropSuccessor();
+	int _errno = _handoffAdopt(list, list_l, child);
+	if (_errno) {
+		LOG_PRINT("ERROR: Could not take tasks back. Letting them go on untraced.\n");
+		for (int t = 0; t < list_l; t++)
+			kill(list[t].tgid, SIGCONT);
+		free(list);
+		_handoffRelay(child);
+	}
+	for (int t = 0; t < list_l; t++) {
+		if (list[t].gone) {
+			pidMapRemove(tasks, list[t].pid);
+			statsTaskExited();
+			affinityForget(list[t].pid);
+			ioUringForget(list[t].pid);
+		}
+	}
+	free(list);
+	i = 0;
+	int held;
+	for (; pidMapIterate(&_handoff_held, &i, &pid, &held); i++)
+		pidMapRemove(&_handoff_held, pid);
+	handoff_freezing = 0;
+}
+
+static void handoffCheck(pid_t child, PidMap_t* tasks) {
+	// From process_signals(), when `handoff_signaled` is set.
+	handoff_signaled = 0;
+	if (_handoff_expired) {
+		_handoff_expired = 0;
+		if (handoff_freezing) {
+			LOG_PRINT("ERROR: Not every task stopped within %lis. Cancelling handoff.\n", handoff_timeout());
+			_handoffUnfreeze(tasks);
+			_handoffDropSuccessor();
+		}
+	}
+	if (_handoff_requested) {
+		_handoff_requested = 0;
+		if (!handoff_freezing)
+			_handoffBegin(tasks);
+	}
+}
+
+static int handoffStop(pid_t child, pid_t pid, int status, PidMap_t* tasks) {
+	// From process_signals() for every wait result while `handoff_freezing`. Returns 1 if it was the handoff's to handle.
+	if (pid == _handoff_successor) {
+		LOG_PRINT("ERROR: New tracer exited before taking over. Cancelling handoff.\n");
+		_handoff_successor = 0;
+		_handoffUnfreeze(tasks);
+		_handoffDropSuccessor();
+		return 1;
+	}
+	if (!pidMapHas(tasks, pid) || !WIFSTOPPED(status) || WSTOPSIG(status) != SIGSTOP || status >> 16)
+		return 0;
+	if (pidMapGet(tasks, pid) != 0) {
+		// Signal-delivery-stops are never inside a syscall. If we've lost track of that, try again.
+		syscall(SYS_tkill, pid, SIGSTOP);
+		return 0;
+	}
+	pidMapSet(&_handoff_held, pid, 1);
+	if (_handoffFrozen(tasks))
+		_handoffFinish(child, tasks);
+	return 1;
+}
+
+static inline void handoffTaskAdded(pid_t pid) {
+	// New tasks have to stop too.
+	if (handoff_freezing)
+		syscall(SYS_tkill, pid, SIGSTOP);
+}
+
+#endif
@@ -0,0 +1,534 @@
+#ifndef INTERCEPTOR_IO_URING_C_INCL
+#define INTERCEPTOR_IO_URING_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <sys/ptrace.h>
+#include <sys/reg.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+#include <linux/limits.h>
+
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_memory.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_replace.h"
+#include "interceptor_stats.c"
+#include "interceptor_logsample.c"
+
+
+////// io_uring:
+
+// Programs that do their file I/O through io_uring never make a path syscall for it. The paths sit in SQEs in a ring shared with the kernel, and io_uring_enter() submits them.
+// So we remember each process's rings from io_uring_setup() and the mmap()s that follow, and when io_uring_enter() is called, rewrite the path pointers of the SQEs it's about to submit.
+// The kernel copies the path during submission, so the new strings can live below the tracee's stack pointer just like in redirect_file().
+// SQEs the kernel didn't get to keep pointing at that scratch space, so those are put back at the syscall-exit-stop.
+// SQPOLL rings are consumed by a kernel thread at any time, so they can't be intercepted like this. They're reported, and can optionally be downgraded at setup.
+
+#ifndef IORING_SETUP_NO_MMAP
+#define IORING_SETUP_NO_MMAP (1U << 14)
+#endif
+#ifndef IORING_SETUP_NO_SQARRAY
+#define IORING_SETUP_NO_SQARRAY (1U << 16)
+#endif
+
+static inline int io_uring_strip_sqpoll() {
+	GET_AND_CACHE_ENV(sqpoll_s, "_PATH_INTERCEPTOR_IO_URING_SQPOLL");
+	return (sqpoll_s && strcmp(sqpoll_s, "strip") == 0);
+}
+
+typedef struct {
+	int opcode;
+	const char* name;
+	int path_offsets[2];
+	// Offsets of the path pointers in struct io_uring_sqe. Zero-terminated, like InterceptibleCall_t's registers.
+} IoUringPathOp_t;
+
+#define _IO_URING_ADDR offsetof(struct io_uring_sqe, addr)
+#define _IO_URING_ADDR2 offsetof(struct io_uring_sqe, addr2)
+#define _IO_URING_ADDR3 offsetof(struct io_uring_sqe, addr3)
+
+#define IO_URING_OP(NAME, ...) { \
+	.opcode = NAME, \
+	.name = #NAME, \
+	.path_offsets = { __VA_ARGS__ } \
+}
+
+const IoUringPathOp_t IoUringPathOps[] = {
+	IO_URING_OP(IORING_OP_OPENAT,
+		_IO_URING_ADDR),
+	IO_URING_OP(IORING_OP_OPENAT2,
+		_IO_URING_ADDR),
+	IO_URING_OP(IORING_OP_STATX,
+		_IO_URING_ADDR),
+	IO_URING_OP(IORING_OP_UNLINKAT,
+		_IO_URING_ADDR),
+	IO_URING_OP(IORING_OP_MKDIRAT,
+		_IO_URING_ADDR),
+	IO_URING_OP(IORING_OP_RENAMEAT,
+		_IO_URING_ADDR,_IO_URING_ADDR2),
+	IO_URING_OP(IORING_OP_SYMLINKAT,
+		_IO_URING_ADDR,_IO_URING_ADDR2),
+	IO_URING_OP(IORING_OP_LINKAT,
+		_IO_URING_ADDR,_IO_URING_ADDR2),
+	IO_URING_OP(IORING_OP_SETXATTR,
+		_IO_URING_ADDR3),
+	IO_URING_OP(IORING_OP_GETXATTR,
+		_IO_URING_ADDR3),
+};
+
+const int IoUringPathOps_l = sizeof(IoUringPathOps) / sizeof(IoUringPathOps[0]);
+
+static const IoUringPathOp_t* get_io_uring_path_op(int opcode) {
+	for (int i = 0; i < IoUringPathOps_l; i++) {
+		if (IoUringPathOps[i].opcode == opcode)
+			return &IoUringPathOps[i];
+	}
+	return NULL;
+}
+
+
+typedef struct {
+	int _valid;
+	pid_t tgid;
+	// File descriptors are per process, so rings are too.
+	int fd;
+	unsigned flags;
+	unsigned sq_entries;
+	struct io_sqring_offsets sq_off;
+	unsigned long sq_ring_addr;
+	unsigned long sqes_addr;
+} IoUringRing_t;
+
+#define _IO_URING_MAX_PENDING 64
+#define _IO_URING_SCRATCH_MAX (64 * 1024)
+// Limits for how many SQEs one io_uring_enter() can have rewritten, and how much of the stack their new paths can use.
+
+typedef struct {
+	int _valid;
+	pid_t pid;
+	int count;
+	unsigned position[_IO_URING_MAX_PENDING];
+	// Offset from the SQ head at entry, to tell at exit whether the kernel consumed it.
+	unsigned long field_addr[_IO_URING_MAX_PENDING];
+	unsigned long orig_value[_IO_URING_MAX_PENDING];
+} IoUringPending_t;
+
+static IoUringRing_t* _io_uring_rings;
+static int _io_uring_rings_l;
+static int _io_uring_rings_live;
+// Until a tracee sets up a ring, the mmap/close/enter hooks stop right there.
+static IoUringPending_t* _io_uring_pending;
+static int _io_uring_pending_l;
+static PidMap_t _io_uring_tgids;
+static int _io_uring_tgids_initialized;
+static PathReplacer_t _io_uring_replacer;
+
+
+static void ioUringInit(PathReplacer_t replacer) {
+	_io_uring_replacer = replacer;
+}
+
+static pid_t _ioUringTgid(pid_t pid) {
+	// Threads share their rings, so look them up by thread group. Cached, since /proc is slow.
+	if (!_io_uring_tgids_initialized) {
+		pidMapInit(&_io_uring_tgids);
+		_io_uring_tgids_initialized = 1;
+	}
+	if (pidMapHas(&_io_uring_tgids, pid))
+		return pidMapGet(&_io_uring_tgids, pid);
+
+	pid_t tgid = trace_backend->tgid(pid);
+	pidMapSet(&_io_uring_tgids, pid, tgid);
+	return tgid;
+}
+
+static IoUringRing_t* _ioUringFindRing(pid_t tgid, int fd) {
+	for (int i = 0; i < _io_uring_rings_l; i++) {
+		if (_io_uring_rings[i]._valid && _io_uring_rings[i].tgid == tgid && _io_uring_rings[i].fd == fd)
+			return &_io_uring_rings[i];
+	}
+	return NULL;
+}
+
+static int _ioUringHasFd(int fd) {
+	// Cheap filter before looking up the thread group.
+	for (int i = 0; i < _io_uring_rings_l; i++) {
+		if (_io_uring_rings[i]._valid && _io_uring_rings[i].fd == fd)
+			return 1;
+	}
+	return 0;
+}
+
+static IoUringRing_t* _ioUringNewRing() {
+	for (int i = 0; i < _io_uring_rings_l; i++) {
+		if (!_io_uring_rings[i]._valid)
+			return &_io_uring_rings[i];
+	}
+	_io_uring_rings = (IoUringRing_t*)realloc(_io_uring_rings, sizeof(IoUringRing_t) * (_io_uring_rings_l + 1));
+	return &_io_uring_rings[_io_uring_rings_l++];
+}
+
+static void _ioUringForgetRing(IoUringRing_t* ring) {
+	ring->_valid = 0;
+	_io_uring_rings_live--;
+}
+
+static IoUringPending_t* _ioUringPending(pid_t pid, int create) {
+	IoUringPending_t* free_slot = NULL;
+	for (int i = 0; i < _io_uring_pending_l; i++) {
+		if (_io_uring_pending[i]._valid && _io_uring_pending[i].pid == pid)
+			return &_io_uring_pending[i];
+		if (!_io_uring_pending[i]._valid && !free_slot)
+			free_slot = &_io_uring_pending[i];
+	}
+	if (!create)
+		return NULL;
+	if (!free_slot) {
+		_io_uring_pending = (IoUringPending_t*)realloc(_io_uring_pending, sizeof(IoUringPending_t) * (_io_uring_pending_l + 1));
+		free_slot = &_io_uring_pending[_io_uring_pending_l++];
+	}
+	free_slot->_valid = 1;
+	free_slot->pid = pid;
+	free_slot->count = 0;
+	return free_slot;
+}
+
+
+//// Hooks, see InterceptibleCalls[]:
+
+static void PREHOOK_io_uring_setup(pid_t pid) {
+	unsigned long params_addr = trace_backend->peek_user(pid, RSI);
+	struct io_uring_params params;
+	if (trace_backend->read_memory(pid, params_addr, &params, sizeof(params)) != 0)
+		return;
+	if (!(params.flags & IORING_SETUP_SQPOLL))
+		return;
+	if (io_uring_strip_sqpoll()) {
+		LOG_PRINT("Stripping IORING_SETUP_SQPOLL from io_uring_setup() so its paths can be intercepted (PID %i).\n", pid);
+		params.flags &= ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF);
+		// The kernel copies the params back out, so liburing and friends will see a normal ring and submit with io_uring_enter().
+		trace_backend->write_memory(pid, params_addr + offsetof(struct io_uring_params, flags), &params.flags, sizeof(params.flags));
+	}
+}
+
+static void EXITHOOK_io_uring_setup(pid_t pid) {
+	long fd = trace_backend->peek_user(pid, RAX);
+	if (fd < 0)
+		return;
+	unsigned long params_addr = trace_backend->peek_user(pid, RSI);
+	struct io_uring_params params;
+	if (trace_backend->read_memory(pid, params_addr, &params, sizeof(params)) != 0) {
+		LOG_PRINT("ERROR: Could not read io_uring_setup() params (PID %i FD %li). Its paths won't be intercepted.\n", pid, fd);
+		return;
+	}
+
+	pid_t tgid = _ioUringTgid(pid);
+	IoUringRing_t* ring = _ioUringFindRing(tgid, fd);
+	if (!ring) {
+		ring = _ioUringNewRing();
+		_io_uring_rings_live++;
+	}
+	ring->_valid = 1;
+	ring->tgid = tgid;
+	ring->fd = fd;
+	ring->flags = params.flags;
+	ring->sq_entries = params.sq_entries;
+	ring->sq_off = params.sq_off;
+	ring->sq_ring_addr = 0;
+	ring->sqes_addr = 0;
+
+	LOG_PRINT("Tracking io_uring (PID %i FD %li):\n\t%u entries, flags 0x%x\n", pid, fd, params.sq_entries, params.flags);
+	if (params.flags & IORING_SETUP_SQPOLL) {
+		LOG_PRINT("ERROR: io_uring (PID %i FD %li) uses IORING_SETUP_SQPOLL.\n\tA kernel thread submits its SQEs, so paths in them CANNOT be intercepted.\n\tSet _PATH_INTERCEPTOR_IO_URING_SQPOLL=strip to downgrade such rings at setup.\n", pid, fd);
+	}
+	if (params.flags & IORING_SETUP_NO_MMAP) {
+		LOG_PRINT("ERROR: io_uring (PID %i FD %li) uses IORING_SETUP_NO_MMAP, which isn't supported. Its paths won't be intercepted.\n", pid, fd);
+	}
+}
+
+static void EXITHOOK_mmap(pid_t pid) {
+	if (!_io_uring_rings_live)
+		return;
+	int fd = trace_backend->peek_user(pid, R8);
+	if (!_ioUringHasFd(fd))
+		return;
+	unsigned long addr = trace_backend->peek_user(pid, RAX);
+	if (addr > -4096UL)
+		return;
+	unsigned long long offset = trace_backend->peek_user(pid, R9);
+	IoUringRing_t* ring = _ioUringFindRing(_ioUringTgid(pid), fd);
+	if (!ring)
+		return;
+	if (offset == IORING_OFF_SQ_RING) {
+		ring->sq_ring_addr = addr;
+	} else if (offset == IORING_OFF_SQES) {
+		ring->sqes_addr = addr;
+	} else {
+		return;
+	}
+	DEBUG_PRINT("Mapped io_uring (PID %i FD %i) offset 0x%llx at 0x%lx.\n", pid, fd, offset, addr);
+}
+
+static void ioUringClosed(pid_t pid) {
+	// Call at close()'s syscall-enter-stop.
+	if (!_io_uring_rings_live)
+		return;
+	int fd = trace_backend->peek_user(pid, RDI);
+	if (!_ioUringHasFd(fd))
+		return;
+	IoUringRing_t* ring = _ioUringFindRing(_ioUringTgid(pid), fd);
+	if (ring) {
+		DEBUG_PRINT("Forgetting closed io_uring (PID %i FD %i).\n", pid, fd);
+		_ioUringForgetRing(ring);
+	}
+}
+
+static void ioUringExecved(pid_t pid) {
+	// io_uring file descriptors are always close-on-exec.
+	if (!_io_uring_rings_live)
+		return;
+	if ((long)trace_backend->peek_user(pid, RAX) != 0)
+		return;
+	pid_t tgid = _ioUringTgid(pid);
+	for (int i = 0; i < _io_uring_rings_l; i++) {
+		if (_io_uring_rings[i]._valid && _io_uring_rings[i].tgid == tgid)
+			_ioUringForgetRing(&_io_uring_rings[i]);
+	}
+}
+
+static void _ioUringRewriteSqe(pid_t pid, IoUringRing_t* ring, unsigned position, unsigned long sqe_addr, const IoUringPathOp_t* op, unsigned long* scratch_addr, unsigned long scratch_limit, IoUringPending_t** pending) {
+	char orig_file[PATH_MAX];
+	char new_file[PATH_MAX];
+	size_t orig_file_len;
+
+	for (int p = 0; p < 2 && op->path_offsets[p]; p++) {
+		unsigned long field_addr = sqe_addr + op->path_offsets[p];
+		unsigned long path_addr;
+		if (trace_backend->read_memory(pid, field_addr, &path_addr, sizeof(path_addr)) != 0 || !path_addr)
+			continue;
+		int _errno = trace_backend->read_string(pid, path_addr, orig_file, PATH_MAX, &orig_file_len);
+		interceptor_stats.path_reads++;
+		if (_errno != 0) {
+			interceptor_stats.read_errors++;
+			LOG_PRINT("ERROR: Could not read path from io_uring SQE (PID %i %s):\n\t%s\n", pid, op->name, strerror(_errno));
+			continue;
+		}
+		path_replacer_last_rule = -1;
+		ssize_t new_file_len = _io_uring_replacer(orig_file, orig_file_len, new_file, PATH_MAX);
+		if (new_file_len == PATH_REPLACER_NO_MATCH)
+			continue;
+
+		if (!*pending)
+			*pending = _ioUringPending(pid, 1);
+		unsigned long new_addr = (*scratch_addr - (new_file_len + 1)) & ~(sizeof (long) - 1);
+		if ((*pending)->count >= _IO_URING_MAX_PENDING || new_addr < scratch_limit) {
+			LOG_PRINT("ERROR: Too many io_uring paths in one submission (PID %i). Passing the rest through.\n", pid);
+			return;
+		}
+		if (trace_backend->write_memory(pid, new_addr, new_file, new_file_len + 1) != 0 || trace_backend->write_memory(pid, field_addr, &new_addr, sizeof(new_addr)) != 0) {
+			LOG_PRINT("ERROR: Could not write io_uring path (PID %i %s).\n", pid, op->name);
+			continue;
+		}
+		*scratch_addr = new_addr;
+
+		int k = (*pending)->count++;
+		(*pending)->position[k] = position;
+		(*pending)->field_addr[k] = field_addr;
+		(*pending)->orig_value[k] = path_addr;
+
+		interceptor_stats.path_rewrites++;
+		unsigned long seen = logSampleRewrite(path_replacer_last_rule, orig_file, orig_file_len);
+		if (seen) {
+			LOG_PRINT(
+				"Intercepted and substituted path (PID %i %s FD %i):\n\t%s\n\t→\t%s\n%s",
+				pid,
+				op->name,
+				ring->fd,
+				orig_file,
+				new_file,
+				logSampleNote(seen)
+			);
+		}
+	}
+}
+
+static void PREHOOK_io_uring_enter(pid_t pid) {
+	if (!_io_uring_rings_live)
+		return;
+	int fd = trace_backend->peek_user(pid, RDI);
+	unsigned to_submit = trace_backend->peek_user(pid, RSI);
+	unsigned flags = trace_backend->peek_user(pid, R10);
+
+	if (!to_submit)
+		return;
+	if (flags & IORING_ENTER_REGISTERED_RING) {
+		static int warned;
+		if (!warned++)
+			LOG_PRINT("ERROR: io_uring_enter() with IORING_ENTER_REGISTERED_RING isn't supported (PID %i). Its paths won't be intercepted.\n", pid);
+		return;
+	}
+	if (!_ioUringHasFd(fd))
+		return;
+	IoUringRing_t* ring = _ioUringFindRing(_ioUringTgid(pid), fd);
+	if (!ring)
+		return;
+	if (ring->flags & (IORING_SETUP_SQPOLL | IORING_SETUP_NO_MMAP))
+		return;
+	if (!ring->sq_ring_addr || !ring->sqes_addr) {
+		DEBUG_PRINT("io_uring (PID %i FD %i) isn't fully mapped yet.\n", pid, fd);
+		return;
+	}
+
+	unsigned head, tail, mask;
+	if (
+		trace_backend->read_memory(pid, ring->sq_ring_addr + ring->sq_off.head, &head, sizeof(head)) != 0 ||
+		trace_backend->read_memory(pid, ring->sq_ring_addr + ring->sq_off.tail, &tail, sizeof(tail)) != 0 ||
+		trace_backend->read_memory(pid, ring->sq_ring_addr + ring->sq_off.ring_mask, &mask, sizeof(mask)) != 0
+	) {
+		LOG_PRINT("ERROR: Could not read io_uring SQ ring (PID %i FD %i).\n", pid, fd);
+		return;
+	}
+
+	unsigned pending_l = tail - head;
+	if (pending_l > to_submit)
+		pending_l = to_submit;
+	if (pending_l > ring->sq_entries)
+		pending_l = ring->sq_entries;
+
+	unsigned long sqe_size = (ring->flags & IORING_SETUP_SQE128) ? 128 : 64;
+	unsigned long rsp = trace_backend->peek_user(pid, RSP);
+	unsigned long scratch_addr = rsp - 128;
+	// Past the red zone. io_uring_enter() has no path arguments of its own, so redirect_file() won't need this space.
+	IoUringPending_t* pending = _ioUringPending(pid, 0);
+	if (pending)
+		pending->count = 0;
+
+	for (unsigned i = 0; i < pending_l; i++) {
+		unsigned index = (head + i) & mask;
+		if (!(ring->flags & IORING_SETUP_NO_SQARRAY)) {
+			if (trace_backend->read_memory(pid, ring->sq_ring_addr + ring->sq_off.array + index * sizeof(unsigned), &index, sizeof(index)) != 0)
+				break;
+			index &= mask;
+		}
+		unsigned long sqe_addr = ring->sqes_addr + index * sqe_size;
+		unsigned char opcode;
+		if (trace_backend->read_memory(pid, sqe_addr + offsetof(struct io_uring_sqe, opcode), &opcode, sizeof(opcode)) != 0)
+			break;
+		const IoUringPathOp_t* op = get_io_uring_path_op(opcode);
+		if (!op)
+			continue;
+		_ioUringRewriteSqe(pid, ring, i, sqe_addr, op, &scratch_addr, rsp - 128 - _IO_URING_SCRATCH_MAX, &pending);
+	}
+}
+
+static void EXITHOOK_io_uring_enter(pid_t pid) {
+	// Put back path pointers of rewritten SQEs the kernel didn't submit, since their scratch space is about to be reused.
+	IoUringPending_t* pending = _ioUringPending(pid, 0);
+	if (!pending)
+		return;
+	long submitted = trace_backend->peek_user(pid, RAX);
+	if (submitted < 0)
+		submitted = 0;
+	for (int k = 0; k < pending->count; k++) {
+		if (pending->position[k] < submitted)
+			continue;
+		DEBUG_PRINT("Restoring unsubmitted io_uring SQE path (PID %i).\n", pid);
+		trace_backend->write_memory(pid, pending->field_addr[k], &pending->orig_value[k], sizeof(pending->orig_value[k]));
+	}
+	pending->_valid = 0;
+}
+
+
+//// Task lifecycle:
+
+static void ioUringForked(pid_t parent_pid, pid_t child_pid) {
+	// A new process inherits its parent's rings: the fds are copied, and the ring mappings are shared.
+	if (!_io_uring_rings_live)
+		return;
+	pid_t parent_tgid = _ioUringTgid(parent_pid);
+	pid_t child_tgid = _ioUringTgid(child_pid);
+	if (parent_tgid == child_tgid)
+		return;
+	int rings_l = _io_uring_rings_l;
+	for (int i = 0; i < rings_l; i++) {
+		if (!_io_uring_rings[i]._valid || _io_uring_rings[i].tgid != parent_tgid)
+			continue;
+		IoUringRing_t copy = _io_uring_rings[i];
+		IoUringRing_t* ring = _ioUringNewRing();
+		*ring = copy;
+		ring->tgid = child_tgid;
+		_io_uring_rings_live++;
+	}
+}
+
+static void ioUringForget(pid_t pid) {
+	if (_io_uring_tgids_initialized && pidMapHas(&_io_uring_tgids, pid)) {
+		if (_io_uring_rings_live && pidMapGet(&_io_uring_tgids, pid) == pid) {
+			// Thread group leader gone, so the process is.
+			for (int i = 0; i < _io_uring_rings_l; i++) {
+				if (_io_uring_rings[i]._valid && _io_uring_rings[i].tgid == pid)
+					_ioUringForgetRing(&_io_uring_rings[i]);
+			}
+		}
+		pidMapRemove(&_io_uring_tgids, pid);
+	}
+	IoUringPending_t* pending = _ioUringPending(pid, 0);
+	if (pending)
+		pending->_valid = 0;
+}
+
+
+//// Handoff, see interceptor_handoff.c:
+
+// One "ring" line per tracked ring. Nothing is pending then, since every task is between syscalls.
+
+static void ioUringHandoffSend(int fd) {
+	for (int i = 0; i < _io_uring_rings_l; i++) {
+		IoUringRing_t* ring = &_io_uring_rings[i];
+		if (!ring->_valid)
+			continue;
+		dprintf(fd, "ring %i %i %u %u %u %u %u %u %lu %lu\n",
+			ring->tgid,
+			ring->fd,
+			ring->flags,
+			ring->sq_entries,
+			ring->sq_off.head,
+			ring->sq_off.tail,
+			ring->sq_off.ring_mask,
+			ring->sq_off.array,
+			ring->sq_ring_addr,
+			ring->sqes_addr
+		);
+	}
+}
+
+static int ioUringHandoffReceive(const char* line) {
+	// Returns 0 if `line` isn't a valid "ring" line.
+	IoUringRing_t ring = { ._valid = 1 };
+	if (sscanf(line, "ring %i %i %u %u %u %u %u %u %lu %lu",
+		&ring.tgid,
+		&ring.fd,
+		&ring.flags,
+		&ring.sq_entries,
+		&ring.sq_off.head,
+		&ring.sq_off.tail,
+		&ring.sq_off.ring_mask,
+		&ring.sq_off.array,
+		&ring.sq_ring_addr,
+		&ring.sqes_addr
+	) != 10)
+		return 0;
+	*_ioUringNewRing() = ring;
+	_io_uring_rings_live++;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef INTERCEPTOR_LOGSAMPLE_C_INCL
+#define INTERCEPTOR_LOGSAMPLE_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <time.h>
+#include <linux/limits.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_stats.c"
+
+
+////// Sampled logging:
+
+// At _PATH_INTERCEPTOR_DEBUG=1, every rewrite is logged, which under load is millions of lines and a real share of the tracer's time.
+// With _PATH_INTERCEPTOR_LOG_MODE=sampled, each distinct (rule, original path) pair is only logged the first time it's seen, and after that every _PATH_INTERCEPTOR_LOG_SAMPLE_RATE-th time. Every _PATH_INTERCEPTOR_LOG_SUMMARY_INTERVAL seconds, a summary line gives the rates, the errors and the most rewritten paths since the last one.
+// Pairs are counted in a fixed-size table, probed like the path cache, so memory stays flat however long the tracer runs. A pair that got evicted is logged as new again.
+// Only the tracer thread logs rewrites, so there's no locking.
+
+static inline int log_sampled() {
+	GET_AND_CACHE_ENV(log_mode_s, "_PATH_INTERCEPTOR_LOG_MODE");
+	if (!log_mode_s || !strlen(log_mode_s) || strcmp(log_mode_s, "all") == 0)
+		return 0;
+	if (strcmp(log_mode_s, "sampled") == 0)
+		return 1;
+	LOG_PRINT("ERROR: Unknown log mode:\n\t%s\n", log_mode_s);
+	exit(1);
+}
+
+static inline long log_sample_rate() {
+	GET_AND_CACHE_ENV(sample_rate_s, "_PATH_INTERCEPTOR_LOG_SAMPLE_RATE");
+	return env_long(sample_rate_s, 1000);
+}
+
+static inline long log_summary_interval() {
+	GET_AND_CACHE_ENV(summary_interval_s, "_PATH_INTERCEPTOR_LOG_SUMMARY_INTERVAL");
+	return env_long(summary_interval_s, 10);
+}
+
+static inline long log_sample_table_size() {
+	GET_AND_CACHE_ENV(table_size_s, "_PATH_INTERCEPTOR_LOG_SAMPLE_TABLE_SIZE");
+	long table_size = env_long(table_size_s, 4096);
+	return table_size > 0 ? table_size : 4096;
+	// Sampling can't work without a table, so there's no turning it off.
+}
+
+#define _LOG_SAMPLE_PROBE 8
+// Slots looked at per lookup. A full window evicts its least recently seen pair.
+
+#define _LOG_SAMPLE_TOP 5
+// Paths listed per summary.
+
+typedef struct {
+	char* path;
+	// NULL if the slot is free.
+	size_t path_len;
+	uint64_t hash;
+	int rule;
+	unsigned long count;
+	unsigned long interval_count;
+	// Since the last summary.
+	uint64_t last_used;
+} _LogSampleEntry_t;
+
+static _LogSampleEntry_t* _log_sample_table;
+static size_t _log_sample_mask;
+static uint64_t _log_sample_clock;
+static unsigned long _log_sample_evictions;
+static int _log_sample_initialized;
+
+static struct timespec _log_sample_summary_time;
+static InterceptorStats_t _log_sample_summary_stats;
+// As of the last summary, for the rates.
+
+static void _logSampleSummary();
+
+static void _logSampleInit() {
+	_log_sample_initialized = 1;
+	size_t capacity = _LOG_SAMPLE_PROBE;
+	while (capacity < (size_t)log_sample_table_size())
+		capacity <<= 1;
+	_log_sample_table = (_LogSampleEntry_t*)calloc(capacity, sizeof(_LogSampleEntry_t));
+	if (!_log_sample_table) {
+		LOG_PRINT("ERROR: Could not allocate %zu log sampling entries. Lower _PATH_INTERCEPTOR_LOG_SAMPLE_TABLE_SIZE.\n", capacity);
+		exit(1);
+	}
+	_log_sample_mask = capacity - 1;
+	clock_gettime(CLOCK_MONOTONIC, &_log_sample_summary_time);
+	_log_sample_summary_stats = interceptor_stats;
+	if (log_summary_interval() > 0) {
+		// Covers whatever the last interval didn't, since process_signals() leaves through exit().
+		atexit(_logSampleSummary);
+	}
+}
+
+static uint64_t _logSampleHash(int rule, const char* path, size_t path_len) {
+	// FNV-1a, seeded with the rule.
+	uint64_t hash = 14695981039346656037ULL ^ (uint64_t)(unsigned)rule;
+	for (size_t i = 0; i < path_len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static unsigned long logSampleRewrite(int rule, const char* path, size_t path_len) {
+	// Count a rewrite of `path` by rule number `rule` (-1 if unknown). Returns how often the pair has been seen if it should be logged, 0 otherwise.
+	// Always 1 outside sampled mode.
+	if (!log_sampled())
+		return 1;
+	if (debug_level() < 1)
+		return 0;
+	if (!_log_sample_initialized)
+		_logSampleInit();
+
+	uint64_t hash = _logSampleHash(rule, path, path_len);
+	size_t home = hash & _log_sample_mask;
+	_LogSampleEntry_t* victim = NULL;
+	_log_sample_clock++;
+
+	for (size_t i = 0; i < _LOG_SAMPLE_PROBE; i++) {
+		_LogSampleEntry_t* entry = &_log_sample_table[(home + i) & _log_sample_mask];
+		if (!entry->path) {
+			if (!victim || victim->path)
+				victim = entry;
+			continue;
+		}
+		if (entry->hash == hash && entry->rule == rule && entry->path_len == path_len && memcmp(entry->path, path, path_len) == 0) {
+			entry->count++;
+			entry->interval_count++;
+			entry->last_used = _log_sample_clock;
+			long rate = log_sample_rate();
+			return (rate > 0 && (entry->count - 1) % rate == 0) ? entry->count : 0;
+		}
+		if (!victim || (victim->path && entry->last_used < victim->last_used))
+			victim = entry;
+	}
+
+	if (victim->path) {
+		_log_sample_evictions++;
+		free(victim->path);
+	}
+	victim->path = strndup(path, path_len);
+	victim->path_len = path_len;
+	victim->hash = hash;
+	victim->rule = rule;
+	victim->count = 1;
+	victim->interval_count = 1;
+	victim->last_used = _log_sample_clock;
+	return 1;
+}
+
+static const char* logSampleNote(unsigned long seen) {
+	// Extra line for the log message of a rewrite logSampleRewrite() saw `seen` times.
+	static char note[96];
+	if (seen <= 1)
+		return "";
+	snprintf(note, sizeof(note), "\t(Seen %lu times. Logging every %li.)\n", seen, log_sample_rate());
+	return note;
+}
+
+static void _logSampleSummary() {
+	// Log the rates and top paths since the last summary, and start a new interval.
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = (now.tv_sec - _log_sample_summary_time.tv_sec) + (now.tv_nsec - _log_sample_summary_time.tv_nsec) / 1e9;
+	if (seconds <= 0)
+		seconds = 1e-9;
+	InterceptorStats_t* last = &_log_sample_summary_stats;
+
+	_LogSampleEntry_t* top[_LOG_SAMPLE_TOP] = { NULL };
+	size_t distinct = 0;
+	for (size_t i = 0; i <= _log_sample_mask; i++) {
+		_LogSampleEntry_t* entry = &_log_sample_table[i];
+		if (!entry->path)
+			continue;
+		distinct++;
+		if (!entry->interval_count)
+			continue;
+		// Insertion into the short list, highest first.
+		int t = _LOG_SAMPLE_TOP;
+		while (t > 0 && (!top[t - 1] || top[t - 1]->interval_count < entry->interval_count)) {
+			if (t < _LOG_SAMPLE_TOP)
+				top[t] = top[t - 1];
+			t--;
+		}
+		if (t < _LOG_SAMPLE_TOP)
+			top[t] = entry;
+	}
+
+	char top_s[_LOG_SAMPLE_TOP * (PATH_MAX + 64)];
+	size_t top_len = 0;
+	top_s[0] = '\0';
+	for (int t = 0; t < _LOG_SAMPLE_TOP && top[t]; t++) {
+		top_len += snprintf(top_s + top_len, sizeof(top_s) - top_len, "\n\t%lu × %s (rule %i)", top[t]->interval_count, top[t]->path, top[t]->rule);
+	}
+
+	LOG_PRINT(
+		"Summary of the last %.1fs: %.0f syscalls/s, %.0f rewrites/s, %lu read errors, %lu unexpected PIDs. %zu distinct rewrites tracked, %lu evicted so far. Most rewritten:%s\n",
+		seconds,
+		(interceptor_stats.syscall_entries - last->syscall_entries) / seconds,
+		(interceptor_stats.path_rewrites - last->path_rewrites) / seconds,
+		interceptor_stats.read_errors - last->read_errors,
+		interceptor_stats.unexpected_pids - last->unexpected_pids,
+		distinct,
+		_log_sample_evictions,
+		top_len ? top_s : " nothing"
+	);
+
+	for (size_t i = 0; i <= _log_sample_mask; i++)
+		_log_sample_table[i].interval_count = 0;
+	_log_sample_summary_time = now;
+	_log_sample_summary_stats = interceptor_stats;
+}
+
+static void logSampleTick() {
+	// Call regularly from the tracer thread. Logs a summary when one is due.
+	// The coarse clock is a plain memory read, and plenty for whole seconds.
+	if (!_log_sample_initialized || log_summary_interval() <= 0)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec - _log_sample_summary_time.tv_sec >= log_summary_interval())
+		_logSampleSummary();
+}
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef INTERCEPTOR_MANIFEST_C_INCL
+#define INTERCEPTOR_MANIFEST_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include <sys/reg.h>
+#include <sys/syscall.h>
+
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_replace.h"
+#include "interceptor_stats.c"
+#include "interceptor_trace_types.h"
+
+
+////// Path manifest:
+
+// For working out what a program needs, E.G. which store paths to bundle into an AppImage, without logging every path at _PATH_INTERCEPTOR_DEBUG=2 and sifting through the output.
+// With _PATH_INTERCEPTOR_MANIFEST set to a filepath, each distinct (original path, syscall class, rewritten or not, succeeded or not) seen is kept in a hash set, and the set is written there sorted when the tracer exits.
+// Paths are noted at the syscall-enter-stop, and go into the set at the syscall-exit-stop, once the result is known. Only the tracer thread touches any of it, so there's no locking.
+// Paths inside io_uring SQEs aren't included, since their results come back through the completion queue.
+
+static inline const char* manifest_file() {
+	GET_AND_CACHE_ENV(manifest_s, "_PATH_INTERCEPTOR_MANIFEST");
+	return (manifest_s && strlen(manifest_s)) ? manifest_s : NULL;
+}
+
+static inline int manifest_nul() {
+	// 0 for JSON, 1 for NUL-terminated records.
+	GET_AND_CACHE_ENV(format_s, "_PATH_INTERCEPTOR_MANIFEST_FORMAT");
+	if (!format_s || !strlen(format_s) || strcmp(format_s, "json") == 0)
+		return 0;
+	if (strcmp(format_s, "nul") == 0)
+		return 1;
+	LOG_PRINT("ERROR: Unknown manifest format:\n\t%s\n", format_s);
+	exit(1);
+}
+
+typedef struct {
+	char* path;
+	// NULL if the slot is free.
+	size_t path_len;
+	uint64_t hash;
+	unsigned char path_class;
+	unsigned char rewritten;
+	unsigned char success;
+} _ManifestEntry_t;
+
+typedef struct {
+	int args_l;
+	int path_class;
+	char paths[SyscallJob_maxargs][PATH_MAX];
+	size_t paths_len[SyscallJob_maxargs];
+	unsigned char rewritten[SyscallJob_maxargs];
+	// Between a syscall-enter-stop and its exit-stop. Freed slots are reused through `args_l = -1`, buffers and all, so only paths that go into the set are ever allocated.
+} _ManifestPending_t;
+
+static const char* const _manifest_classes[] = { "open", "stat", "access", "readlink", "exec", "chdir", "modify" };
+#define _MANIFEST_CLASS_MODIFY 6
+// Anything that isn't just reading. Creating, removing, renaming and changing metadata.
+
+static _ManifestEntry_t* _manifest_entries;
+static size_t _manifest_cap;
+static size_t _manifest_l;
+static _ManifestPending_t* _manifest_pending;
+static int _manifest_pending_l;
+static PidMap_t _manifest_pending_by_pid;
+// Slot in `_manifest_pending` for each task that's in a syscall we noted paths for.
+
+
+static int _manifestClass(rax_t rax) {
+	switch (rax) {
+		case SYS_open:
+		case SYS_openat:
+		case SYS_creat:
+		case SYS_name_to_handle_at:
+		case SYS_open_by_handle_at:
+			return 0;
+		case SYS_stat:
+		case SYS_lstat:
+		case SYS_newfstatat:
+		case SYS_statx:
+		case SYS_statfs:
+		case SYS_getxattr:
+		case SYS_lgetxattr:
+		case SYS_listxattr:
+		case SYS_llistxattr:
+			return 1;
+		case SYS_access:
+		case SYS_faccessat:
+		case SYS_faccessat2:
+			return 2;
+		case SYS_readlink:
+		case SYS_readlinkat:
+			return 3;
+		case SYS_execve:
+		case SYS_execveat:
+			return 4;
+		case SYS_chdir:
+		case SYS_chroot:
+			return 5;
+		default:
+			return _MANIFEST_CLASS_MODIFY;
+	}
+}
+
+static uint64_t _manifestHash(const char* path, size_t path_len, int path_class, int rewritten, int success) {
+	// FNV-1a.
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < path_len; i++)
+		hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+	hash = (hash ^ (path_class << 2 | rewritten << 1 | success)) * 0x100000001b3ULL;
+	return hash;
+}
+
+static void _manifestGrow() {
+	size_t old_cap = _manifest_cap;
+	_ManifestEntry_t* old_entries = _manifest_entries;
+	_manifest_cap = old_cap ? old_cap * 2 : 1024;
+	_manifest_entries = (_ManifestEntry_t*)calloc(_manifest_cap, sizeof(_ManifestEntry_t));
+	for (size_t i = 0; i < old_cap; i++) {
+		if (!old_entries[i].path)
+			continue;
+		size_t j = old_entries[i].hash & (_manifest_cap - 1);
+		while (_manifest_entries[j].path)
+			j = (j + 1) & (_manifest_cap - 1);
+		_manifest_entries[j] = old_entries[i];
+	}
+	free(old_entries);
+}
+
+static void _manifestAdd(const char* path, size_t path_len, int path_class, int rewritten, int success) {
+	// Copies `path` if the tuple isn't in the set yet.
+	uint64_t hash = _manifestHash(path, path_len, path_class, rewritten, success);
+	if ((_manifest_l + 1) * 2 > _manifest_cap)
+		_manifestGrow();
+	size_t i = hash & (_manifest_cap - 1);
+	for (; _manifest_entries[i].path; i = (i + 1) & (_manifest_cap - 1)) {
+		_ManifestEntry_t* entry = &_manifest_entries[i];
+		if (entry->hash == hash && entry->path_len == path_len && entry->path_class == path_class && entry->rewritten == rewritten && entry->success == success && memcmp(entry->path, path, path_len) == 0)
+			return;
+	}
+	_manifest_entries[i] = (_ManifestEntry_t){ strndup(path, path_len), path_len, hash, path_class, rewritten, success };
+	_manifest_l++;
+	interceptor_stats.manifest_entries = _manifest_l;
+}
+
+static int _manifestCompare(const void* a, const void* b) {
+	const _ManifestEntry_t* entry_a = (const _ManifestEntry_t*)a;
+	const _ManifestEntry_t* entry_b = (const _ManifestEntry_t*)b;
+	int cmp = strcmp(entry_a->path, entry_b->path);
+	if (cmp)
+		return cmp;
+	cmp = strcmp(_manifest_classes[entry_a->path_class], _manifest_classes[entry_b->path_class]);
+	if (cmp)
+		return cmp;
+	if (entry_a->rewritten != entry_b->rewritten)
+		return entry_a->rewritten - entry_b->rewritten;
+	return entry_a->success - entry_b->success;
+}
+
+static void _manifestWriteJsonString(FILE* f, const char* s) {
+	// Bytes that aren't valid UTF-8 are passed through as they are, since there's no way to escape them in JSON.
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void _manifestWrite() {
+	// Compacts the set into a sorted array, so this has to be the last thing done with it.
+	size_t l = 0;
+	for (size_t i = 0; i < _manifest_cap; i++) {
+		if (_manifest_entries[i].path)
+			_manifest_entries[l++] = _manifest_entries[i];
+	}
+	qsort(_manifest_entries, l, sizeof(_ManifestEntry_t), _manifestCompare);
+
+	FILE* f = fopen(manifest_file(), "w");
+	if (!f) {
+		LOG_PRINT("ERROR: Could not write manifest:\n\t%s\n\t%s\n", manifest_file(), strerror(errno));
+		return;
+	}
+	int nul = manifest_nul();
+	if (!nul)
+		fputs("[\n", f);
+	for (size_t i = 0; i < l; i++) {
+		const _ManifestEntry_t* entry = &_manifest_entries[i];
+		if (nul) {
+			fprintf(f, "%s\t%s\t%s\t%s",
+				_manifest_classes[entry->path_class],
+				entry->rewritten ? "rewritten" : "original",
+				entry->success ? "ok" : "failed",
+				entry->path
+			);
+			fputc('\0', f);
+		} else {
+			fputs("\t{\"path\": ", f);
+			_manifestWriteJsonString(f, entry->path);
+			fprintf(f, ", \"class\": \"%s\", \"rewritten\": %s, \"success\": %s}%s\n",
+				_manifest_classes[entry->path_class],
+				entry->rewritten ? "true" : "false",
+				entry->success ? "true" : "false",
+				i + 1 < l ? "," : ""
+			);
+		}
+	}
+	if (!nul)
+		fputs("]\n", f);
+	fclose(f);
+	LOG_PRINT("Wrote %zu manifest entries:\n\t%s\n", l, manifest_file());
+}
+
+static void manifestInit() {
+	if (!manifest_file())
+		return;
+	manifest_nul();
+	// Fail on a bad format now, instead of at exit.
+	pidMapInit(&_manifest_pending_by_pid);
+	_manifestGrow();
+	atexit(_manifestWrite);
+}
+
+static void manifestEnter(SyscallJob_t* job) {
+	// Call on the tracer thread once `job` has been matched. Remembers its paths until manifestExit().
+	if (!manifest_file() || !job->args_l)
+		return;
+	int slot;
+	if (pidMapHas(&_manifest_pending_by_pid, job->pid)) {
+		slot = pidMapGet(&_manifest_pending_by_pid, job->pid);
+		// Left over from a syscall whose exit-stop never came, E.G. from a successful execve() in another thread. Just overwrite it.
+	} else {
+		for (slot = 0; slot < _manifest_pending_l && _manifest_pending[slot].args_l >= 0; slot++);
+		if (slot == _manifest_pending_l)
+			_manifest_pending = (_ManifestPending_t*)realloc(_manifest_pending, sizeof(_ManifestPending_t) * (++_manifest_pending_l));
+		pidMapSet(&_manifest_pending_by_pid, job->pid, slot);
+	}
+	_ManifestPending_t* pending = &_manifest_pending[slot];
+	pending->args_l = 0;
+	pending->path_class = _manifestClass(job->call.call_rax);
+	for (int i = 0; i < job->args_l; i++) {
+		const SyscallJobArg_t* arg = &job->args[i];
+		if (arg->read_errno != 0 || !arg->orig_file_len)
+			continue;
+		// Empty for AT_EMPTY_PATH, which is about the FD.
+		memcpy(pending->paths[pending->args_l], arg->arena.orig_file, arg->orig_file_len);
+		pending->paths_len[pending->args_l] = arg->orig_file_len;
+		pending->rewritten[pending->args_l] = arg->new_file_len != PATH_REPLACER_NO_MATCH;
+		pending->args_l++;
+	}
+}
+
+static void manifestExit(pid_t pid) {
+	// Call at every syscall-exit-stop.
+	if (!manifest_file() || !pidMapHas(&_manifest_pending_by_pid, pid))
+		return;
+	int slot = pidMapGet(&_manifest_pending_by_pid, pid);
+	pidMapRemove(&_manifest_pending_by_pid, pid);
+	_ManifestPending_t* pending = &_manifest_pending[slot];
+	long result = trace_backend->peek_user(pid, RAX);
+	for (int i = 0; i < pending->args_l; i++)
+		_manifestAdd(pending->paths[i], pending->paths_len[i], pending->path_class, pending->rewritten[i], result >= 0);
+	pending->args_l = -1;
+}
+
+static void manifestForget(pid_t pid) {
+	// Call when a task exits.
+	if (!manifest_file() || !pidMapHas(&_manifest_pending_by_pid, pid))
+		return;
+	int slot = pidMapGet(&_manifest_pending_by_pid, pid);
+	pidMapRemove(&_manifest_pending_by_pid, pid);
+	_manifest_pending[slot].args_l = -1;
+}
+
+#endif
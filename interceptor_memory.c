@@ -0,0 +1,133 @@
+#ifndef INTERCEPTOR_MEMORY_C_INCL
+#define INTERCEPTOR_MEMORY_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "interceptor_debug.c"
+
+
+////// Tracee memory:
+
+// Access to tracee memory. All return `errno` on failure, 0 otherwise.
+// Blocks go through process_vm_readv()/process_vm_writev() in one syscall, falling back to a word at a time through PTRACE_PEEKDATA/PTRACE_POKEDATA. The fallback also covers read-only pages, which only ptrace can write, and kernels without the calls.
+
+#define _TRACEE_MEMORY_VM_MIN (4 * sizeof (long))
+// Below this, a few PEEKs or POKEs are about as cheap.
+
+static int _tracee_memory_vm_broken;
+
+static int _traceeMemoryVm(pid_t pid, unsigned long addr, void* buf, size_t len, int write) {
+	// Returns 1 if the whole block was transferred.
+	if (len < _TRACEE_MEMORY_VM_MIN || _tracee_memory_vm_broken)
+		return 0;
+	struct iovec local = { .iov_base = buf, .iov_len = len };
+	struct iovec remote = { .iov_base = (void*)addr, .iov_len = len };
+	ssize_t done = write ? process_vm_writev(pid, &local, 1, &remote, 1, 0) : process_vm_readv(pid, &local, 1, &remote, 1, 0);
+	if (done < 0 && errno == ENOSYS)
+		_tracee_memory_vm_broken = 1;
+	return done == (ssize_t)len;
+}
+
+static int read_tracee_memory(pid_t pid, unsigned long addr, void* buf, size_t len) {
+	if (_traceeMemoryVm(pid, addr, buf, len, 0))
+		return 0;
+	char* out = (char*)buf;
+	while (len) {
+		unsigned long word_addr = addr & ~(sizeof (long) - 1);
+		size_t skip = addr - word_addr;
+		errno = 0;
+		long val = ptrace(PTRACE_PEEKDATA, pid, word_addr, NULL);
+		if (val == -1 && errno)
+			return errno;
+		size_t chunk_len = sizeof (long) - skip;
+		if (chunk_len > len)
+			chunk_len = len;
+		memcpy(out, (char*)&val + skip, chunk_len);
+		out += chunk_len;
+		addr += chunk_len;
+		len -= chunk_len;
+	}
+	return 0;
+}
+
+static int read_tracee_string(pid_t pid, unsigned long addr, char* buf, size_t cap, size_t* len) {
+	// `buf` is always left NUL-terminated, with whatever could be read on failure, and `*len` is its length.
+	size_t read_len = 0;
+
+	*buf = '\0';
+	*len = 0;
+
+	while (1) {
+		long val;
+		char *nul;
+
+		errno = 0;
+		val = ptrace(PTRACE_PEEKDATA, pid, addr, NULL);
+		if (val == -1 && errno) {
+			DEBUG_PRINT("PTRACE_PEEKDATA error at word %zu (%i %lx).\n",
+				read_len / sizeof (long),
+				pid,
+				addr
+			);
+			return errno;
+		}
+		addr += sizeof (long);
+
+		nul = memchr(&val, '\0', sizeof (long));
+		size_t chunk_len = nul ? (size_t)(nul - (char *) &val) : sizeof (long);
+
+		if (read_len + chunk_len + 1 > cap) {
+			DEBUG_PRINT("String longer than %zu bytes (%i %lx).\n",
+				cap,
+				pid,
+				addr
+			);
+			return ENAMETOOLONG;
+		}
+
+		memcpy(buf + read_len, &val, chunk_len);
+		read_len += chunk_len;
+		buf[read_len] = '\0';
+		*len = read_len;
+
+		if (nul)
+			return 0;
+	}
+}
+
+static int write_tracee_memory(pid_t pid, unsigned long addr, const void* buf, size_t len) {
+	if (_traceeMemoryVm(pid, addr, (void*)buf, len, 1))
+		return 0;
+	// Partial words at either end are read first, so the bytes around them are kept.
+	const char* in = (const char*)buf;
+	while (len) {
+		unsigned long word_addr = addr & ~(sizeof (long) - 1);
+		size_t skip = addr - word_addr;
+		size_t chunk_len = sizeof (long) - skip;
+		if (chunk_len > len)
+			chunk_len = len;
+		long val = 0;
+		if (chunk_len != sizeof (long)) {
+			errno = 0;
+			val = ptrace(PTRACE_PEEKDATA, pid, word_addr, NULL);
+			if (val == -1 && errno)
+				return errno;
+		}
+		memcpy((char*)&val + skip, in, chunk_len);
+		if (ptrace(PTRACE_POKEDATA, pid, word_addr, val) == -1)
+			return errno;
+		in += chunk_len;
+		addr += chunk_len;
+		len -= chunk_len;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,522 @@
+#ifndef INTERCEPTOR_OVERLAY_C_INCL
+#define INTERCEPTOR_OVERLAY_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <dirent.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/reg.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_replace.h"
+#include "interceptor_rules.c"
+#include "interceptor_stats.c"
+#include "interceptor_trace_types.h"
+
+
+////// Overlay listings:
+
+// getdents64() takes an FD, so a program listing a redirected directory only ever sees what's in the target.
+// Rules marked "@overlay" in the rules file change that for directories. When open() or openat() of a directory was rewritten by one, we remember the FD at the syscall-exit-stop, and answer getdents64() on it ourselves: the target's entries, plus the original directory's entries that the target doesn't have.
+// The merged listing is built once per pair of directories, sorted by name, and cached until either directory's mtime changes. Each FD keeps the listing it started with until it's rewound, like a real directory stream.
+// d_off is the position in the merged listing, so telldir() and seekdir() work, and lseek() on those FDs is answered from that too. FDs made by dup() and fcntl() aren't known, and neither are FDs from before a handoff.
+// Only close() is hooked, so before answering, /proc/PID/fd/FD is checked against the directory the FD was opened on. One that's been closed or replaced behind our back, E.G. by dup2() or close_range(), goes to the kernel again.
+
+static inline long overlay_cache_size() {
+	GET_AND_CACHE_ENV(cache_size_s, "_PATH_INTERCEPTOR_OVERLAY_CACHE_SIZE");
+	return env_long(cache_size_s, 64);
+}
+
+typedef struct {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} _OverlayDirent_t;
+// As getdents64() writes them.
+
+typedef struct {
+	int refs;
+	char* records;
+	size_t* offsets;
+	// Of each record in `records`, plus one for the end.
+	size_t count;
+} OverlayListing_t;
+
+typedef struct {
+	char* orig_dir;
+	// NULL if the slot is free.
+	char* target_dir;
+	struct stat orig_stat;
+	struct stat target_stat;
+	OverlayListing_t* listing;
+	unsigned long used;
+} _OverlayCacheEntry_t;
+
+typedef struct {
+	int _valid;
+	pid_t tgid;
+	int fd;
+	char* orig_dir;
+	char* target_dir;
+	OverlayListing_t* listing;
+	// NULL until the first getdents64(), and again after a rewind.
+	size_t position;
+	dev_t dev;
+	ino_t ino;
+	// Of the directory the FD was opened on.
+} OverlayDir_t;
+
+typedef struct {
+	char* orig_dir;
+	char* target_dir;
+	// Between the syscall-enter-stop of an open() and its exit-stop.
+} _OverlayPending_t;
+
+static int _overlay_rules_loaded;
+static char* _overlay_rules;
+// Whether each rule is an overlay, by index.
+static int _overlay_rules_l;
+static int _overlay_any;
+static OverlayDir_t* _overlay_dirs;
+static int _overlay_dirs_l;
+static int _overlay_dirs_live;
+// Until a tracee opens an overlay directory, the getdents64/lseek/close hooks stop right there.
+static _OverlayPending_t* _overlay_pending;
+static int _overlay_pending_l;
+static PidMap_t _overlay_pending_by_pid;
+static PidMap_t _overlay_tgids;
+static _OverlayCacheEntry_t* _overlay_cache;
+static unsigned long _overlay_cache_clock;
+
+
+static void _overlayLoadRules() {
+	if (_overlay_rules_loaded)
+		return;
+	_overlay_rules_loaded = 1;
+	RuleSet_t ruleset;
+	ruleSetInit(&ruleset);
+	ruleSetLoadEnv(&ruleset);
+	_overlay_rules_l = ruleset.length;
+	_overlay_rules = (char*)calloc(ruleset.length + 1, 1);
+	for (int i = 0; i < ruleset.length; i++) {
+		_overlay_rules[i] = ruleset.rules[i].is_overlay;
+		_overlay_any |= ruleset.rules[i].is_overlay;
+	}
+}
+
+static int overlay_enabled() {
+	// Whether any rule is an overlay. Also asked in the child, for patchInstallFilter().
+	_overlayLoadRules();
+	return _overlay_any;
+}
+
+static int overlay_call(rax_t rax) {
+	// Whether InterceptibleCalls[] only has it for overlays.
+	return rax == SYS_getdents64 || rax == SYS_lseek;
+}
+
+static void overlayInit() {
+	if (!overlay_enabled())
+		return;
+	pidMapInit(&_overlay_pending_by_pid);
+	pidMapInit(&_overlay_tgids);
+	_overlay_cache = (_OverlayCacheEntry_t*)calloc(overlay_cache_size() > 0 ? overlay_cache_size() : 1, sizeof(_OverlayCacheEntry_t));
+}
+
+static pid_t _overlayTgid(pid_t pid) {
+	if (pidMapHas(&_overlay_tgids, pid))
+		return pidMapGet(&_overlay_tgids, pid);
+	pid_t tgid = trace_backend->tgid(pid);
+	pidMapSet(&_overlay_tgids, pid, tgid);
+	return tgid;
+}
+
+
+//// Listings:
+
+typedef struct {
+	char* name;
+	uint64_t ino;
+	unsigned char type;
+	int from_target;
+} _OverlayName_t;
+
+static int _overlayCompareNames(const void* a, const void* b) {
+	const _OverlayName_t* name_a = (const _OverlayName_t*)a;
+	const _OverlayName_t* name_b = (const _OverlayName_t*)b;
+	int cmp = strcmp(name_a->name, name_b->name);
+	if (cmp)
+		return cmp;
+	return name_b->from_target - name_a->from_target;
+	// Target first, so it wins.
+}
+
+static int _overlayReadDir(const char* dir_path, int from_target, _OverlayName_t** names, size_t* names_l, size_t* names_cap) {
+	DIR* dir = opendir(dir_path);
+	if (!dir)
+		return 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir))) {
+		if (*names_l == *names_cap) {
+			*names_cap = *names_cap ? *names_cap * 2 : 64;
+			*names = (_OverlayName_t*)realloc(*names, sizeof(_OverlayName_t) * *names_cap);
+		}
+		(*names)[(*names_l)++] = (_OverlayName_t){ strdup(entry->d_name), entry->d_ino, entry->d_type, from_target };
+	}
+	closedir(dir);
+	return 1;
+}
+
+static OverlayListing_t* _overlayBuild(const char* orig_dir, const char* target_dir) {
+	_OverlayName_t* names = NULL;
+	size_t names_l = 0;
+	size_t names_cap = 0;
+	_overlayReadDir(target_dir, 1, &names, &names_l, &names_cap);
+	_overlayReadDir(orig_dir, 0, &names, &names_l, &names_cap);
+	qsort(names, names_l, sizeof(_OverlayName_t), _overlayCompareNames);
+
+	OverlayListing_t* listing = (OverlayListing_t*)calloc(1, sizeof(OverlayListing_t));
+	listing->refs = 1;
+	listing->offsets = (size_t*)malloc(sizeof(size_t) * (names_l + 1));
+	size_t records_cap = 0;
+	size_t records_len = 0;
+	for (size_t i = 0; i < names_l; i++) {
+		if (i && strcmp(names[i].name, names[i - 1].name) == 0)
+			continue;
+		size_t name_len = strlen(names[i].name);
+		unsigned short reclen = (offsetof(_OverlayDirent_t, d_name) + name_len + 1 + 7) & ~7;
+		if (records_len + reclen > records_cap) {
+			records_cap = (records_len + reclen) * 2;
+			listing->records = (char*)realloc(listing->records, records_cap);
+		}
+		_OverlayDirent_t* record = (_OverlayDirent_t*)(listing->records + records_len);
+		memset(record, 0, reclen);
+		record->d_ino = names[i].ino;
+		record->d_off = listing->count + 1;
+		record->d_reclen = reclen;
+		record->d_type = names[i].type;
+		memcpy(record->d_name, names[i].name, name_len);
+		listing->offsets[listing->count++] = records_len;
+		records_len += reclen;
+	}
+	listing->offsets[listing->count] = records_len;
+	for (size_t i = 0; i < names_l; i++)
+		free(names[i].name);
+	free(names);
+	interceptor_stats.overlay_merges++;
+	DEBUG_PRINT("Merged listing of %s and %s: %zu entries.\n", target_dir, orig_dir, listing->count);
+	return listing;
+}
+
+static void _overlayRelease(OverlayListing_t* listing) {
+	if (!listing || --listing->refs)
+		return;
+	free(listing->records);
+	free(listing->offsets);
+	free(listing);
+}
+
+static int _overlaySameStat(const struct stat* a, const struct stat* b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static OverlayListing_t* _overlayListing(const char* orig_dir, const char* target_dir) {
+	// A reference to the merged listing, from the cache if neither directory changed since.
+	struct stat orig_stat, target_stat;
+	if (stat(orig_dir, &orig_stat) != 0)
+		memset(&orig_stat, 0, sizeof(orig_stat));
+	if (stat(target_dir, &target_stat) != 0)
+		memset(&target_stat, 0, sizeof(target_stat));
+	long cache_size = overlay_cache_size();
+	_OverlayCacheEntry_t* victim = NULL;
+	for (long i = 0; i < cache_size; i++) {
+		_OverlayCacheEntry_t* entry = &_overlay_cache[i];
+		if (entry->orig_dir && strcmp(entry->orig_dir, orig_dir) == 0 && strcmp(entry->target_dir, target_dir) == 0) {
+			entry->used = ++_overlay_cache_clock;
+			if (_overlaySameStat(&entry->orig_stat, &orig_stat) && _overlaySameStat(&entry->target_stat, &target_stat)) {
+				entry->listing->refs++;
+				return entry->listing;
+			}
+			victim = entry;
+			break;
+		}
+		if (!victim || (victim->orig_dir && (!entry->orig_dir || entry->used < victim->used)))
+			victim = entry;
+	}
+	OverlayListing_t* listing = _overlayBuild(orig_dir, target_dir);
+	if (!victim)
+		return listing;
+	// _PATH_INTERCEPTOR_OVERLAY_CACHE_SIZE=0.
+	if (victim->orig_dir) {
+		free(victim->orig_dir);
+		free(victim->target_dir);
+		_overlayRelease(victim->listing);
+	}
+	victim->orig_dir = strdup(orig_dir);
+	victim->target_dir = strdup(target_dir);
+	victim->orig_stat = orig_stat;
+	victim->target_stat = target_stat;
+	victim->listing = listing;
+	victim->used = ++_overlay_cache_clock;
+	listing->refs++;
+	return listing;
+}
+
+
+//// Directory FDs:
+
+static OverlayDir_t* _overlayFindDir(pid_t tgid, int fd) {
+	for (int i = 0; i < _overlay_dirs_l; i++) {
+		if (_overlay_dirs[i]._valid && _overlay_dirs[i].tgid == tgid && _overlay_dirs[i].fd == fd)
+			return &_overlay_dirs[i];
+	}
+	return NULL;
+}
+
+static OverlayDir_t* _overlayNewDir() {
+	for (int i = 0; i < _overlay_dirs_l; i++) {
+		if (!_overlay_dirs[i]._valid)
+			return &_overlay_dirs[i];
+	}
+	_overlay_dirs = (OverlayDir_t*)realloc(_overlay_dirs, sizeof(OverlayDir_t) * (_overlay_dirs_l + 1));
+	return &_overlay_dirs[_overlay_dirs_l++];
+}
+
+static void _overlayForgetDir(OverlayDir_t* dir) {
+	free(dir->orig_dir);
+	free(dir->target_dir);
+	_overlayRelease(dir->listing);
+	dir->_valid = 0;
+	_overlay_dirs_live--;
+}
+
+static int _overlayFdStat(pid_t pid, int fd, struct stat* fd_stat) {
+	// stat() of what `fd` of `pid` refers to right now.
+	char fd_path[64];
+	snprintf(fd_path, sizeof(fd_path), "/proc/%i/fd/%i", pid, fd);
+	return stat(fd_path, fd_stat) == 0;
+}
+
+static OverlayDir_t* _overlayCheckedDir(pid_t pid) {
+	// The directory for the FD in `pid`'s first syscall argument, if it's still the one it was opened on.
+	int fd = trace_backend->peek_user(pid, RDI);
+	OverlayDir_t* dir = _overlayFindDir(_overlayTgid(pid), fd);
+	if (!dir)
+		return NULL;
+	struct stat fd_stat;
+	if (!_overlayFdStat(pid, fd, &fd_stat) || fd_stat.st_dev != dir->dev || fd_stat.st_ino != dir->ino) {
+		DEBUG_PRINT("Overlay directory FD was replaced (PID %i FD %i). Forgetting it.\n", pid, fd);
+		_overlayForgetDir(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+static void overlayEnter(SyscallJob_t* job) {
+	// Call on the tracer thread once `job` has been matched. Remembers directories opened through an overlay rule until overlayExit().
+	if (!_overlay_any || job->args_l < 1 || (job->call.call_rax != SYS_open && job->call.call_rax != SYS_openat))
+		return;
+	const SyscallJobArg_t* arg = &job->args[0];
+	if (arg->read_errno != 0 || arg->new_file_len == PATH_REPLACER_NO_MATCH || arg->rule < 0 || arg->rule >= _overlay_rules_l || !_overlay_rules[arg->rule])
+		return;
+	if (arg->arena.orig_file[0] != '/' || strcmp(arg->arena.orig_file, arg->arena.new_file) == 0)
+		return;
+	int slot;
+	if (pidMapHas(&_overlay_pending_by_pid, job->pid)) {
+		slot = pidMapGet(&_overlay_pending_by_pid, job->pid);
+		free(_overlay_pending[slot].orig_dir);
+		free(_overlay_pending[slot].target_dir);
+	} else {
+		for (slot = 0; slot < _overlay_pending_l && _overlay_pending[slot].orig_dir; slot++);
+		if (slot == _overlay_pending_l)
+			_overlay_pending = (_OverlayPending_t*)realloc(_overlay_pending, sizeof(_OverlayPending_t) * (++_overlay_pending_l));
+		pidMapSet(&_overlay_pending_by_pid, job->pid, slot);
+	}
+	_overlay_pending[slot].orig_dir = strdup(arg->arena.orig_file);
+	_overlay_pending[slot].target_dir = strdup(arg->arena.new_file);
+}
+
+static void _overlayClearPending(pid_t pid, _OverlayPending_t* pending) {
+	pidMapRemove(&_overlay_pending_by_pid, pid);
+	free(pending->orig_dir);
+	free(pending->target_dir);
+	pending->orig_dir = NULL;
+	pending->target_dir = NULL;
+}
+
+static void overlayExit(pid_t pid) {
+	// Call at every syscall-exit-stop.
+	if (!_overlay_any || !pidMapHas(&_overlay_pending_by_pid, pid))
+		return;
+	_OverlayPending_t* pending = &_overlay_pending[pidMapGet(&_overlay_pending_by_pid, pid)];
+	long fd = trace_backend->peek_user(pid, RAX);
+	struct stat orig_stat, target_stat;
+	if (fd < 0 || !_overlayFdStat(pid, fd, &target_stat) || !S_ISDIR(target_stat.st_mode) || stat(pending->orig_dir, &orig_stat) != 0 || !S_ISDIR(orig_stat.st_mode)) {
+		// Nothing to merge unless both are directories.
+		_overlayClearPending(pid, pending);
+		return;
+	}
+	pid_t tgid = _overlayTgid(pid);
+	OverlayDir_t* dir = _overlayFindDir(tgid, fd);
+	if (dir)
+		_overlayForgetDir(dir);
+	// Closed behind our back, E.G. by close_range().
+	dir = _overlayNewDir();
+	*dir = (OverlayDir_t){ 1, tgid, (int)fd, pending->orig_dir, pending->target_dir, NULL, 0, target_stat.st_dev, target_stat.st_ino };
+	_overlay_dirs_live++;
+	pending->orig_dir = NULL;
+	pending->target_dir = NULL;
+	pidMapRemove(&_overlay_pending_by_pid, pid);
+	DEBUG_PRINT("Overlay directory (PID %i FD %li):\n\t%s\n\t+\t%s\n", pid, fd, dir->target_dir, dir->orig_dir);
+}
+
+static void _overlayAnswer(pid_t pid, long result) {
+	// Skip the syscall, and have it return `result`. See emulate_syscall().
+	struct user_regs_struct regs;
+	if (trace_backend->get_regs(pid, &regs) != 0)
+		return;
+	regs.orig_rax = -1;
+	regs.rax = result;
+	trace_backend->set_regs(pid, &regs);
+}
+
+static void PREHOOK_getdents64(pid_t pid) {
+	if (!_overlay_dirs_live)
+		return;
+	OverlayDir_t* dir = _overlayCheckedDir(pid);
+	if (!dir)
+		return;
+	unsigned long buf_addr = trace_backend->peek_user(pid, RSI);
+	size_t buf_len = trace_backend->peek_user(pid, RDX);
+	if (!dir->listing)
+		dir->listing = _overlayListing(dir->orig_dir, dir->target_dir);
+	OverlayListing_t* listing = dir->listing;
+	size_t end = dir->position;
+	if (end > listing->count)
+		end = listing->count;
+	size_t start = end;
+	while (end < listing->count && listing->offsets[end + 1] - listing->offsets[start] <= buf_len)
+		end++;
+	size_t len = listing->offsets[end] - listing->offsets[start];
+	interceptor_stats.overlay_reads++;
+	if (end == start && start < listing->count) {
+		_overlayAnswer(pid, -EINVAL);
+		return;
+	}
+	if (len) {
+		int write_errno = trace_backend->write_memory(pid, buf_addr, listing->records + listing->offsets[start], len);
+		if (write_errno != 0) {
+			_overlayAnswer(pid, -write_errno);
+			return;
+		}
+	}
+	dir->position = end;
+	_overlayAnswer(pid, len);
+}
+
+static void PREHOOK_lseek(pid_t pid) {
+	if (!_overlay_dirs_live)
+		return;
+	OverlayDir_t* dir = _overlayCheckedDir(pid);
+	if (!dir)
+		return;
+	long offset = trace_backend->peek_user(pid, RSI);
+	int whence = trace_backend->peek_user(pid, RDX);
+	if (whence == SEEK_CUR)
+		offset += dir->position;
+	else if (whence != SEEK_SET)
+		offset = -1;
+	if (offset < 0) {
+		_overlayAnswer(pid, -EINVAL);
+		return;
+	}
+	if (offset == 0) {
+		// rewinddir(). Picks up changes, like a real directory would.
+		_overlayRelease(dir->listing);
+		dir->listing = NULL;
+	}
+	dir->position = offset;
+	_overlayAnswer(pid, offset);
+}
+
+static void overlayClosed(pid_t pid) {
+	// Call at close()'s syscall-enter-stop.
+	if (!_overlay_dirs_live)
+		return;
+	OverlayDir_t* dir = _overlayFindDir(_overlayTgid(pid), trace_backend->peek_user(pid, RDI));
+	if (dir)
+		_overlayForgetDir(dir);
+}
+
+static void overlayExecved(pid_t pid) {
+	// Call at execve()'s syscall-exit-stop. opendir() FDs are close-on-exec, and others are rare enough to just serve plainly from here on.
+	if (!_overlay_dirs_live || (long)trace_backend->peek_user(pid, RAX) != 0)
+		return;
+	pid_t tgid = _overlayTgid(pid);
+	for (int i = 0; i < _overlay_dirs_l; i++) {
+		if (_overlay_dirs[i]._valid && _overlay_dirs[i].tgid == tgid)
+			_overlayForgetDir(&_overlay_dirs[i]);
+	}
+}
+
+
+//// Task lifecycle:
+
+static void overlayForked(pid_t parent_pid, pid_t child_pid) {
+	// A new process gets copies of its parent's FDs. Their positions are really shared, but copying is close enough for directories.
+	if (!_overlay_dirs_live)
+		return;
+	pid_t parent_tgid = _overlayTgid(parent_pid);
+	pid_t child_tgid = _overlayTgid(child_pid);
+	if (parent_tgid == child_tgid)
+		return;
+	int dirs_l = _overlay_dirs_l;
+	for (int i = 0; i < dirs_l; i++) {
+		if (!_overlay_dirs[i]._valid || _overlay_dirs[i].tgid != parent_tgid)
+			continue;
+		OverlayDir_t copy = _overlay_dirs[i];
+		OverlayDir_t* dir = _overlayNewDir();
+		*dir = copy;
+		dir->tgid = child_tgid;
+		dir->orig_dir = strdup(copy.orig_dir);
+		dir->target_dir = strdup(copy.target_dir);
+		if (dir->listing)
+			dir->listing->refs++;
+		_overlay_dirs_live++;
+	}
+}
+
+static void overlayForget(pid_t pid) {
+	if (!_overlay_any)
+		return;
+	if (pidMapHas(&_overlay_pending_by_pid, pid))
+		_overlayClearPending(pid, &_overlay_pending[pidMapGet(&_overlay_pending_by_pid, pid)]);
+	if (!pidMapHas(&_overlay_tgids, pid))
+		return;
+	if (_overlay_dirs_live && pidMapGet(&_overlay_tgids, pid) == pid) {
+		// Thread group leader gone, so the process is.
+		for (int i = 0; i < _overlay_dirs_l; i++) {
+			if (_overlay_dirs[i]._valid && _overlay_dirs[i].tgid == pid)
+				_overlayForgetDir(&_overlay_dirs[i]);
+		}
+	}
+	pidMapRemove(&_overlay_tgids, pid);
+}
+
+#endif
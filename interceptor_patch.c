@@ -0,0 +1,645 @@
+#ifndef INTERCEPTOR_PATCH_C_INCL
+#define INTERCEPTOR_PATCH_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/reg.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_emulate.c"
+#include "interceptor_manifest.c"
+#include "interceptor_overlay.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_rules.c"
+#include "interceptor_stats.c"
+#include "interceptor_trace_calls.c"
+#include "interceptor_trace_types.h"
+
+
+////// Syscall-site patching:
+
+// Under PTRACE_SYSCALL, every syscall a tracee makes costs two stops, path or not. With _PATH_INTERCEPTOR_PATCH=1, the main target starts with a seccomp filter that only stops for the syscalls in InterceptibleCalls, as PTRACE_EVENT_SECCOMP, and the tracer resumes with PTRACE_CONT. Syscall-exit-stops are only asked for by syscalls with an exit hook.
+// On top of that, hot call sites of single-path syscalls get patched to skip the tracer entirely. glibc's wrappers mostly do `mov $NR, %eax; syscall`. Once a site has stopped _PATH_INTERCEPTOR_PATCH_THRESHOLD times, the tracer overwrites the `mov` with a `jmp` to a stub in a region it maps into the tracee, by hijacking one of its syscalls for an mmap(). The stub sets EAX, and calls a handler that matches the path against a copy of the rules stored in the region, builds the rewritten path on the stack, and makes the syscall itself with a marker in R9, which the filter lets through.
+// That only works for rule sets that are all literal prefixes with a single candidate, since there's no regex engine in the tracee. Other rule sets, and _PATH_INTERCEPTOR_MANIFEST, just get the filter. Patched calls skip emulation, logging and the stats, so syscalls with hooks, and emulated ones with _PATH_INTERCEPTOR_EMULATE, are never patched.
+// The `syscall` itself is left alone, so a thread that was preempted between the two instructions still makes its syscall the old way. The `jmp` is written with a single aligned PTRACE_POKEDATA, or only while the process has one thread otherwise, so no thread ever runs half an instruction. A bad path pointer crashes the tracee in the handler instead of failing with EFAULT, except for NULL.
+// Patches are forgotten on exec, and forked children start their own region when they need one. Only tracees we start get the filter, so daemon mode, handoffs and recording don't patch.
+
+static inline int patch_enabled() {
+	GET_AND_CACHE_ENV(patch_s, "_PATH_INTERCEPTOR_PATCH");
+	return (patch_s && strcmp(patch_s, "1") == 0);
+}
+
+static inline long patch_threshold() {
+	GET_AND_CACHE_ENV(threshold_s, "_PATH_INTERCEPTOR_PATCH_THRESHOLD");
+	return env_long(threshold_s, 16);
+}
+
+static inline int patch_usable() {
+	// Whether tracees we start get the seccomp filter. The tracer resumes them differently if they do, so the child and process_signals() both ask this.
+	return patch_enabled() && !trace_record_file() && !trace_replay_file();
+}
+
+#define _PATCH_MAGIC 0x4d49484354415021ULL
+#define _PATCH_MAGIC_S "0x4d49484354415021"
+// In R9 for syscalls made by the handler. None of the patchable syscalls use a sixth argument.
+
+#define _PATCH_REGION_SIZE (64 << 10)
+#define _PATCH_REGION_REACH ((1UL << 31) - (1UL << 20))
+// How far a region can be from a site, for a rel32 jump either way.
+
+#define _PATCH_MAX_REGIONS 4
+#define _PATCH_SITES 256
+// Slots for call sites per process, probed like the path cache. Sites that don't fit are never patched.
+
+#define _PATCH_SITE_PROBE 8
+#define _PATCH_STUB_SIZE 32
+#define _PATCH_SITE_LEN 7
+// `mov $NR, %eax` and `syscall`.
+
+#define _PATCH_HANDLER_RDI 1
+#define _PATCH_HANDLER_RSI 2
+
+
+//// Handler:
+
+// Copied into each region, followed by the rule table. Position-independent, and without anything the C side could have put elsewhere.
+// Table: u32 rule count, u32 padding, then per rule u32 prefix offset, prefix length, replacement offset, replacement length, with offsets from the start of the table.
+
+__asm__(
+	".pushsection .text\n"
+	".balign 16\n"
+	".globl patch_blob_start\n"
+	".hidden patch_blob_start\n"
+	"patch_blob_start:\n"
+
+	".macro PATCH_HANDLER reg\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	push %rbx\n"
+	"	push %r12\n"
+	"	push %r13\n"
+	"	push %r14\n"
+	"	push %r15\n"
+	"	push %r9\n"
+	"	push %rax\n"
+	"	push %rdi\n"
+	"	push %rsi\n"
+	"	mov %\\reg, %r12\n"
+	"	test %r12, %r12\n"
+	"	jz 8f\n"
+	"	lea .Lpatch_table(%rip), %r15\n"
+	"	mov (%r15), %r14d\n"
+	"	lea 8(%r15), %r13\n"
+	"1:	test %r14d, %r14d\n"
+	"	jz 8f\n"
+	"	mov (%r13), %ebx\n"
+	"	add %r15, %rbx\n"
+	"	mov 4(%r13), %ecx\n"
+	"	xor %r11d, %r11d\n"
+	"2:	cmp %rcx, %r11\n"
+	"	je 4f\n"
+	"	movzbl (%r12,%r11), %eax\n"
+	"	cmp (%rbx,%r11), %al\n"
+	"	jne 3f\n"
+	"	inc %r11\n"
+	"	jmp 2b\n"
+	"3:	add $16, %r13\n"
+	"	dec %r14d\n"
+	"	jmp 1b\n"
+	// Rule at R13 matched the first R11 bytes. Build the new path on the stack.
+	"4:	mov %r12, %rdi\n"
+	"	xor %eax, %eax\n"
+	"	mov $-1, %rcx\n"
+	"	repne scasb\n"
+	"	not %rcx\n"
+	"	sub %r11, %rcx\n"
+	"	mov %rcx, %rbx\n"
+	"	mov 12(%r13), %r14d\n"
+	"	lea (%rbx,%r14), %rcx\n"
+	"	cmp $4096, %rcx\n"
+	"	ja 7f\n"
+	"	add $15, %rcx\n"
+	"	and $-16, %rcx\n"
+	"	sub %rcx, %rsp\n"
+	"	mov %rsp, %rdi\n"
+	"	mov 8(%r13), %esi\n"
+	"	add %r15, %rsi\n"
+	"	mov %r14, %rcx\n"
+	"	rep movsb\n"
+	"	lea (%r12,%r11), %rsi\n"
+	"	mov %rbx, %rcx\n"
+	"	rep movsb\n"
+	"	mov %rsp, %r12\n"
+	"	mov -64(%rbp), %rdi\n"
+	"	mov -72(%rbp), %rsi\n"
+	"	mov %r12, %\\reg\n"
+	"	jmp 8f\n"
+	// Too long. Passed through, like the tracer does.
+	"7:	mov -64(%rbp), %rdi\n"
+	"	mov -72(%rbp), %rsi\n"
+	"8:	mov -56(%rbp), %rax\n"
+	"	movabs $" _PATCH_MAGIC_S ", %r9\n"
+	"	syscall\n"
+	"	mov -48(%rbp), %r9\n"
+	"	mov -64(%rbp), %rdi\n"
+	"	mov -72(%rbp), %rsi\n"
+	"	mov -8(%rbp), %rbx\n"
+	"	mov -16(%rbp), %r12\n"
+	"	mov -24(%rbp), %r13\n"
+	"	mov -32(%rbp), %r14\n"
+	"	mov -40(%rbp), %r15\n"
+	"	mov %rbp, %rsp\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".endm\n"
+
+	".globl patch_handler_rdi\n"
+	".hidden patch_handler_rdi\n"
+	"patch_handler_rdi:\n"
+	"	PATCH_HANDLER rdi\n"
+	".globl patch_handler_rsi\n"
+	".hidden patch_handler_rsi\n"
+	"patch_handler_rsi:\n"
+	"	PATCH_HANDLER rsi\n"
+	".purgem PATCH_HANDLER\n"
+
+	".balign 16\n"
+	".globl patch_blob_end\n"
+	".hidden patch_blob_end\n"
+	"patch_blob_end:\n"
+	".Lpatch_table:\n"
+	".popsection\n"
+);
+
+extern const unsigned char patch_blob_start[];
+extern const unsigned char patch_handler_rdi[];
+extern const unsigned char patch_handler_rsi[];
+extern const unsigned char patch_blob_end[];
+
+
+//// State:
+
+typedef struct {
+	unsigned long addr;
+	// Of the `mov`. 0 if the slot is free.
+	unsigned long count;
+	int state;
+} _PatchSite_t;
+
+#define _PATCH_SITE_COUNTING 0
+#define _PATCH_SITE_PATCHED 1
+#define _PATCH_SITE_UNPATCHABLE 2
+
+typedef struct {
+	unsigned long base;
+	size_t used;
+} _PatchRegion_t;
+
+typedef struct {
+	pid_t tgid;
+	_PatchRegion_t regions[_PATCH_MAX_REGIONS];
+	int regions_l;
+	int cannot_map;
+	// Set once an mmap() fails, so it isn't tried on every stop.
+	pid_t injecting_pid;
+	unsigned long injecting_addr;
+	struct user_regs_struct injecting_regs;
+	// The hijacked syscall's registers, to start it again once the region is mapped.
+	_PatchSite_t sites[_PATCH_SITES];
+} _PatchProcess_t;
+
+static int patch_filtered;
+// The tracees have the seccomp filter, and are resumed with PTRACE_CONT whenever no syscall-exit-stop is wanted.
+static int _patch_sites_enabled;
+static char _patch_handlers[_INTERCEPTIBLE_CALL_INDEX_L];
+// _PATCH_HANDLER_* by syscall number, or 0 if it can't be patched.
+static unsigned char* _patch_table;
+static size_t _patch_table_len;
+static _PatchProcess_t** _patch_processes;
+static int _patch_processes_l;
+static PidMap_t _patch_tgids;
+// Cached, since /proc is slow.
+
+
+static int _patchCallable(int i) {
+	// Whether InterceptibleCalls[i] can be answered by the handler alone.
+	const InterceptibleCall_t* call = &InterceptibleCalls[i];
+	if (call->pre_hook || call->post_hook || call->exit_hook || (call->emulation && emulate_enabled()))
+		return 0;
+	if (!call->call_filearg_registers[0] || (InterceptibleCall_maxargs_l > 1 && call->call_filearg_registers[1]))
+		return 0;
+	return call->call_filearg_registers[0] == RDI ? _PATCH_HANDLER_RDI : call->call_filearg_registers[0] == RSI ? _PATCH_HANDLER_RSI : 0;
+}
+
+static void _patchBuildHandlers() {
+	for (int nr = 0; nr < _INTERCEPTIBLE_CALL_INDEX_L; nr++) {
+		int i = get_interceptible_call_index(nr);
+		_patch_handlers[nr] = i >= 0 ? _patchCallable(i) : 0;
+	}
+}
+
+static int _patchBuildTable() {
+	// Returns 0 if the rules can't be matched by the handler.
+	RuleSet_t ruleset;
+	ruleSetInit(&ruleset);
+	ruleSetLoadEnv(&ruleset);
+	if (!ruleset.length)
+		return 0;
+	size_t len = 8 + 16 * ruleset.length;
+	for (int i = 0; i < ruleset.length; i++) {
+		const InterceptRule_t* rule = &ruleset.rules[i];
+		if (rule->is_overlay) {
+			LOG_PRINT("Rule %i is an overlay, whose directory FDs have to be seen opening. Only filtering syscalls, not patching any.\n", i);
+			return 0;
+		}
+		if (!rule->is_literal_prefix || rule->candidates_l != 1) {
+			LOG_PRINT("Rule %i isn't a literal prefix with a single replacement. Only filtering syscalls, not patching any.\n", i);
+			return 0;
+		}
+		len += rule->literal_prefix_len + rule->candidates_len[0];
+	}
+	if ((size_t)(patch_blob_end - patch_blob_start) + len > _PATCH_REGION_SIZE / 2) {
+		LOG_PRINT("Rules are too long to patch into tracees. Only filtering syscalls.\n");
+		return 0;
+	}
+	_patch_table = (unsigned char*)calloc(1, len);
+	_patch_table_len = len;
+	uint32_t* header = (uint32_t*)_patch_table;
+	header[0] = ruleset.length;
+	size_t strings = 8 + 16 * ruleset.length;
+	for (int i = 0; i < ruleset.length; i++) {
+		const InterceptRule_t* rule = &ruleset.rules[i];
+		uint32_t* entry = (uint32_t*)(_patch_table + 8 + 16 * i);
+		entry[0] = strings;
+		entry[1] = rule->literal_prefix_len;
+		memcpy(_patch_table + strings, rule->literal_prefix, rule->literal_prefix_len);
+		strings += rule->literal_prefix_len;
+		entry[2] = strings;
+		entry[3] = rule->candidates_len[0];
+		memcpy(_patch_table + strings, rule->candidates_s[0], rule->candidates_len[0]);
+		strings += rule->candidates_len[0];
+	}
+	return 1;
+}
+
+static void patchInit(pid_t child) {
+	// `child` is the main target, if we started it. See patch_usable().
+	patch_filtered = child && patch_usable();
+	if (!patch_filtered)
+		return;
+	pidMapInit(&_patch_tgids);
+	_patchBuildHandlers();
+	if (manifest_file()) {
+		LOG_PRINT("Writing a manifest, which needs to see every call. Only filtering syscalls, not patching any.\n");
+	} else {
+		_patch_sites_enabled = _patchBuildTable();
+	}
+	LOG_PRINT("Tracing through a seccomp filter%s.\n", _patch_sites_enabled ? ", and patching hot call sites" : "");
+}
+
+
+//// Filter:
+
+static void patchInstallFilter() {
+	// Call in the child, after the tracer has set PTRACE_O_TRACESECCOMP, since SECCOMP_RET_TRACE fails syscalls with ENOSYS otherwise.
+	_patchBuildHandlers();
+	int nrs[_INTERCEPTIBLE_CALL_INDEX_L];
+	int nrs_l = 0;
+	for (int nr = 0; nr < _INTERCEPTIBLE_CALL_INDEX_L; nr++) {
+		if (get_interceptible_call_index(nr) >= 0 && (!overlay_call(nr) || overlay_enabled()))
+			nrs[nrs_l++] = nr;
+	}
+
+	struct sock_filter filter[_INTERCEPTIBLE_CALL_INDEX_L + 16];
+	int l = 0;
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+	filter[l++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, nrs_l + 1);
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+	// Then one jump per syscall, to "trace" or "check", after the "allow" right behind them.
+	for (int i = 0; i < nrs_l; i++) {
+		int to_allow = nrs_l - 1 - i;
+		filter[l++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nrs[i], to_allow + 1 + (_patch_handlers[nrs[i]] ? 1 : 0), 0);
+	}
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+	// Check: made by the handler?
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[5]));
+	filter[l++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)_PATCH_MAGIC, 0, 3);
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[5]) + 4);
+	filter[l++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)(_PATCH_MAGIC >> 32), 0, 1);
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+	filter[l++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+
+	struct sock_fprog program = { .len = (unsigned short)l, .filter = filter };
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) != 0) {
+		LOG_PRINT("ERROR: Could not install the seccomp filter for _PATH_INTERCEPTOR_PATCH:\n\t%s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+
+//// Sites:
+
+static _PatchProcess_t* _patchProcess(pid_t pid) {
+	pid_t tgid;
+	if (pidMapHas(&_patch_tgids, pid)) {
+		tgid = pidMapGet(&_patch_tgids, pid);
+	} else {
+		tgid = trace_backend->tgid(pid);
+		pidMapSet(&_patch_tgids, pid, tgid);
+	}
+	for (int i = 0; i < _patch_processes_l; i++) {
+		if (_patch_processes[i]->tgid == tgid)
+			return _patch_processes[i];
+	}
+	_patch_processes = (_PatchProcess_t**)realloc(_patch_processes, sizeof(_PatchProcess_t*) * (_patch_processes_l + 1));
+	_PatchProcess_t* process = (_PatchProcess_t*)calloc(1, sizeof(_PatchProcess_t));
+	process->tgid = tgid;
+	_patch_processes[_patch_processes_l++] = process;
+	return process;
+}
+
+static void _patchForgetProcess(pid_t tgid) {
+	for (int i = 0; i < _patch_processes_l; i++) {
+		if (_patch_processes[i]->tgid == tgid) {
+			free(_patch_processes[i]);
+			_patch_processes[i] = _patch_processes[--_patch_processes_l];
+			return;
+		}
+	}
+}
+
+static _PatchSite_t* _patchSite(_PatchProcess_t* process, unsigned long addr) {
+	// Find or add. NULL if the window is full.
+	size_t home = (addr * 0x9E3779B97F4A7C15ULL) >> 56;
+	_PatchSite_t* free_site = NULL;
+	for (size_t i = 0; i < _PATCH_SITE_PROBE; i++) {
+		_PatchSite_t* site = &process->sites[(home + i) % _PATCH_SITES];
+		if (site->addr == addr)
+			return site;
+		if (!site->addr && !free_site)
+			free_site = site;
+	}
+	if (free_site)
+		free_site->addr = addr;
+	return free_site;
+}
+
+static int _patchThreads(pid_t tgid) {
+	char status_path[64];
+	char line[256];
+	int threads = 0;
+	snprintf(status_path, sizeof(status_path), "/proc/%i/status", tgid);
+	FILE* f = fopen(status_path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "Threads:", 8) == 0) {
+			threads = strtol(line + 8, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return threads;
+}
+
+static unsigned long _patchFindGap(pid_t tgid, unsigned long site) {
+	// A free, page-aligned address for a region within reach of `site`, or 0.
+	char maps_path[64];
+	char line[512];
+	snprintf(maps_path, sizeof(maps_path), "/proc/%i/maps", tgid);
+	FILE* f = fopen(maps_path, "r");
+	if (!f)
+		return 0;
+	unsigned long best = 0;
+	unsigned long best_distance = _PATCH_REGION_REACH;
+	unsigned long gap_start = 0x10000;
+	// Above the usual vm.mmap_min_addr.
+	int done = 0;
+	while (!done) {
+		unsigned long start, end;
+		if (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+				continue;
+		} else {
+			start = end = 0x7ffffffff000UL;
+			done = 1;
+		}
+		if (start > gap_start && start - gap_start >= _PATCH_REGION_SIZE) {
+			unsigned long addr = site & ~0xfffUL;
+			if (addr < gap_start)
+				addr = gap_start;
+			if (addr > start - _PATCH_REGION_SIZE)
+				addr = start - _PATCH_REGION_SIZE;
+			unsigned long distance = addr > site ? addr + _PATCH_REGION_SIZE - site : site - addr;
+			if (distance < best_distance) {
+				best = addr;
+				best_distance = distance;
+			}
+		}
+		if (end > gap_start)
+			gap_start = end;
+	}
+	fclose(f);
+	return best;
+}
+
+static _PatchRegion_t* _patchRegion(_PatchProcess_t* process, unsigned long site) {
+	// A region with room for one more stub, within reach of `site`.
+	for (int i = 0; i < process->regions_l; i++) {
+		_PatchRegion_t* region = &process->regions[i];
+		unsigned long distance = region->base > site ? region->base + _PATCH_REGION_SIZE - site : site - region->base;
+		if (distance < _PATCH_REGION_REACH && region->used + _PATCH_STUB_SIZE <= _PATCH_REGION_SIZE)
+			return region;
+	}
+	return NULL;
+}
+
+static void _patchPut32(unsigned char* p, uint32_t value) {
+	memcpy(p, &value, 4);
+}
+
+static int _patchApply(pid_t pid, _PatchRegion_t* region, _PatchSite_t* site, int handler) {
+	// Write the stub for `site` into `region`, then point the site at it. Returns 0 if nothing was changed.
+	unsigned long stub_addr = region->base + region->used;
+	unsigned long handler_addr = region->base + ((handler == _PATCH_HANDLER_RDI ? patch_handler_rdi : patch_handler_rsi) - patch_blob_start);
+	unsigned char stub[_PATCH_STUB_SIZE];
+	unsigned char code[_PATCH_SITE_LEN];
+	if (trace_backend->read_memory(pid, site->addr, code, sizeof(code)) != 0)
+		return 0;
+	memset(stub, 0xcc, sizeof(stub));
+	memcpy(stub, code, 5);
+	// mov $NR, %eax
+	memcpy(stub + 5, "\x48\x8d\x64\x24\x80", 5);
+	// lea -128(%rsp), %rsp, past the red zone.
+	stub[10] = 0xe8;
+	_patchPut32(stub + 11, (uint32_t)(handler_addr - (stub_addr + 15)));
+	// call handler
+	memcpy(stub + 15, "\x48\x8d\xa4\x24\x80\x00\x00\x00", 8);
+	// lea 128(%rsp), %rsp
+	stub[23] = 0xe9;
+	_patchPut32(stub + 24, (uint32_t)(site->addr + _PATCH_SITE_LEN - (stub_addr + 28)));
+	// jmp back, past the syscall.
+	if (trace_backend->write_memory(pid, stub_addr, stub, sizeof(stub)) != 0)
+		return 0;
+	region->used += _PATCH_STUB_SIZE;
+
+	unsigned char jump[5];
+	jump[0] = 0xe9;
+	_patchPut32(jump + 1, (uint32_t)(stub_addr - (site->addr + 5)));
+	if (trace_backend->write_memory(pid, site->addr, jump, sizeof(jump)) != 0)
+		return 0;
+	return 1;
+}
+
+static int _patchCheckSite(pid_t pid, _PatchProcess_t* process, _PatchSite_t* site, rax_t rax) {
+	// Whether the code at `site` is what we can patch.
+	unsigned char code[_PATCH_SITE_LEN + 1];
+	if (trace_backend->read_memory(pid, site->addr - 1, code, sizeof(code)) != 0)
+		return 0;
+	uint32_t imm;
+	memcpy(&imm, code + 2, 4);
+	if (code[1] != 0xb8 || (rax_t)imm != rax || code[6] != 0x0f || code[7] != 0x05)
+		return 0;
+	// A prefix before it would make it a different instruction, E.G. `mov $NR, %r8d`.
+	unsigned char before = code[0];
+	if ((before >= 0x40 && before <= 0x4f) || strchr("\x66\x67\xf0\xf2\xf3\x2e\x36\x3e\x26\x64\x65", before))
+		return 0;
+	if ((site->addr & 7) > 3 && _patchThreads(process->tgid) != 1) {
+		DEBUG_PRINT("Call site %#lx of %i straddles a word, and there are other threads. Not patching.\n", site->addr, process->tgid);
+		return 0;
+	}
+	return 1;
+}
+
+static int patchSyscall(pid_t pid, rax_t rax) {
+	// Call at each PTRACE_EVENT_SECCOMP stop, before handling the syscall. Counts its call site, and patches it once it's hot.
+	// Returns 1 if the syscall was turned into an mmap() for a new region instead. It must then be resumed with PTRACE_SYSCALL, and patchInjected() called at its syscall-exit-stop.
+	if (!_patch_sites_enabled || rax < 0 || rax >= _INTERCEPTIBLE_CALL_INDEX_L || !_patch_handlers[rax])
+		return 0;
+	unsigned long rip = trace_backend->peek_user(pid, RIP);
+	_PatchProcess_t* process = _patchProcess(pid);
+	_PatchSite_t* site = _patchSite(process, rip - _PATCH_SITE_LEN);
+	if (!site || site->state != _PATCH_SITE_COUNTING || ++site->count < (unsigned long)patch_threshold())
+		return 0;
+	if (!_patchCheckSite(pid, process, site, rax)) {
+		site->state = _PATCH_SITE_UNPATCHABLE;
+		return 0;
+	}
+
+	_PatchRegion_t* region = _patchRegion(process, site->addr);
+	if (region) {
+		if (_patchApply(pid, region, site, _patch_handlers[rax])) {
+			site->state = _PATCH_SITE_PATCHED;
+			interceptor_stats.patched_sites++;
+			DEBUG_PRINT("Patched call site of '%s' in %i:\n\t%#lx\n", get_interceptible_call(rax).name, process->tgid, site->addr);
+		} else {
+			site->state = _PATCH_SITE_UNPATCHABLE;
+		}
+		return 0;
+	}
+	if (process->cannot_map || process->injecting_pid || process->regions_l >= _PATCH_MAX_REGIONS)
+		return 0;
+	unsigned long addr = _patchFindGap(process->tgid, site->addr);
+	if (!addr) {
+		site->state = _PATCH_SITE_UNPATCHABLE;
+		return 0;
+	}
+
+	struct user_regs_struct regs;
+	if (trace_backend->get_regs(pid, &regs) != 0)
+		return 0;
+	process->injecting_regs = regs;
+	regs.orig_rax = SYS_mmap;
+	regs.rdi = addr;
+	regs.rsi = _PATCH_REGION_SIZE;
+	regs.rdx = PROT_READ | PROT_EXEC;
+	regs.r10 = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+	regs.r8 = -1;
+	regs.r9 = 0;
+	if (trace_backend->set_regs(pid, &regs) != 0)
+		return 0;
+	process->injecting_pid = pid;
+	process->injecting_addr = addr;
+	// Not counted any further, so the site gets patched the next time it stops.
+	site->count--;
+	DEBUG_PRINT("Mapping call site stubs into %i at %#lx.\n", process->tgid, addr);
+	return 1;
+}
+
+static void patchInjected(pid_t pid) {
+	// Call at the syscall-exit-stop of a syscall patchSyscall() turned into an mmap(). Fills the new region, and sets the original syscall up to run again.
+	_PatchProcess_t* process = _patchProcess(pid);
+	if (process->injecting_pid != pid)
+		return;
+	process->injecting_pid = 0;
+	unsigned long result = trace_backend->peek_user(pid, RAX);
+
+	struct user_regs_struct regs = process->injecting_regs;
+	regs.rip -= 2;
+	regs.rax = regs.orig_rax;
+	// Back onto the `syscall`.
+	trace_backend->set_regs(pid, &regs);
+
+	if (result != process->injecting_addr) {
+		LOG_PRINT("ERROR: Could not map call site stubs into %i. Not patching it any further:\n\t%s\n", process->tgid, strerror(-(long)result));
+		process->cannot_map = 1;
+		return;
+	}
+	size_t blob_len = patch_blob_end - patch_blob_start;
+	unsigned char* contents = (unsigned char*)malloc(blob_len + _patch_table_len);
+	memcpy(contents, patch_blob_start, blob_len);
+	memcpy(contents + blob_len, _patch_table, _patch_table_len);
+	int write_errno = trace_backend->write_memory(pid, result, contents, blob_len + _patch_table_len);
+	free(contents);
+	if (write_errno != 0) {
+		LOG_PRINT("ERROR: Could not write call site stubs into %i. Not patching it any further:\n\t%s\n", process->tgid, strerror(write_errno));
+		process->cannot_map = 1;
+		return;
+	}
+	_PatchRegion_t* region = &process->regions[process->regions_l++];
+	region->base = result;
+	region->used = (blob_len + _patch_table_len + 15) & ~15UL;
+}
+
+static void patchExec(pid_t pid) {
+	// Call at PTRACE_EVENT_EXEC. The new program has none of the old one's patches.
+	if (!patch_filtered)
+		return;
+	_PatchProcess_t* process = _patchProcess(pid);
+	_patchForgetProcess(process->tgid);
+}
+
+static void patchForget(pid_t pid) {
+	// Call when a task exits.
+	if (!patch_filtered)
+		return;
+	_patchForgetProcess(pid);
+	// Keyed by thread group, which is the leader's PID.
+	for (int i = 0; i < _patch_processes_l; i++) {
+		if (_patch_processes[i]->injecting_pid == pid)
+			_patch_processes[i]->injecting_pid = 0;
+	}
+	if (pidMapHas(&_patch_tgids, pid))
+		pidMapRemove(&_patch_tgids, pid);
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef INTERCEPTOR_PATHCACHE_C_INCL
+#define INTERCEPTOR_PATHCACHE_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_stats.c"
+
+
+////// Path metadata cache:
+
+// Fallback rules need to know whether a candidate path exists, on every call that matches them, and syscall emulation needs whole stat results and symlink targets. Asking the kernel from the tracer each time would cost more than the rest of the rewrite put together, so results are cached here.
+// Each entry is kept valid by an inotify watch on the directory it's in, or on its nearest existing ancestor if that directory doesn't exist yet. Any change in that directory, including to the metadata or contents of a file in it, bumps the watch's generation, which invalidates every entry made under the previous one.
+// inotify is read lazily: SIGIO on the inotify fd just sets a flag, and the next lookup drains the events. If the kernel's event queue overflowed in the meantime, every entry is invalidated. A tracee's creating syscall has queued its event, and so raised the flag, before we can see its next stop.
+// Only changes directly in the watched directory are seen. Renaming or replacing one of its ancestors isn't, and neither are changes inside a directory entry, so a directory's own stat result isn't reliable. Neither are writes through mmap() or through hard links in other directories. Results that follow a symlink, like existence checks, are only kept valid by the watch on the link's own directory, so removing or replacing its target somewhere else leaves them stale.
+
+static inline long path_cache_size() {
+	GET_AND_CACHE_ENV(cache_size_s, "_PATH_INTERCEPTOR_PATH_CACHE_SIZE");
+	return env_long(cache_size_s, 4096);
+}
+
+#define _PATH_CACHE_PROBE 8
+// Slots looked at per lookup. Lookups and inserts scan the whole window, so removing an entry is just clearing its slot, and a full window evicts its oldest entry.
+
+typedef struct {
+	char* path;
+	// NULL if the slot is free.
+	size_t path_len;
+	uint64_t hash;
+	int have_statx[2];
+	int statx_errno[2];
+	struct statx statx[2];
+	// Indexed by whether symlinks were followed (0) or not (1), and filled as they're asked for.
+	int have_readlink;
+	int readlink_errno;
+	char* readlink_target;
+	size_t readlink_target_len;
+	int watch;
+	// Slot in `_path_cache_watches`.
+	uint32_t generation;
+	uint64_t last_used;
+} _PathCacheEntry_t;
+
+typedef struct {
+	int wd;
+	// -1 if the slot is free.
+	uint32_t generation;
+	int refs;
+	// Entries using this watch. It's removed when the last one goes.
+} _PathCacheWatch_t;
+
+static _PathCacheEntry_t* _path_cache;
+static size_t _path_cache_mask;
+static uint64_t _path_cache_clock;
+static _PathCacheWatch_t* _path_cache_watches;
+static int _path_cache_watches_l;
+static PidMap_t _path_cache_watches_by_wd;
+// Slot for each inotify watch descriptor. The kernel hands descriptors out counting up, so they can't index the slots directly, or the table would only ever grow.
+static int _path_cache_inotify_fd = -1;
+static volatile atomic_int _path_cache_dirty;
+static pthread_mutex_t _path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+// Matcher threads share the cache in pipelined mode.
+static int _path_cache_initialized;
+
+static void _pathCacheSigio(int sig) {
+	atomic_store(&_path_cache_dirty, 1);
+}
+
+static void _pathCacheInit() {
+	_path_cache_initialized = 1;
+	long size = path_cache_size();
+	if (size <= 0) {
+		DEBUG_PRINT("Path metadata cache disabled.\n");
+		return;
+	}
+	size_t capacity = _PATH_CACHE_PROBE;
+	while (capacity < (size_t)size)
+		capacity <<= 1;
+	_path_cache = (_PathCacheEntry_t*)calloc(capacity, sizeof(_PathCacheEntry_t));
+	_path_cache_mask = capacity - 1;
+	pidMapInit(&_path_cache_watches_by_wd);
+
+	_path_cache_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_path_cache_inotify_fd < 0) {
+		LOG_PRINT("ERROR: Could not set up inotify for the path metadata cache. Every lookup will go to the kernel:\n\t%s\n", strerror(errno));
+		return;
+	}
+	struct sigaction sigio_action = { .sa_handler = _pathCacheSigio, .sa_flags = SA_RESTART };
+	sigemptyset(&sigio_action.sa_mask);
+	sigaction(SIGIO, &sigio_action, NULL);
+	fcntl(_path_cache_inotify_fd, F_SETOWN, getpid());
+	fcntl(_path_cache_inotify_fd, F_SETSIG, SIGIO);
+	fcntl(_path_cache_inotify_fd, F_SETFL, fcntl(_path_cache_inotify_fd, F_GETFL) | O_ASYNC);
+}
+
+static uint64_t _pathCacheHash(const char* path, size_t path_len) {
+	// FNV-1a.
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < path_len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int _pathCacheWatchSlot(int wd) {
+	// The slot for `wd`, taking a free one if it hasn't got one yet.
+	if (pidMapHas(&_path_cache_watches_by_wd, wd))
+		return pidMapGet(&_path_cache_watches_by_wd, wd);
+	int slot;
+	for (slot = 0; slot < _path_cache_watches_l && _path_cache_watches[slot].wd >= 0; slot++);
+	if (slot == _path_cache_watches_l) {
+		_path_cache_watches = (_PathCacheWatch_t*)realloc(_path_cache_watches, sizeof(_PathCacheWatch_t) * (++_path_cache_watches_l));
+		_path_cache_watches[slot] = (_PathCacheWatch_t){ .wd = -1 };
+	}
+	_path_cache_watches[slot].wd = wd;
+	pidMapSet(&_path_cache_watches_by_wd, wd, slot);
+	return slot;
+}
+
+static void _pathCacheDrain() {
+	// Bump the generation of every watch something happened under.
+	atomic_store(&_path_cache_dirty, 0);
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t events_len;
+	while ((events_len = read(_path_cache_inotify_fd, events, sizeof(events))) > 0) {
+		for (char* p = events; p < events + events_len; ) {
+			struct inotify_event* event = (struct inotify_event*)p;
+			if (event->mask & IN_Q_OVERFLOW) {
+				// Events were dropped, so anything could have changed.
+				for (int i = 0; i < _path_cache_watches_l; i++)
+					_path_cache_watches[i].generation++;
+				DEBUG_PRINT("inotify queue overflowed. Invalidating the whole path metadata cache.\n");
+			} else {
+				if (pidMapHas(&_path_cache_watches_by_wd, event->wd))
+					_path_cache_watches[pidMapGet(&_path_cache_watches_by_wd, event->wd)].generation++;
+				DEBUG_PRINT_L(3, "Path metadata cache invalidated by watch %i.\n", event->wd);
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+static void _pathCacheRelease(_PathCacheEntry_t* entry) {
+	if (entry->watch >= 0) {
+		_PathCacheWatch_t* watch = &_path_cache_watches[entry->watch];
+		if (--watch->refs == 0) {
+			inotify_rm_watch(_path_cache_inotify_fd, watch->wd);
+			pidMapRemove(&_path_cache_watches_by_wd, watch->wd);
+			watch->wd = -1;
+			// Bump, so no entry can be valid under the old generation once the slot is reused.
+			watch->generation++;
+		}
+	}
+	free(entry->path);
+	free(entry->readlink_target);
+	entry->path = NULL;
+	entry->readlink_target = NULL;
+}
+
+static int _pathCacheAddWatch(const char* path, size_t path_len) {
+	// Watch the directory `path` is in, or the nearest ancestor that exists. Returns the watch descriptor, or -1.
+	char dir[PATH_MAX];
+	memcpy(dir, path, path_len + 1);
+	while (1) {
+		char* slash = strrchr(dir, '/');
+		if (!slash)
+			return -1;
+		if (slash == dir) {
+			slash[1] = '\0';
+		} else {
+			*slash = '\0';
+		}
+		int wd = inotify_add_watch(_path_cache_inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		if (wd >= 0)
+			return wd;
+		if ((errno != ENOENT && errno != ENOTDIR) || slash == dir) {
+			DEBUG_PRINT("Could not watch %s for the path metadata cache: %s\n", dir, strerror(errno));
+			return -1;
+		}
+	}
+}
+
+#define _PATH_CACHE_STATX_MASK (STATX_BASIC_STATS | STATX_BTIME)
+
+static int _pathStatxUncached(const char* path, int nofollow, struct statx* statxbuf) {
+	// Returns `errno` on failure, 0 otherwise.
+	if (statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT | (nofollow ? AT_SYMLINK_NOFOLLOW : 0), _PATH_CACHE_STATX_MASK, statxbuf) != 0)
+		return errno;
+	return 0;
+}
+
+static int _pathReadlinkUncached(const char* path, char* target, size_t target_cap, size_t* target_len) {
+	ssize_t len = readlink(path, target, target_cap);
+	if (len < 0)
+		return errno;
+	*target_len = len;
+	return 0;
+}
+
+static _PathCacheEntry_t* _pathCacheLookup(const char* path, size_t path_len) {
+	// Find the valid entry for `path`, or make an empty one. Returns NULL if it can't be cached.
+	// Call with _path_cache_lock held.
+	if (!_path_cache_initialized)
+		_pathCacheInit();
+	if (!_path_cache || _path_cache_inotify_fd < 0 || path[0] != '/')
+		return NULL;
+	if (atomic_load(&_path_cache_dirty))
+		_pathCacheDrain();
+
+	uint64_t hash = _pathCacheHash(path, path_len);
+	size_t home = hash & _path_cache_mask;
+	_PathCacheEntry_t* victim = NULL;
+	_path_cache_clock++;
+
+	for (size_t i = 0; i < _PATH_CACHE_PROBE; i++) {
+		_PathCacheEntry_t* entry = &_path_cache[(home + i) & _path_cache_mask];
+		if (!entry->path) {
+			if (!victim || victim->path)
+				victim = entry;
+			continue;
+		}
+		if (entry->hash == hash && entry->path_len == path_len && memcmp(entry->path, path, path_len) == 0) {
+			if (entry->watch >= 0 && _path_cache_watches[entry->watch].generation == entry->generation) {
+				entry->last_used = _path_cache_clock;
+				interceptor_stats.path_cache_hits++;
+				return entry;
+			}
+			// Stale. Reuse the slot.
+			_pathCacheRelease(entry);
+			victim = entry;
+			continue;
+		}
+		if (!victim || (victim->path && entry->last_used < victim->last_used))
+			victim = entry;
+	}
+
+	interceptor_stats.path_cache_misses++;
+	if (victim->path)
+		_pathCacheRelease(victim);
+
+	// Watch before looking, so a change in between invalidates the results rather than getting lost.
+	int wd = _pathCacheAddWatch(path, path_len);
+	if (wd < 0)
+		return NULL;
+	int slot = _pathCacheWatchSlot(wd);
+	_PathCacheWatch_t* watch = &_path_cache_watches[slot];
+	watch->refs++;
+	memset(victim, 0, sizeof(*victim));
+	victim->path = strndup(path, path_len);
+	victim->path_len = path_len;
+	victim->hash = hash;
+	victim->watch = slot;
+	victim->generation = watch->generation;
+	victim->last_used = _path_cache_clock;
+	DEBUG_PRINT_L(3, "Caching path metadata (watch %i): %s\n", wd, path);
+	return victim;
+}
+
+static int pathCacheStatx(const char* path, size_t path_len, int nofollow, struct statx* statxbuf) {
+	// statx() of `path` (NUL-terminated) with the basic fields and birth time, as the tracer sees it. Returns `errno` on failure, 0 otherwise. `statxbuf` can be NULL.
+	pthread_mutex_lock(&_path_cache_lock);
+	_PathCacheEntry_t* entry = _pathCacheLookup(path, path_len);
+	int statx_errno;
+	if (!entry) {
+		pthread_mutex_unlock(&_path_cache_lock);
+		struct statx uncached;
+		return _pathStatxUncached(path, nofollow, statxbuf ? statxbuf : &uncached);
+	}
+	if (!entry->have_statx[nofollow]) {
+		entry->statx_errno[nofollow] = _pathStatxUncached(path, nofollow, &entry->statx[nofollow]);
+		entry->have_statx[nofollow] = 1;
+	}
+	statx_errno = entry->statx_errno[nofollow];
+	if (statxbuf && !statx_errno)
+		*statxbuf = entry->statx[nofollow];
+	pthread_mutex_unlock(&_path_cache_lock);
+	return statx_errno;
+}
+
+static __attribute__ ((unused)) int pathCacheReadlink(const char* path, size_t path_len, char* target, size_t target_cap, size_t* target_len) {
+	// readlink() of `path`. Like readlink(), `target` isn't NUL-terminated, and is truncated to `target_cap`. Returns `errno` on failure, 0 otherwise.
+	pthread_mutex_lock(&_path_cache_lock);
+	_PathCacheEntry_t* entry = _pathCacheLookup(path, path_len);
+	if (!entry) {
+		pthread_mutex_unlock(&_path_cache_lock);
+		return _pathReadlinkUncached(path, target, target_cap, target_len);
+	}
+	if (!entry->have_readlink) {
+		char full_target[PATH_MAX];
+		size_t full_target_len = 0;
+		entry->readlink_errno = _pathReadlinkUncached(path, full_target, sizeof(full_target), &full_target_len);
+		if (!entry->readlink_errno) {
+			entry->readlink_target = (char*)malloc(full_target_len);
+			memcpy(entry->readlink_target, full_target, full_target_len);
+			entry->readlink_target_len = full_target_len;
+		}
+		entry->have_readlink = 1;
+	}
+	int readlink_errno = entry->readlink_errno;
+	if (!readlink_errno) {
+		*target_len = entry->readlink_target_len < target_cap ? entry->readlink_target_len : target_cap;
+		memcpy(target, entry->readlink_target, *target_len);
+	}
+	pthread_mutex_unlock(&_path_cache_lock);
+	return readlink_errno;
+}
+
+static int pathCacheExists(const char* path, size_t path_len) {
+	// Whether `path` (NUL-terminated) exists, as stat() sees it from the tracer. Relative paths are resolved against the tracer's working directory, not a tracee's.
+	return pathCacheStatx(path, path_len, 0, NULL) == 0;
+}
+
+#endif
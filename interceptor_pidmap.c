@@ -134,6 +134,21 @@ static void pidMapRemove(PidMap_t* pidmap, int key) {
 		exit(1);
 	}
 	pidmap->_entries[i]._valid = 0;
+	pidmap->_cached_key_valid = 0;
+	// Or the next lookup of `key` would still find it.
+}
+
+static __attribute__ ((unused)) int pidMapIterate(PidMap_t* pidmap, pidmap_index_t* i, int* key, int* value) {
+	// Find the first entry at or after index `*i`. Returns 0 past the end.
+	// for (pidmap_index_t i = 0; pidMapIterate(&pidmap, &i, &key, &value); i++)
+	for (; *i < pidmap->length; (*i)++) {
+		if (pidmap->_entries[*i]._valid) {
+			*key = pidmap->_entries[*i].key;
+			*value = pidmap->_entries[*i].value;
+			return 1;
+		}
+	}
+	return 0;
 }
 
 #if 0
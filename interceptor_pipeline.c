@@ -0,0 +1,335 @@
+#ifndef INTERCEPTOR_PIPELINE_C_INCL
+#define INTERCEPTOR_PIPELINE_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_pidmap.c"
+#include "interceptor_replace.h"
+#include "interceptor_trace_types.h"
+
+
+////// Pipelined stop handling:
+
+// Normally process_signals() reads, matches and writes back each path before it can wait for the next stop, so one slow match holds up every other tracee.
+// In pipelined mode, the tracer thread only reads the paths and queues the job. A pool of matcher threads runs the rewrite engine, and queues the results back. The tracer thread writes them and resumes each tracee as soon as its own result is ready.
+// Only the tracer thread ever calls ptrace(), since ptrace requests have to come from the thread that's attached.
+
+static inline long pipeline_threads() {
+	GET_AND_CACHE_ENV(threads_s, "_PATH_INTERCEPTOR_MATCH_THREADS");
+	return env_long(threads_s, 0);
+}
+
+
+//// Bounded lock-free MPMC queue:
+
+// Dmitry Vyukov's bounded MPMC queue. Each cell's sequence number says whether it's ready to be written (== position) or read (== position + 1).
+
+typedef struct {
+	atomic_size_t sequence;
+	void* data;
+} _JobQueueCell_t;
+
+typedef struct {
+	_JobQueueCell_t* cells;
+	size_t mask;
+	char _pad0[64];
+	atomic_size_t enqueue_pos;
+	char _pad1[64];
+	atomic_size_t dequeue_pos;
+	char _pad2[64];
+	// Keep the producer and consumer positions on separate cache lines.
+} JobQueue_t;
+
+static void jobQueueInit(JobQueue_t* queue, size_t capacity) {
+	// `capacity` must be a power of two.
+	queue->cells = (_JobQueueCell_t*)malloc(sizeof(_JobQueueCell_t) * capacity);
+	queue->mask = capacity - 1;
+	for (size_t i = 0; i < capacity; i++) {
+		atomic_store_explicit(&queue->cells[i].sequence, i, memory_order_relaxed);
+	}
+	atomic_store_explicit(&queue->enqueue_pos, 0, memory_order_relaxed);
+	atomic_store_explicit(&queue->dequeue_pos, 0, memory_order_relaxed);
+}
+
+static int jobQueuePush(JobQueue_t* queue, void* data) {
+	// Returns 0 if the queue is full.
+	size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+	while (1) {
+		_JobQueueCell_t* cell = &queue->cells[pos & queue->mask];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				cell->data = data;
+				atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+				return 1;
+			}
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+static void* jobQueuePop(JobQueue_t* queue) {
+	// Returns NULL if the queue is empty.
+	size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+	while (1) {
+		_JobQueueCell_t* cell = &queue->cells[pos & queue->mask];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				void* data = cell->data;
+				atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+				return data;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+
+//// Matcher pool:
+
+#define _PIPELINE_QUEUE_CAPACITY 4096
+
+typedef void (*SyscallJobMatcher_t) (SyscallJob_t* job, PathReplacer_t replacer);
+
+static int pipeline_enabled;
+
+static JobQueue_t _pipeline_requests;
+static JobQueue_t _pipeline_results;
+static sem_t _pipeline_requests_ready;
+static int _pipeline_results_fd = -1;
+// eventfd, bumped by matchers whenever they queue a result.
+static int _pipeline_sigchld_fd = -1;
+// signalfd for SIGCHLD, which is how tracee stops wake us up while we're waiting for results.
+static SyscallJobMatcher_t _pipeline_matcher;
+static PathReplacer_t _pipeline_replacer;
+static SyscallJob_t* _pipeline_free_jobs;
+// Free list of jobs, only touched by the tracer thread. Grows to the peak number of tracees in flight, and is then reused.
+static PidMap_t _pipeline_in_flight;
+static int _pipeline_serial;
+// Serial of the job in flight for each task. A task can exit, E.G. killed by another thread's exit_group(), while a matcher has its job, and its PID can even be reused by the time the result comes back.
+
+typedef void (*PipelineFdReady_t) (int fd, short revents);
+
+static struct pollfd* _pipeline_watch_fds;
+static PipelineFdReady_t* _pipeline_watch_ready;
+static int _pipeline_watch_l;
+// Other file descriptors to wake up for while waiting, E.G. the daemon socket. Their callbacks run on the tracer thread, so they can ptrace().
+
+static void* _pipelineMatcherThread(void* arg) {
+	while (1) {
+		while (sem_wait(&_pipeline_requests_ready) != 0 && errno == EINTR);
+		SyscallJob_t* job;
+		while (!(job = (SyscallJob_t*)jobQueuePop(&_pipeline_requests))) {
+			// Only possible if another matcher took "our" job and we're about to get the next one.
+			sched_yield();
+		}
+		_pipeline_matcher(job, _pipeline_replacer);
+		while (!jobQueuePush(&_pipeline_results, job)) {
+			// There can't be more jobs than the capacity in flight, so this shouldn't spin for long.
+			sched_yield();
+		}
+		uint64_t one = 1;
+		write(_pipeline_results_fd, &one, sizeof(one));
+	}
+	return NULL;
+}
+
+static void pipelineInitSignalfd() {
+	// Block SIGCHLD before starting any threads, so it stays blocked in all of them and only ever shows up on the signalfd.
+	// Forked tracees inherit the blocked mask, so they have to unblock it again before exec.
+	if (_pipeline_sigchld_fd >= 0)
+		return;
+	sigset_t sigchld_set;
+	sigemptyset(&sigchld_set);
+	sigaddset(&sigchld_set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+	_pipeline_sigchld_fd = signalfd(-1, &sigchld_set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (_pipeline_sigchld_fd < 0) {
+		LOG_PRINT("ERROR: Could not set up SIGCHLD signalfd:\n\t%s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static inline int pipeline_polling() {
+	// Whether waiting has to go through pipelineWaitPid().
+	return _pipeline_sigchld_fd >= 0;
+}
+
+static void pipelineWatchFd(int fd, PipelineFdReady_t ready) {
+	pipelineInitSignalfd();
+	_pipeline_watch_fds = (struct pollfd*)realloc(_pipeline_watch_fds, sizeof(struct pollfd) * (_pipeline_watch_l + 1));
+	_pipeline_watch_ready = (PipelineFdReady_t*)realloc(_pipeline_watch_ready, sizeof(PipelineFdReady_t) * (_pipeline_watch_l + 1));
+	_pipeline_watch_fds[_pipeline_watch_l].fd = fd;
+	_pipeline_watch_fds[_pipeline_watch_l].events = POLLIN;
+	_pipeline_watch_ready[_pipeline_watch_l] = ready;
+	_pipeline_watch_l++;
+}
+
+static void pipelineUnwatchFd(int fd) {
+	for (int i = 0; i < _pipeline_watch_l; i++) {
+		if (_pipeline_watch_fds[i].fd == fd) {
+			_pipeline_watch_l--;
+			_pipeline_watch_fds[i] = _pipeline_watch_fds[_pipeline_watch_l];
+			_pipeline_watch_ready[i] = _pipeline_watch_ready[_pipeline_watch_l];
+			return;
+		}
+	}
+}
+
+static void pipelineInit(SyscallJobMatcher_t matcher, PathReplacer_t replacer) {
+	long threads_l = pipeline_threads();
+	if (threads_l <= 0)
+		return;
+
+	_pipeline_matcher = matcher;
+	_pipeline_replacer = replacer;
+	pidMapInit(&_pipeline_in_flight);
+	jobQueueInit(&_pipeline_requests, _PIPELINE_QUEUE_CAPACITY);
+	jobQueueInit(&_pipeline_results, _PIPELINE_QUEUE_CAPACITY);
+	sem_init(&_pipeline_requests_ready, 0, 0);
+
+	pipelineInitSignalfd();
+	_pipeline_results_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_pipeline_results_fd < 0) {
+		LOG_PRINT("ERROR: Could not set up pipelined mode:\n\t%s\n", strerror(errno));
+		exit(1);
+	}
+
+	sigset_t all_signals, orig_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &orig_signals);
+	// Signals meant for the tracer, like a handoff request, have to interrupt the tracer thread's waiting, so matchers never take any.
+	for (long i = 0; i < threads_l; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, _pipelineMatcherThread, NULL) != 0) {
+			LOG_PRINT("ERROR: Could not start matcher thread:\n\t%s\n", strerror(errno));
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+
+	pipeline_enabled = 1;
+	LOG_PRINT("Pipelined stop handling enabled:\n\t%li matcher threads\n", threads_l);
+}
+
+static SyscallJob_t* pipelineJobAlloc() {
+	SyscallJob_t* job = _pipeline_free_jobs;
+	if (job) {
+		_pipeline_free_jobs = job->_next_free;
+		return job;
+	}
+	return (SyscallJob_t*)malloc(sizeof(SyscallJob_t));
+}
+
+static void pipelineJobFree(SyscallJob_t* job) {
+	job->_next_free = _pipeline_free_jobs;
+	_pipeline_free_jobs = job;
+}
+
+static int pipelineSubmit(SyscallJob_t* job) {
+	// Returns 0 if the queue is full, in which case the caller should just handle the job itself.
+	job->_serial = ++_pipeline_serial;
+	if (!jobQueuePush(&_pipeline_requests, job))
+		return 0;
+	pidMapSet(&_pipeline_in_flight, job->pid, job->_serial);
+	sem_post(&_pipeline_requests_ready);
+	return 1;
+}
+
+static int pipelineJobLanded(SyscallJob_t* job) {
+	// Call for each finished job. Returns 0 if its task exited in the meantime, so nothing should be done with it but freeing it.
+	if (!pidMapHas(&_pipeline_in_flight, job->pid) || pidMapGet(&_pipeline_in_flight, job->pid) != job->_serial)
+		return 0;
+	pidMapRemove(&_pipeline_in_flight, job->pid);
+	return 1;
+}
+
+static void pipelineForget(pid_t pid) {
+	// Call when a task exits.
+	if (pipeline_enabled && pidMapHas(&_pipeline_in_flight, pid))
+		pidMapRemove(&_pipeline_in_flight, pid);
+}
+
+static int pipelineComplete(void (*complete)(SyscallJob_t* job)) {
+	// Hand every finished job to `complete`. Returns how many there were.
+	int completed = 0;
+	SyscallJob_t* job;
+	while ((job = (SyscallJob_t*)jobQueuePop(&_pipeline_results))) {
+		complete(job);
+		completed++;
+	}
+	return completed;
+}
+
+static pid_t pipelineWaitPid(pid_t pid, int *wstatus, int options, void (*complete)(SyscallJob_t* job)) {
+	// waitpid(), except that finished jobs get completed and watched file descriptors get handled while we'd otherwise be blocked.
+	// Nothing can get lost between checking and sleeping: a result queued after we looked leaves the eventfd readable, and a stop after waitpid() leaves the signalfd readable.
+	// With watched file descriptors, having no children at all just means waiting for them.
+	while (1) {
+		if (pipeline_enabled)
+			pipelineComplete(complete);
+		pid_t changed_pid = waitpid(pid, wstatus, options | WNOHANG);
+		if (changed_pid != 0 && !(changed_pid < 0 && errno == ECHILD && _pipeline_watch_l))
+			return changed_pid;
+
+		int fds_l = 2 + _pipeline_watch_l;
+		struct pollfd fds[fds_l];
+		fds[0] = (struct pollfd){ .fd = _pipeline_sigchld_fd, .events = POLLIN };
+		fds[1] = (struct pollfd){ .fd = _pipeline_results_fd, .events = POLLIN };
+		// poll() ignores the eventfd slot when it's -1, without matcher threads.
+		memcpy(fds + 2, _pipeline_watch_fds, sizeof(struct pollfd) * _pipeline_watch_l);
+		if (poll(fds, fds_l, -1) < 0) {
+			if (errno == EINTR)
+				return -1;
+				// Like waitpid() with a signal handler, so the caller can look at what the handler did.
+			LOG_PRINT("ERROR: poll() failed while waiting for tracees:\n\t%s\n", strerror(errno));
+			exit(1);
+		}
+		char drain[sizeof(struct signalfd_siginfo) * 16];
+		if (fds[0].revents & POLLIN)
+			while (read(_pipeline_sigchld_fd, drain, sizeof(drain)) > 0);
+		if (fds[1].revents & POLLIN)
+			read(_pipeline_results_fd, drain, sizeof(uint64_t));
+		for (int i = 2; i < fds_l; i++) {
+			if (fds[i].revents) {
+				// Callbacks can watch and unwatch, so look the callback up again.
+				for (int w = 0; w < _pipeline_watch_l; w++) {
+					if (_pipeline_watch_fds[w].fd == fds[i].fd) {
+						_pipeline_watch_ready[w](fds[i].fd, fds[i].revents);
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef INTERCEPTOR_PRAGMAS_H_INCL
 #define INTERCEPTOR_PRAGMAS_H_INCL
 
-// #define _GNU_SOURCE
+// Needed for the CPU_SET() family and sched_setaffinity() in interceptor_affinity.c.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #endif
@@ -0,0 +1,545 @@
+#ifndef INTERCEPTOR_PREFETCH_C_INCL
+#define INTERCEPTOR_PREFETCH_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "interceptor_backend.c"
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+#include "interceptor_pathcache.c"
+#include "interceptor_replace.h"
+#include "interceptor_stats.c"
+
+
+////// Loader prefetch:
+
+// Right after an execve(), ld.so looks for each DT_NEEDED library in every RPATH, LD_LIBRARY_PATH, RUNPATH and system directory in turn, and in a dozen hardware capability subdirectories of each. With a Nix-style RUNPATH, that's hundreds of failing openat() and stat() calls before main(), each two stops and a rewrite, plus a path cache miss whenever a fallback rule or _PATH_INTERCEPTOR_EMULATE needs to know whether the rewritten path exists.
+// With _PATH_INTERCEPTOR_PREFETCH=1, the tracer asks for PTRACE_EVENT_EXEC, and at that stop hands the PID to a background thread. That reads the new program's ELF headers and walks the same search the loader is about to, rewriting each path it will try and looking the result up in the path cache. Libraries it finds are read in turn, for their own dependencies. The loader's stops then mostly find the cache warm.
+// It's a guess at what the loader will do, and a wrong guess only costs cache slots. The search follows glibc 2.36, or musl with its built-in system directories if PT_INTERP names it. The interpreter itself is opened by the kernel inside execve(), so it's only read to tell the two apart. /etc/ld.so.cache isn't parsed, so libraries from it are only looked up directly in the system directories, which is where it mostly points.
+// The rewrites themselves aren't kept. They're cheap next to the lookups, and with fallback rules depend on the cache anyway.
+
+static inline int prefetch_enabled() {
+	GET_AND_CACHE_ENV(prefetch_s, "_PATH_INTERCEPTOR_PREFETCH");
+	return (prefetch_s && strcmp(prefetch_s, "1") == 0);
+}
+
+#define _PREFETCH_QUEUE 64
+// PIDs waiting for the prefetch thread. Execs beyond that in one burst just aren't prefetched.
+
+#define _PREFETCH_MAX_OBJECTS 256
+// Libraries looked for per exec.
+
+#define _PREFETCH_MAX_NEEDED 128
+// DT_NEEDED entries read per object.
+
+#define _PREFETCH_MAX_STRTAB (4 << 20)
+
+#define _PREFETCH_MISSING_DIRS 4096
+// Slots in the set of directories the loader will know are missing. glibc stops looking in a directory once it's failed to stat() it.
+
+static const char* const _prefetch_default_dirs[] = {
+	"/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu", "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL
+};
+// Debian's multiarch directories, then glibc's own. Only one set exists on most systems, and the others cost a lookup each.
+
+static const char* const _prefetch_musl_default_path = "/lib:/usr/local/lib:/usr/lib";
+
+static const char* const _prefetch_hwcaps_subdirs[] = {
+	"glibc-hwcaps/x86-64-v4/", "glibc-hwcaps/x86-64-v3/", "glibc-hwcaps/x86-64-v2/",
+	"tls/haswell/avx512_1/x86_64/", "tls/haswell/avx512_1/", "tls/haswell/x86_64/", "tls/haswell/",
+	"tls/avx512_1/x86_64/", "tls/avx512_1/", "tls/x86_64/", "tls/",
+	"haswell/avx512_1/x86_64/", "haswell/avx512_1/", "haswell/x86_64/", "haswell/",
+	"avx512_1/x86_64/", "avx512_1/", "x86_64/", "", NULL
+};
+// In the order glibc 2.36 tries them on a CPU that has everything. The legacy ones after glibc-hwcaps/ are gone in 2.37.
+
+typedef struct {
+	char interp[PATH_MAX];
+	char* strtab;
+	size_t strtab_len;
+	size_t needed[_PREFETCH_MAX_NEEDED];
+	int needed_l;
+	long rpath;
+	long runpath;
+	// Offsets into `strtab`, or -1.
+} _PrefetchElf_t;
+
+typedef struct {
+	char* path;
+	// As the loader will know it, for $ORIGIN.
+	char* opened;
+	// What it's rewritten to.
+} _PrefetchObject_t;
+
+typedef struct {
+	pid_t pid;
+	int musl;
+	char* library_path;
+	char* preload;
+	char* main_rpath;
+	char main_origin[PATH_MAX];
+	_PrefetchObject_t objects[_PREFETCH_MAX_OBJECTS];
+	int objects_l;
+	uint64_t missing_dirs[_PREFETCH_MISSING_DIRS];
+	unsigned long lookups;
+} _PrefetchSearch_t;
+
+static PathReplacer_t _prefetch_replacer;
+static pthread_mutex_t _prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _prefetch_wake = PTHREAD_COND_INITIALIZER;
+static pid_t _prefetch_queue[_PREFETCH_QUEUE];
+static int _prefetch_queue_head;
+static int _prefetch_queue_l;
+static int _prefetch_started;
+
+
+static void prefetchInit(PathReplacer_t replacer) {
+	_prefetch_replacer = replacer;
+}
+
+
+//// ELF reading:
+
+static const char* _prefetchElfString(const _PrefetchElf_t* elf, long offset) {
+	if (offset < 0 || !elf->strtab || (size_t)offset >= elf->strtab_len)
+		return NULL;
+	return elf->strtab + offset;
+}
+
+static int _prefetchParseElf(int fd, _PrefetchElf_t* elf) {
+	// Returns 0 if `fd` isn't a 64-bit ELF file we can read.
+	Elf64_Ehdr ehdr;
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_phentsize != sizeof(Elf64_Phdr))
+		return 0;
+	Elf64_Phdr phdrs[64];
+	int phdrs_l = ehdr.e_phnum < 64 ? ehdr.e_phnum : 64;
+	if (pread(fd, phdrs, sizeof(Elf64_Phdr) * phdrs_l, ehdr.e_phoff) != (ssize_t)(sizeof(Elf64_Phdr) * phdrs_l))
+		return 0;
+
+	const Elf64_Phdr* dynamic = NULL;
+	for (int i = 0; i < phdrs_l; i++) {
+		if (phdrs[i].p_type == PT_INTERP) {
+			size_t interp_len = phdrs[i].p_filesz < PATH_MAX ? phdrs[i].p_filesz : PATH_MAX - 1;
+			ssize_t read_len = pread(fd, elf->interp, interp_len, phdrs[i].p_offset);
+			elf->interp[read_len > 0 ? read_len : 0] = '\0';
+		} else if (phdrs[i].p_type == PT_DYNAMIC) {
+			dynamic = &phdrs[i];
+		}
+	}
+	if (!dynamic)
+		return 1;
+	// Static, otherwise. Nothing for a loader to look up.
+
+	size_t dyns_l = dynamic->p_filesz / sizeof(Elf64_Dyn);
+	if (dyns_l > 4096)
+		dyns_l = 4096;
+	Elf64_Dyn* dyns = (Elf64_Dyn*)malloc(sizeof(Elf64_Dyn) * dyns_l);
+	if (pread(fd, dyns, sizeof(Elf64_Dyn) * dyns_l, dynamic->p_offset) != (ssize_t)(sizeof(Elf64_Dyn) * dyns_l)) {
+		free(dyns);
+		return 0;
+	}
+	Elf64_Addr strtab_addr = 0;
+	size_t strtab_len = 0;
+	for (size_t i = 0; i < dyns_l && dyns[i].d_tag != DT_NULL; i++) {
+		switch (dyns[i].d_tag) {
+			case DT_NEEDED:
+				if (elf->needed_l < _PREFETCH_MAX_NEEDED)
+					elf->needed[elf->needed_l++] = dyns[i].d_un.d_val;
+				break;
+			case DT_RPATH:
+				elf->rpath = dyns[i].d_un.d_val;
+				break;
+			case DT_RUNPATH:
+				elf->runpath = dyns[i].d_un.d_val;
+				break;
+			case DT_STRTAB:
+				strtab_addr = dyns[i].d_un.d_ptr;
+				break;
+			case DT_STRSZ:
+				strtab_len = dyns[i].d_un.d_val;
+				break;
+		}
+	}
+	free(dyns);
+
+	// DT_STRTAB is an address, so find the segment that loads it.
+	for (int i = 0; i < phdrs_l; i++) {
+		if (phdrs[i].p_type != PT_LOAD || strtab_addr < phdrs[i].p_vaddr || strtab_addr + strtab_len > phdrs[i].p_vaddr + phdrs[i].p_filesz)
+			continue;
+		if (!strtab_len || strtab_len > _PREFETCH_MAX_STRTAB)
+			break;
+		elf->strtab = (char*)malloc(strtab_len + 1);
+		if (pread(fd, elf->strtab, strtab_len, strtab_addr - phdrs[i].p_vaddr + phdrs[i].p_offset) != (ssize_t)strtab_len) {
+			free(elf->strtab);
+			elf->strtab = NULL;
+			break;
+		}
+		elf->strtab[strtab_len] = '\0';
+		elf->strtab_len = strtab_len;
+		break;
+	}
+	return 1;
+}
+
+static int _prefetchReadElf(const char* path, _PrefetchElf_t* elf) {
+	// Read what the loader's search depends on from the ELF file at `path`. Free with _prefetchFreeElf() either way.
+	memset(elf, 0, sizeof(*elf));
+	elf->rpath = -1;
+	elf->runpath = -1;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	int ok = _prefetchParseElf(fd, elf);
+	close(fd);
+	return ok;
+}
+
+static void _prefetchFreeElf(_PrefetchElf_t* elf) {
+	free(elf->strtab);
+	elf->strtab = NULL;
+}
+
+
+//// Search:
+
+static int _prefetchLookup(_PrefetchSearch_t* search, const char* path, size_t path_len, char* opened, size_t opened_cap) {
+	// Rewrite `path` like the tracer will when the loader tries it, and look up the result, which warms the path cache for it. Returns whether it exists, with what the kernel will be asked for in `opened`.
+	search->lookups++;
+	ssize_t opened_len = _prefetch_replacer(path, path_len, opened, opened_cap);
+	if (opened_len == PATH_REPLACER_NO_MATCH) {
+		// The cache only serves rewritten paths, so don't fill it with others.
+		if (path_len + 1 > opened_cap)
+			return 0;
+		memcpy(opened, path, path_len + 1);
+		return access(path, F_OK) == 0;
+	}
+	return pathCacheExists(opened, opened_len);
+}
+
+static uint64_t _prefetchHash(const char* s, size_t len) {
+	// FNV-1a.
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+static int _prefetchDirMissing(_PrefetchSearch_t* search, const char* dir, size_t dir_len, int add) {
+	// Check for, or with `add`, remember, a directory the loader has found missing. Collisions only make the guess worse.
+	uint64_t hash = _prefetchHash(dir, dir_len);
+	for (size_t i = 0; i < _PREFETCH_MISSING_DIRS; i++) {
+		uint64_t* slot = &search->missing_dirs[(hash + i) & (_PREFETCH_MISSING_DIRS - 1)];
+		if (*slot == hash)
+			return 1;
+		if (!*slot) {
+			if (add)
+				*slot = hash;
+			return add;
+		}
+	}
+	return 0;
+}
+
+static void _prefetchAddObject(_PrefetchSearch_t* search, const char* path, const char* opened) {
+	if (search->objects_l >= _PREFETCH_MAX_OBJECTS)
+		return;
+	search->objects[search->objects_l].path = strdup(path);
+	search->objects[search->objects_l].opened = strdup(opened);
+	search->objects_l++;
+}
+
+static int _prefetchHaveObject(_PrefetchSearch_t* search, const char* name) {
+	// Whether a library called `name` was already found. The loader matches later DT_NEEDED entries by name, without another search.
+	const char* base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	for (int i = 1; i < search->objects_l; i++) {
+		const char* other = strrchr(search->objects[i].path, '/');
+		if (strcmp(other ? other + 1 : search->objects[i].path, base) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static int _prefetchSearchDir(_PrefetchSearch_t* search, const char* dir, size_t dir_len, const char* name, int subdirs) {
+	// Look for library `name` in `dir` like the loader will, in its hardware capability subdirectories if `subdirs`. Returns 1 once it's found.
+	char path[PATH_MAX];
+	char opened[PATH_MAX];
+	while (dir_len > 0 && dir[dir_len - 1] == '/')
+		dir_len--;
+	for (int s = 0; _prefetch_hwcaps_subdirs[s]; s++) {
+		const char* subdir = subdirs ? _prefetch_hwcaps_subdirs[s] : "";
+		int dir_part_len = snprintf(path, sizeof(path), "%.*s/%s", (int)dir_len, dir, subdir);
+		int path_len = snprintf(path + dir_part_len, sizeof(path) - dir_part_len, "%s", name) + dir_part_len;
+		if (path_len >= (int)sizeof(path))
+			return 0;
+		if (dir_part_len > 1)
+			// Without the trailing slash, which is how the loader stat()s it.
+			dir_part_len--;
+		if (!_prefetchDirMissing(search, path, dir_part_len, 0)) {
+			if (_prefetchLookup(search, path, path_len, opened, sizeof(opened))) {
+				_prefetchAddObject(search, path, opened);
+				return 1;
+			}
+			if (!search->musl) {
+				char c = path[dir_part_len];
+				path[dir_part_len] = '\0';
+				if (!_prefetchLookup(search, path, dir_part_len, opened, sizeof(opened)))
+					_prefetchDirMissing(search, path, dir_part_len, 1);
+				path[dir_part_len] = c;
+			}
+		}
+		if (!subdirs)
+			break;
+	}
+	return 0;
+}
+
+static int _prefetchSearchPath(_PrefetchSearch_t* search, const char* dirs, const char* origin, const char* name, int subdirs) {
+	// Same for each directory in the colon-separated `dirs`, with $ORIGIN expanded.
+	if (!dirs)
+		return 0;
+	while (*dirs) {
+		const char* end = strchr(dirs, ':');
+		size_t dir_len = end ? (size_t)(end - dirs) : strlen(dirs);
+		char dir[PATH_MAX];
+		size_t expanded_len = 0;
+		int usable = 1;
+		for (size_t i = 0; i < dir_len && usable; ) {
+			size_t token_len = 0;
+			if (strncmp(dirs + i, "$ORIGIN", 7) == 0) {
+				token_len = 7;
+			} else if (strncmp(dirs + i, "${ORIGIN}", 9) == 0) {
+				token_len = 9;
+			} else if (dirs[i] == '$') {
+				// $LIB and $PLATFORM depend on the build of glibc.
+				usable = 0;
+				break;
+			}
+			const char* piece = token_len ? origin : dirs + i;
+			size_t piece_len = token_len ? strlen(origin) : 1;
+			if (expanded_len + piece_len + 1 > sizeof(dir)) {
+				usable = 0;
+				break;
+			}
+			memcpy(dir + expanded_len, piece, piece_len);
+			expanded_len += piece_len;
+			i += token_len ? token_len : 1;
+		}
+		dir[expanded_len] = '\0';
+		// Empty entries mean the working directory, which ld.so would look up relative to it. Not worth guessing.
+		if (usable && expanded_len && dir[0] == '/' && _prefetchSearchDir(search, dir, expanded_len, name, subdirs))
+			return 1;
+		if (!end)
+			break;
+		dirs = end + 1;
+	}
+	return 0;
+}
+
+static void _prefetchNeeded(_PrefetchSearch_t* search, const char* name, const _PrefetchElf_t* elf, const char* origin) {
+	// Find library `name`, needed by the object `elf` from `origin`, and queue it.
+	if (!name || !*name || _prefetchHaveObject(search, name))
+		return;
+	char opened[PATH_MAX];
+	if (strchr(name, '/')) {
+		// Opened as it is, without a search.
+		if (name[0] == '/' && _prefetchLookup(search, name, strlen(name), opened, sizeof(opened)))
+			_prefetchAddObject(search, name, opened);
+		return;
+	}
+
+	const char* runpath = _prefetchElfString(elf, elf->runpath);
+	if (search->musl) {
+		if (_prefetchSearchPath(search, search->library_path, origin, name, 0))
+			return;
+		const char* rpath = runpath ? runpath : _prefetchElfString(elf, elf->rpath);
+		if (_prefetchSearchPath(search, rpath, origin, name, 0))
+			return;
+		_prefetchSearchPath(search, _prefetch_musl_default_path, origin, name, 0);
+		return;
+	}
+
+	// glibc uses RPATHs only for objects without a RUNPATH, its own and then those of whatever loaded it. Only the main program's is looked at here.
+	if (!runpath) {
+		if (_prefetchSearchPath(search, _prefetchElfString(elf, elf->rpath), origin, name, 1))
+			return;
+		if (_prefetchSearchPath(search, search->main_rpath, search->main_origin, name, 1))
+			return;
+	}
+	if (_prefetchSearchPath(search, search->library_path, origin, name, 1))
+		return;
+	if (_prefetchSearchPath(search, runpath, origin, name, 1))
+		return;
+	for (int i = 0; _prefetch_default_dirs[i]; i++) {
+		if (_prefetchSearchDir(search, _prefetch_default_dirs[i], strlen(_prefetch_default_dirs[i]), name, 0))
+			return;
+	}
+}
+
+static void _prefetchReadEnv(_PrefetchSearch_t* search) {
+	// The new program's LD_LIBRARY_PATH and LD_PRELOAD.
+	char environ_path[64];
+	snprintf(environ_path, sizeof(environ_path), "/proc/%i/environ", search->pid);
+	FILE* f = fopen(environ_path, "re");
+	if (!f)
+		return;
+	char* var = NULL;
+	size_t var_cap = 0;
+	ssize_t var_len;
+	while ((var_len = getdelim(&var, &var_cap, '\0', f)) > 0) {
+		if (strncmp(var, "LD_LIBRARY_PATH=", 16) == 0) {
+			free(search->library_path);
+			search->library_path = strdup(var + 16);
+			// glibc takes semicolons too.
+			for (char* c = search->library_path; *c; c++) {
+				if (*c == ';')
+					*c = ':';
+			}
+		} else if (strncmp(var, "LD_PRELOAD=", 11) == 0) {
+			free(search->preload);
+			search->preload = strdup(var + 11);
+		}
+	}
+	free(var);
+	fclose(f);
+}
+
+static void _prefetchExec(pid_t pid) {
+	// Walk the library search of the program `pid` just exec'd.
+	static _PrefetchSearch_t search;
+	memset(&search, 0, sizeof(search));
+	search.pid = pid;
+
+	char exe_link[64];
+	char exe[PATH_MAX];
+	snprintf(exe_link, sizeof(exe_link), "/proc/%i/exe", pid);
+	ssize_t exe_len = readlink(exe_link, exe, sizeof(exe) - 1);
+	if (exe_len <= 0)
+		return;
+	exe[exe_len] = '\0';
+
+	_PrefetchElf_t elf;
+	// Through /proc, in case the tracee got a file that isn't at `exe` any more.
+	if (!_prefetchReadElf(exe_link, &elf) || !elf.interp[0] || !elf.needed_l) {
+		_prefetchFreeElf(&elf);
+		return;
+	}
+	search.musl = strstr(elf.interp, "ld-musl") != NULL;
+	strcpy(search.main_origin, exe);
+	*strrchr(search.main_origin, '/') = '\0';
+	if (!search.main_origin[0])
+		strcpy(search.main_origin, "/");
+	if (elf.runpath < 0 && _prefetchElfString(&elf, elf.rpath))
+		search.main_rpath = strdup(_prefetchElfString(&elf, elf.rpath));
+	_prefetchReadEnv(&search);
+	search.objects[search.objects_l].path = strdup(exe);
+	search.objects[search.objects_l].opened = strdup(exe_link);
+	search.objects_l++;
+
+	char opened[PATH_MAX];
+	if (!search.musl) {
+		// glibc's first two, before any library.
+		_prefetchLookup(&search, "/etc/ld.so.preload", 18, opened, sizeof(opened));
+		_prefetchLookup(&search, "/etc/ld.so.cache", 16, opened, sizeof(opened));
+	}
+	if (search.preload) {
+		char* saveptr;
+		for (char* name = strtok_r(search.preload, " :", &saveptr); name; name = strtok_r(NULL, " :", &saveptr))
+			_prefetchNeeded(&search, name, &elf, search.main_origin);
+	}
+
+	// Breadth-first, like the loader.
+	for (int o = 0; o < search.objects_l; o++) {
+		if (o > 0) {
+			if (!_prefetchReadElf(search.objects[o].opened, &elf)) {
+				_prefetchFreeElf(&elf);
+				continue;
+			}
+		}
+		char origin[PATH_MAX];
+		strcpy(origin, search.objects[o].path);
+		*strrchr(origin, '/') = '\0';
+		if (!origin[0])
+			strcpy(origin, "/");
+		for (int i = 0; i < elf.needed_l; i++)
+			_prefetchNeeded(&search, _prefetchElfString(&elf, elf.needed[i]), &elf, o > 0 ? origin : search.main_origin);
+		_prefetchFreeElf(&elf);
+	}
+
+	interceptor_stats.prefetch_lookups += search.lookups;
+	DEBUG_PRINT("Prefetched %lu loader lookups for %i objects of %i:\n\t%s\n", search.lookups, search.objects_l, pid, exe);
+	for (int o = 0; o < search.objects_l; o++) {
+		free(search.objects[o].path);
+		free(search.objects[o].opened);
+	}
+	free(search.library_path);
+	free(search.preload);
+	free(search.main_rpath);
+}
+
+
+//// Thread:
+
+static void* _prefetchThread(void* arg) {
+	while (1) {
+		pthread_mutex_lock(&_prefetch_lock);
+		while (!_prefetch_queue_l)
+			pthread_cond_wait(&_prefetch_wake, &_prefetch_lock);
+		pid_t pid = _prefetch_queue[_prefetch_queue_head];
+		_prefetch_queue_head = (_prefetch_queue_head + 1) % _PREFETCH_QUEUE;
+		_prefetch_queue_l--;
+		pthread_mutex_unlock(&_prefetch_lock);
+		_prefetchExec(pid);
+	}
+	return NULL;
+}
+
+static void _prefetchStart() {
+	_prefetch_started = 1;
+	sigset_t all_signals, orig_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &orig_signals);
+	// Like the matcher threads, so signals meant for the tracer thread go to it.
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, _prefetchThread, NULL) != 0) {
+		LOG_PRINT("ERROR: Could not start prefetch thread. Not prefetching:\n\t%s\n", strerror(errno));
+	} else {
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+}
+
+static void prefetchExec(pid_t pid) {
+	// Call at the PTRACE_EVENT_EXEC stop of `pid`. The tracee can go on right away, since the work is done on the prefetch thread, ahead of the loader.
+	if (!prefetch_enabled() || !_prefetch_replacer || trace_replay_file())
+		return;
+	// When replaying, `pid` isn't ours to read, if it exists at all.
+	if (!_prefetch_started)
+		_prefetchStart();
+	pthread_mutex_lock(&_prefetch_lock);
+	if (_prefetch_queue_l < _PREFETCH_QUEUE) {
+		_prefetch_queue[(_prefetch_queue_head + _prefetch_queue_l) % _PREFETCH_QUEUE] = pid;
+		_prefetch_queue_l++;
+		pthread_cond_signal(&_prefetch_wake);
+	} else {
+		DEBUG_PRINT("Prefetch queue full. Not prefetching for %i.\n", pid);
+	}
+	pthread_mutex_unlock(&_prefetch_lock);
+}
+
+#endif
@@ -4,106 +4,187 @@
 #include "interceptor_pragmas.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <regex.h>
 #include <string.h>
 
 #include "interceptor_conf.c"
 #include "interceptor_debug.c"
+#include "interceptor_pathcache.c"
 #include "interceptor_replace.h"
+#include "interceptor_rules.c"
+
+
+__thread int path_replacer_last_rule;
+// Declared in interceptor_replace.h, for callers that only see that.
 
 
 ////// Simple regex replacement:
 
-static char* regex_replace(const char* original_s, const char* match_regex_s, const char* replacement_s) {
-	// Return an `original_s` string with one occurence of `match_regex_s` in it replaced with `replacement_s`, or NULL if the string does not match the `match_regex_s`.
-	// The returned string is heap-allocated, and must be freed.
+static int regex_find(const char* input, size_t input_len, const regex_t* match_regex, size_t* match_start, size_t* match_end) {
+	// Find the first occurence of `match_regex` in `input`. Returns 0 if there is none.
+	regmatch_t regex_matches[1];
 
-	static regex_t* _match_regex_compiled;
-	static char* _match_regex_string;
-	// Ooh. Race conditions? (I mean, I don't currently expect it to change anyway.) — Also, the code using this is currently all single-threaded.
+	regex_matches[0].rm_so = 0;
+	regex_matches[0].rm_eo = input_len;
+	// REG_STARTEND saves regexec() its own strlen().
 
-	if (
-		!_match_regex_compiled ||
-		strcmp(match_regex_s, _match_regex_string) != 0
-	) {
-		LOG_PRINT("Compiling new path interceptor regex:\n\t%s\n", match_regex_s);
+	int regex_return = regexec(
+			match_regex,
+			input,
+			1,
+			regex_matches,
+			REG_STARTEND
+	);
 
-		if (_match_regex_compiled) {
-			free(_match_regex_compiled);
-			free(_match_regex_string);
-		}
+	if (regex_return)
+		return 0;
+
+	*match_start = regex_matches[0].rm_so;
+	*match_end = regex_matches[0].rm_eo;
+	return 1;
+}
+
+static int literal_prefix_find(const char* input, size_t input_len, const char* prefix, size_t prefix_len, size_t* match_start, size_t* match_end) {
+	// Same contract as regex_find(), for a regex that is only "^" and a literal. Equivalent, since "^" can only match at the start.
+	if (input_len < prefix_len || memcmp(input, prefix, prefix_len) != 0)
+		return 0;
+	*match_start = 0;
+	*match_end = prefix_len;
+	return 1;
+}
 
-		_match_regex_compiled = (regex_t*)malloc(sizeof(regex_t));
-		// Cast because Kate uses one ClangD LSP configuration for both C and C++. /Shrug./
-		_match_regex_string = (char*)malloc(sizeof(char) *  (strlen(replacement_s) + 1));
+static ssize_t splice_replacement(const char* input, size_t input_len, size_t match_start, size_t match_end, const char* replacement_s, size_t replacement_len, char* output_buf, size_t output_cap) {
+	// Write `input` with the bytes from `match_start` to `match_end` replaced with `replacement_s` into `output_buf`, and return the new length, or PATH_REPLACER_NO_MATCH if it wouldn't fit.
+	// Lengths are passed in so nothing here has to scan the strings again.
+	size_t suffix_len = input_len - match_end;
+	size_t replaced_len = match_start + replacement_len + suffix_len;
 
-		regcomp(_match_regex_compiled, match_regex_s, REG_EXTENDED);
-		// TODO: The options flag could be exposed as a environment variable configuration.
-		strcpy(_match_regex_string, match_regex_s);
+	if (replaced_len + 1 > output_cap) {
+		LOG_PRINT("ERROR: Replaced path would be too long (%zu bytes). Passing path through:\n\t%s\n", replaced_len, input);
+		return PATH_REPLACER_NO_MATCH;
 	}
 
-	regmatch_t regex_matches[1];
+	memcpy(output_buf, input, match_start);
+	memcpy(output_buf + match_start, replacement_s, replacement_len);
+	memcpy(output_buf + match_start + replacement_len, input + match_end, suffix_len);
+	output_buf[replaced_len] = '\0';
+	return replaced_len;
+}
 
-	int regex_return = regexec(
-			_match_regex_compiled,
-			original_s,
-			1,
-			regex_matches,
-			0
-	);
 
-	if (!regex_return) {
-		int original_len = strlen(original_s);
-		int replacement_len = strlen(replacement_s);
-		int replaced_len = original_len
-			+ replacement_len
-			- regex_matches[0].rm_eo
-			+ regex_matches[0].rm_so;
-		char* replaced_s = (char*)malloc(sizeof(char) * (replaced_len + 1));
-		for (int i=0; i < regex_matches[0].rm_so; i++) {
-			replaced_s[i] = original_s[i];
+////// Rewrite engines:
+
+// Each engine applies a whole rule set, first match wins, and must give byte-identical results to the others. intercept-files-bench checks that.
+// Engines only differ in how they find the match. Picking the replacement from a rule's candidates is shared.
+
+typedef ssize_t (*RuleSetEngine_t) (const RuleSet_t* ruleset, const char* input, size_t input_len, char* output_buf, size_t output_cap);
+
+static ssize_t _ruleApply(const InterceptRule_t* rule, const char* input, size_t input_len, size_t match_start, size_t match_end, char* output_buf, size_t output_cap) {
+	// Every candidate but the last has to exist to be used.
+	// Relative ones are skipped. The tracer's working directory isn't the tracee's, so there's no checking them from here.
+	int last = rule->candidates_l - 1;
+	for (int c = 0; c < last; c++) {
+		ssize_t replaced_len = splice_replacement(input, input_len, match_start, match_end, rule->candidates_s[c], rule->candidates_len[c], output_buf, output_cap);
+		if (replaced_len != PATH_REPLACER_NO_MATCH && output_buf[0] == '/' && pathCacheExists(output_buf, replaced_len))
+			return replaced_len;
+	}
+	return splice_replacement(input, input_len, match_start, match_end, rule->candidates_s[last], rule->candidates_len[last], output_buf, output_cap);
+}
+
+static ssize_t ruleSetReplaceRegex(const RuleSet_t* ruleset, const char* input, size_t input_len, char* output_buf, size_t output_cap) {
+	// Every rule through POSIX regexec().
+	size_t match_start, match_end;
+	for (int i = 0; i < ruleset->length; i++) {
+		const InterceptRule_t* rule = &ruleset->rules[i];
+		if (!regex_find(input, input_len, &rule->match_regex, &match_start, &match_end))
+			continue;
+		ssize_t replaced_len = _ruleApply(rule, input, input_len, match_start, match_end, output_buf, output_cap);
+		if (replaced_len != PATH_REPLACER_NO_MATCH) {
+			path_replacer_last_rule = i;
+			return replaced_len;
 		}
-		for (int i=0; i < replacement_len; i++) {
-			replaced_s[regex_matches[0].rm_so + i] = replacement_s[i];
+	}
+	return PATH_REPLACER_NO_MATCH;
+}
+
+static ssize_t ruleSetReplaceLiteral(const RuleSet_t* ruleset, const char* input, size_t input_len, char* output_buf, size_t output_cap) {
+	// Literal-prefix rules with memcmp(), falling back to regexec() for the others.
+	size_t match_start, match_end;
+	for (int i = 0; i < ruleset->length; i++) {
+		const InterceptRule_t* rule = &ruleset->rules[i];
+		int found;
+		if (rule->is_literal_prefix) {
+			found = literal_prefix_find(input, input_len, rule->literal_prefix, rule->literal_prefix_len, &match_start, &match_end);
+		} else {
+			found = regex_find(input, input_len, &rule->match_regex, &match_start, &match_end);
 		}
-		int i_offset = original_len - replaced_len;
-		for (int i=regex_matches[0].rm_so+replacement_len; i < replaced_len; i++) {
-			replaced_s[i] = original_s[i + i_offset];
+		if (!found)
+			continue;
+		ssize_t replaced_len = _ruleApply(rule, input, input_len, match_start, match_end, output_buf, output_cap);
+		if (replaced_len != PATH_REPLACER_NO_MATCH) {
+			path_replacer_last_rule = i;
+			return replaced_len;
 		}
-		replaced_s[replaced_len] = '\0';
-		return replaced_s;
 	}
+	return PATH_REPLACER_NO_MATCH;
+}
+
+typedef struct {
+	const char* name;
+	RuleSetEngine_t replace;
+} RuleSetEngineEntry_t;
+
+const RuleSetEngineEntry_t RuleSetEngines[] = {
+	{ "regex", ruleSetReplaceRegex },
+	{ "literal", ruleSetReplaceLiteral },
+};
+
+const int RuleSetEngines_l = sizeof(RuleSetEngines) / sizeof(RuleSetEngines[0]);
 
-	return NULL;
+static RuleSetEngine_t rule_set_engine() {
+	GET_AND_CACHE_ENV(engine_s, "_PATH_INTERCEPTOR_ENGINE");
+	if (engine_s && strlen(engine_s)) {
+		for (int i = 0; i < RuleSetEngines_l; i++) {
+			if (strcmp(engine_s, RuleSetEngines[i].name) == 0)
+				return RuleSetEngines[i].replace;
+		}
+		LOG_PRINT("ERROR: Unknown rewrite engine:\n\t%s\n", engine_s);
+		exit(1);
+	}
+	return ruleSetReplaceLiteral;
 }
 
-static char* intercept_path(const char* pathname) {
-	// Also returns NULL for no match.
-	// The returned string is heap-allocated, and must be freed.
 
-	// const char* match_regex_s = getenv("_PATH_INTERCEPTOR_MATCH_REGEX");
-	// const char* replacement_s = getenv("_PATH_INTERCEPTOR_REPLACEMENT_STRING");
+static __attribute__ ((unused)) ssize_t intercept_path(const char* pathname, size_t pathname_len, char* output_buf, size_t output_cap) {
+	// PathReplacer_t for the environment-configured rule set.
 
-	// Not sure how I feel about dynamic configuration mid-run. Env vars aren't meaningfully externally mutable anyway, but caching everything at launch feels a little weird.
-	GET_AND_CACHE_ENV(match_regex_s, "_PATH_INTERCEPTOR_MATCH_REGEX");
-	GET_AND_CACHE_ENV(replacement_s, "_PATH_INTERCEPTOR_REPLACEMENT_STRING");
+	static __thread RuleSet_t ruleset;
+	static __thread RuleSetEngine_t engine;
+	// Since the configuration is cached anyway, compile once per thread. Pipelined mode calls this from several matcher threads, and glibc's regexec() locks each compiled regex, so sharing one set would serialize them.
+
+	if (!engine) {
+		ruleSetInit(&ruleset);
+		ruleSetLoadEnv(&ruleset);
+		engine = rule_set_engine();
+	}
 
 	#define RETURN_DEFAULT \
-		return NULL
+		return PATH_REPLACER_NO_MATCH
 
-	if (!match_regex_s || !replacement_s) {
+	if (!ruleset.length) {
 		DEBUG_PRINT("No path replacer defined. Passing path through: %s\n", pathname);
 		RETURN_DEFAULT;
 	}
 
 	DEBUG_PRINT("Path interception requested: %s\n", pathname);
 
-	char* replaced_s = regex_replace(pathname, match_regex_s, replacement_s);
+	ssize_t replaced_len = engine(&ruleset, pathname, pathname_len, output_buf, output_cap);
 
-	if (replaced_s) {
+	if (replaced_len != PATH_REPLACER_NO_MATCH) {
 		DEBUG_PRINT("Intercepted path: %s\n", pathname);
-		return replaced_s;
+		return replaced_len;
 	}
 
 	DEBUG_PRINT("Not intercepting path: %s\n", pathname);
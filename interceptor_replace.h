@@ -1,6 +1,16 @@
 #ifndef INTERCEPTOR_REPLACE_H_INCL
 #define INTERCEPTOR_REPLACE_H_INCL
 
-typedef char* (*StringReplacer_t) (const char* pathname);
+#include <sys/types.h>
+
+// Writes the replacement for `input` (`input_len` bytes, NUL-terminated) into `output_buf`, NUL-terminated, and returns its length.
+// Returns PATH_REPLACER_NO_MATCH if the path should be passed through unchanged, including when the replacement wouldn't fit into `output_cap` bytes.
+// Nothing is allocated, so the caller can reuse the same buffers for every call.
+typedef ssize_t (*PathReplacer_t) (const char* input, size_t input_len, char* output_buf, size_t output_cap);
+
+#define PATH_REPLACER_NO_MATCH ((ssize_t)-1)
+
+extern __thread int path_replacer_last_rule;
+// Replacers that have numbered rules set this to the number of the one that produced their last replacement. Callers that care set it to -1 first, since other replacers leave it alone.
 
 #endif
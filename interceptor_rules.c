@@ -0,0 +1,164 @@
+#ifndef INTERCEPTOR_RULES_C_INCL
+#define INTERCEPTOR_RULES_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <regex.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+
+
+////// Rule sets:
+
+// An ordered list of (regex, replacement) rules. The first rule whose regex matches a path wins.
+// Rules come from _PATH_INTERCEPTOR_MATCH_REGEX/_PATH_INTERCEPTOR_REPLACEMENT_STRING (as the first rule) and from the file named by _PATH_INTERCEPTOR_RULES_FILE.
+// In the file, each line is `REGEX<TAB>REPLACEMENT`. Empty lines and lines starting with "#" are ignored.
+// A line starting with `@overlay<TAB>` makes an overlay rule, whose directories get merged listings. See interceptor_overlay.c.
+// A replacement can be a TAB-separated list of candidates instead, E.G. `^/nix/store/<TAB>/appdir/nix/store/<TAB>/nix/store/`. The first candidate whose result exists is used, and the last one is used if none of the others exist.
+
+typedef struct {
+	char* match_regex_s;
+	regex_t match_regex;
+	char** candidates_s;
+	size_t* candidates_len;
+	int candidates_l;
+	// Replacements, in order of preference. Usually just one.
+	// If the regex is just "^" followed by literal characters, which is how most of our rules look, it can be matched with a memcmp() instead of regexec().
+	int is_literal_prefix;
+	char* literal_prefix;
+	size_t literal_prefix_len;
+	int is_overlay;
+} InterceptRule_t;
+
+typedef struct {
+	InterceptRule_t* rules;
+	int length;
+} RuleSet_t;
+
+
+static int _ruleLiteralPrefix(const char* match_regex_s, char* literal_prefix, size_t* literal_prefix_len) {
+	// If `match_regex_s` is an anchored literal under REG_EXTENDED, write the unescaped literal into `literal_prefix` and return 1.
+	if (match_regex_s[0] != '^')
+		return 0;
+	size_t len = 0;
+	for (const char* p = match_regex_s + 1; *p; p++) {
+		if (strchr(".[]()*+?{}|^$", *p))
+			return 0;
+		if (*p == '\\') {
+			p++;
+			// Only escaped punctuation is a plain literal. Escaped letters and digits are back-references or GNU extensions.
+			if (!*p || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))
+				return 0;
+		}
+		literal_prefix[len++] = *p;
+	}
+	literal_prefix[len] = '\0';
+	*literal_prefix_len = len;
+	return 1;
+}
+
+static void ruleSetInit(RuleSet_t* ruleset) {
+	ruleset->rules = NULL;
+	ruleset->length = 0;
+}
+
+static void ruleSetAdd(RuleSet_t* ruleset, const char* match_regex_s, const char* replacement_s) {
+	LOG_PRINT("Compiling new path interceptor regex:\n\t%s\n", match_regex_s);
+
+	ruleset->rules = (InterceptRule_t*)realloc(ruleset->rules, sizeof(InterceptRule_t) * (ruleset->length + 1));
+	InterceptRule_t* rule = &ruleset->rules[ruleset->length];
+
+	int regcomp_return = regcomp(&rule->match_regex, match_regex_s, REG_EXTENDED);
+	// TODO: The options flag could be exposed as a environment variable configuration.
+	if (regcomp_return) {
+		char regerror_s[256];
+		regerror(regcomp_return, &rule->match_regex, regerror_s, sizeof(regerror_s));
+		LOG_PRINT("ERROR: Could not compile path interceptor regex:\n\t%s\n\t%s\n", match_regex_s, regerror_s);
+		exit(1);
+	}
+
+	rule->match_regex_s = strdup(match_regex_s);
+	rule->is_overlay = 0;
+	rule->candidates_l = 0;
+	rule->candidates_s = NULL;
+	rule->candidates_len = NULL;
+	for (const char* candidate = replacement_s; ; ) {
+		const char* tab = strchr(candidate, '\t');
+		size_t candidate_len = tab ? (size_t)(tab - candidate) : strlen(candidate);
+		rule->candidates_s = (char**)realloc(rule->candidates_s, sizeof(char*) * (rule->candidates_l + 1));
+		rule->candidates_len = (size_t*)realloc(rule->candidates_len, sizeof(size_t) * (rule->candidates_l + 1));
+		rule->candidates_s[rule->candidates_l] = strndup(candidate, candidate_len);
+		rule->candidates_len[rule->candidates_l] = candidate_len;
+		rule->candidates_l++;
+		if (!tab)
+			break;
+		candidate = tab + 1;
+	}
+	if (rule->candidates_l > 1)
+		LOG_PRINT("Rule %i falls back through %i candidates, the first existing one wins.\n", ruleset->length, rule->candidates_l);
+	rule->literal_prefix = (char*)malloc(strlen(match_regex_s) + 1);
+	rule->is_literal_prefix = _ruleLiteralPrefix(match_regex_s, rule->literal_prefix, &rule->literal_prefix_len);
+	if (rule->is_literal_prefix)
+		DEBUG_PRINT("Rule %i is a literal prefix: %s\n", ruleset->length, rule->literal_prefix);
+
+	ruleset->length++;
+}
+
+static int ruleSetLoadFile(RuleSet_t* ruleset, const char* rules_filepath) {
+	// Returns the number of rules added.
+	FILE* f = fopen(rules_filepath, "r");
+	if (!f) {
+		LOG_PRINT("ERROR: Could not open rules file:\n\t%s\n", rules_filepath);
+		exit(1);
+	}
+	int added = 0;
+	int line_number = 0;
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	while ((line_len = getline(&line, &line_cap, f)) >= 0) {
+		line_number++;
+		while (line_len && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+			line[--line_len] = '\0';
+		if (!line_len || line[0] == '#')
+			continue;
+		char* rule_s = line;
+		int is_overlay = strncmp(rule_s, "@overlay\t", 9) == 0;
+		if (is_overlay)
+			rule_s += 9;
+		char* tab = strchr(rule_s, '\t');
+		if (!tab) {
+			LOG_PRINT("ERROR: Rules file line %i has no tab between regex and replacement:\n\t%s\n", line_number, line);
+			exit(1);
+		}
+		*tab = '\0';
+		ruleSetAdd(ruleset, rule_s, tab + 1);
+		if (is_overlay) {
+			ruleset->rules[ruleset->length - 1].is_overlay = 1;
+			DEBUG_PRINT("Rule %i is an overlay.\n", ruleset->length - 1);
+		}
+		added++;
+	}
+	free(line);
+	fclose(f);
+	return added;
+}
+
+static void ruleSetLoadEnv(RuleSet_t* ruleset) {
+	// Not sure how I feel about dynamic configuration mid-run. Env vars aren't meaningfully externally mutable anyway, but caching everything at launch feels a little weird.
+	GET_AND_CACHE_ENV(match_regex_s, "_PATH_INTERCEPTOR_MATCH_REGEX");
+	GET_AND_CACHE_ENV(replacement_s, "_PATH_INTERCEPTOR_REPLACEMENT_STRING");
+	GET_AND_CACHE_ENV(rules_filepath, "_PATH_INTERCEPTOR_RULES_FILE");
+
+	if (match_regex_s && replacement_s)
+		ruleSetAdd(ruleset, match_regex_s, replacement_s);
+	if (rules_filepath && strlen(rules_filepath))
+		ruleSetLoadFile(ruleset, rules_filepath);
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef INTERCEPTOR_STATS_C_INCL
+#define INTERCEPTOR_STATS_C_INCL
+
+#include "interceptor_pragmas.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <sys/resource.h>
+
+#include "interceptor_conf.c"
+#include "interceptor_debug.c"
+
+
+////// Tracer counters:
+
+// Plain counters, bumped unconditionally since an increment is cheaper than checking whether anybody wants them.
+// If _PATH_INTERCEPTOR_STATS_FILE is set, they're appended there as `key=value` lines when the tracer exits, for intercept-files-stress and other scripts to pick up.
+
+typedef struct {
+	unsigned long stops;
+	unsigned long syscall_entries;
+	unsigned long path_reads;
+	unsigned long path_rewrites;
+	unsigned long read_errors;
+	unsigned long new_tasks;
+	unsigned long exited_tasks;
+	unsigned long unexpected_pids;
+	unsigned long path_cache_hits;
+	unsigned long path_cache_misses;
+	unsigned long emulated_calls;
+	unsigned long prefetch_lookups;
+	unsigned long patched_sites;
+	unsigned long manifest_entries;
+	unsigned long overlay_merges;
+	unsigned long overlay_reads;
+	long live_tasks;
+	long peak_live_tasks;
+	long pidmap_capacity;
+} InterceptorStats_t;
+
+static InterceptorStats_t interceptor_stats;
+static struct timespec _stats_start_time;
+
+static inline void statsTaskAdded() {
+	interceptor_stats.new_tasks++;
+	interceptor_stats.live_tasks++;
+	if (interceptor_stats.live_tasks > interceptor_stats.peak_live_tasks)
+		interceptor_stats.peak_live_tasks = interceptor_stats.live_tasks;
+}
+
+static inline void statsTaskExited() {
+	interceptor_stats.exited_tasks++;
+	interceptor_stats.live_tasks--;
+}
+
+static double statsElapsedSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - _stats_start_time.tv_sec) + (now.tv_nsec - _stats_start_time.tv_nsec) / 1e9;
+}
+
+static void _statsWrite() {
+	GET_AND_CACHE_ENV(stats_filepath, "_PATH_INTERCEPTOR_STATS_FILE");
+	FILE* f = fopen(stats_filepath, "a");
+	if (!f) {
+		LOG_PRINT("ERROR: Could not open stats file:\n\t%s\n", stats_filepath);
+		return;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	// Only our own threads. RUSAGE_CHILDREN would include the tracees we've reaped.
+	double elapsed = statsElapsedSeconds();
+	fprintf(f, "elapsed_s=%.6f\n", elapsed);
+	fprintf(f, "tracer_user_s=%.6f\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+	fprintf(f, "tracer_sys_s=%.6f\n", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+	fprintf(f, "tracer_maxrss_kb=%li\n", usage.ru_maxrss);
+	fprintf(f, "stops=%lu\n", interceptor_stats.stops);
+	fprintf(f, "stops_per_s=%.1f\n", elapsed > 0 ? interceptor_stats.stops / elapsed : 0);
+	fprintf(f, "syscall_entries=%lu\n", interceptor_stats.syscall_entries);
+	fprintf(f, "path_reads=%lu\n", interceptor_stats.path_reads);
+	fprintf(f, "path_rewrites=%lu\n", interceptor_stats.path_rewrites);
+	fprintf(f, "read_errors=%lu\n", interceptor_stats.read_errors);
+	fprintf(f, "new_tasks=%lu\n", interceptor_stats.new_tasks);
+	fprintf(f, "exited_tasks=%lu\n", interceptor_stats.exited_tasks);
+	fprintf(f, "unexpected_pids=%lu\n", interceptor_stats.unexpected_pids);
+	fprintf(f, "path_cache_hits=%lu\n", interceptor_stats.path_cache_hits);
+	fprintf(f, "path_cache_misses=%lu\n", interceptor_stats.path_cache_misses);
+	fprintf(f, "emulated_calls=%lu\n", interceptor_stats.emulated_calls);
+	fprintf(f, "prefetch_lookups=%lu\n", interceptor_stats.prefetch_lookups);
+	fprintf(f, "patched_sites=%lu\n", interceptor_stats.patched_sites);
+	fprintf(f, "manifest_entries=%lu\n", interceptor_stats.manifest_entries);
+	fprintf(f, "overlay_merges=%lu\n", interceptor_stats.overlay_merges);
+	fprintf(f, "overlay_reads=%lu\n", interceptor_stats.overlay_reads);
+	fprintf(f, "peak_live_tasks=%li\n", interceptor_stats.peak_live_tasks);
+	fprintf(f, "pidmap_capacity=%li\n", interceptor_stats.pidmap_capacity);
+	fclose(f);
+}
+
+static __attribute__ ((unused)) void statsInit() {
+	clock_gettime(CLOCK_MONOTONIC, &_stats_start_time);
+	GET_AND_CACHE_ENV(stats_filepath, "_PATH_INTERCEPTOR_STATS_FILE");
+	if (stats_filepath && strlen(stats_filepath)) {
+		// process_signals() leaves through exit() when the main target does.
+		atexit(_statsWrite);
+	}
+}
+
+#endif
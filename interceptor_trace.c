@@ -6,6 +6,7 @@
 // #include <stdlib.h>
 
 #include <errno.h>
+#include <string.h>
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
@@ -19,7 +20,15 @@
 #include "interceptor_trace_types.h"
 #include "interceptor_trace_calls.c"
 
+#include "interceptor_memory.c"
 #include "interceptor_pidmap.c"
+#include "interceptor_affinity.c"
+#include "interceptor_stats.c"
+#include "interceptor_logsample.c"
+#include "interceptor_pipeline.c"
+#include "interceptor_backend.c"
+#include "interceptor_handoff.c"
+#include "interceptor_prefetch.c"
 
 
 /*
@@ -33,41 +42,133 @@
 
 ////// PTRACE:
 
-static void process_signals(pid_t child, StringReplacer_t);
+static void process_signals(pid_t child, PathReplacer_t);
+static long tracee_ptrace_options();
+static void start_tracee(pid_t pid);
 static pid_t wait_for_stop(pid_t pid, int *wstatus, int options);
-static void handle_syscall(rax_t rax, pid_t pid, StringReplacer_t replacer);
-static int read_file(reg_t filearg_register, pid_t pid, char *file);
-static void redirect_file(reg_t filearg_register, pid_t pid, const char *file);
+static void handle_syscall(rax_t rax, pid_t pid, PathReplacer_t replacer, SyscallJob_t* job);
+static int handle_syscall_pipelined(rax_t rax, pid_t pid, PathReplacer_t replacer);
+static int decode_syscall(rax_t rax, pid_t pid, SyscallJob_t* job);
+static void match_syscall(SyscallJob_t* job, PathReplacer_t replacer);
+static void apply_syscall(SyscallJob_t* job);
+static void resume_syscall(SyscallJob_t* job);
+static int read_file(reg_t filearg_register, pid_t pid, char *file, size_t file_cap, size_t *file_len);
+static void redirect_file(reg_t filearg_register, pid_t pid, const char *file, size_t file_len);
+
+
+#define _PID_NOT_IN_SYSCALL 0
+#define _PID_IN_SYSCALL 1
+#define _PID_IN_SYSCALL_EXITHOOK 2
+#define _PID_IN_INJECTED_SYSCALL -1
+// Values in `pid_in_syscall`. _PID_IN_SYSCALL_EXITHOOK + i means InterceptibleCalls[i].exit_hook has to run at the syscall-exit-stop. _PID_IN_INJECTED_SYSCALL is a syscall patchSyscall() made the tracee do.
+
+static PidMap_t pid_in_syscall;
+// See process_signals().
+
+static void (*tracer_task_exit_hook) (pid_t pid, int exit_code);
+// Called for every traced task that exits or is killed, with the code the tracer would exit with if it were the main target.
+
+
+static void adopt_tracee(pid_t pid, int in_syscall) {
+	// Start tracking a task some other tracer was handling. See handoffAdopt().
+	pidMapSet(&pid_in_syscall, pid, in_syscall ? _PID_IN_SYSCALL : _PID_NOT_IN_SYSCALL);
+	statsTaskAdded();
+	interceptor_stats.pidmap_capacity = pid_in_syscall.length;
+}
 
+static int entered_syscall_state(rax_t rax) {
+	int i = get_interceptible_call_index(rax);
+	if (i >= 0 && InterceptibleCalls[i].exit_hook)
+		return _PID_IN_SYSCALL_EXITHOOK + i;
+	// Under the seccomp filter, the next stop is the next syscall's, unless we ask for the exit-stop.
+	return (patch_filtered && !manifest_file() && !overlay_enabled()) ? _PID_NOT_IN_SYSCALL : _PID_IN_SYSCALL;
+}
 
-static void process_signals(pid_t child, StringReplacer_t replacer) {
+static int resume_request(pid_t pid) {
+	// Under the seccomp filter, the tracee only needs to stop again at syscall exit if it's in a syscall we still have to see the end of.
+	// Tasks we don't know (anymore) get PTRACE_SYSCALL, which is never wrong, just slower.
+	if (patch_filtered && pidMapHas(&pid_in_syscall, pid) && pidMapGet(&pid_in_syscall, pid) == _PID_NOT_IN_SYSCALL)
+		return PTRACE_CONT;
+	return PTRACE_SYSCALL;
+}
 
-	LOG_PRINT("Starting main target:\n\t%i\n", child);
 
-	PidMap_t pid_in_syscall;
+static void process_signals(pid_t child, PathReplacer_t replacer) {
+	// `child` is the main target, whose exit ends the tracer. In daemon mode it's 0, and tracees come in through start_tracee() instead.
+
+	if (child)
+		LOG_PRINT("Starting main target:\n\t%i\n", child);
+
+	statsInit();
+	manifestInit();
+	overlayInit();
+	affinityInit();
+	ioUringInit(replacer);
+	prefetchInit(replacer);
+	patchInit(child);
+	traceBackendInit(child, resume_syscall);
+	if (!trace_backend_pipelinable()) {
+		if (pipeline_threads() > 0)
+			LOG_PRINT("Handling stops inline while recording or replaying. Ignoring _PATH_INTERCEPTOR_MATCH_THREADS.\n");
+	} else if (patch_filtered) {
+		if (pipeline_threads() > 0)
+			LOG_PRINT("Handling stops inline while patching call sites. Ignoring _PATH_INTERCEPTOR_MATCH_THREADS.\n");
+	} else {
+		pipelineInit(match_syscall, replacer);
+	}
+	handoffInit(child, tracee_ptrace_options());
+
 	pidMapInit(&pid_in_syscall);
 	// See section "Syscall-stops" in ptrace(2).
 	// Each syscall causes one stop upon call entry, which must be continued with ptrace(PTRACE_SYSCALL), and another "indistinguishable" stop on call exit, which must also be continued.
 	// We keep track of that oscillating state per thread to catch only syscall-enter-stops.
 	// We can't just synchronously wait for the syscall-exit-stop each time, because then parent thread syscalls that require us to first handle child thread syscalls, like SYS_wait4 (61), have no way of completing.
+	// The value is one of _PID_*_SYSCALL below, so syscalls with an `exit_hook` can be recognized at their exit-stop.
 	// This also means we only do wait_for_stop() once per loop. That in turn means we (1) can catch *every* potential event, such as exits and forks, and (2) we don't have to repeat (or worry as much about synchronizing) the logic for handling special events like that due to waiting multiple times.
 
-	pidMapSet(&pid_in_syscall, child, 0);
-
 	pid_t pid;
 
-	ptrace(PTRACE_SYSCALL, child, 0, 0);
+	SyscallJob_t inline_job;
+	// Reused for every syscall that's handled start-to-finish right here.
+
+	if (handoff_fd() >= 0) {
+		handoffAdopt(child, adopt_tracee);
+	} else if (child) {
+		pidMapSet(&pid_in_syscall, child, 0);
+		statsTaskAdded();
+		interceptor_stats.pidmap_capacity = pid_in_syscall.length;
+		trace_backend->resume(child, resume_request(child), 0);
+	}
 
 	while(1) {
 		int status = 0;
 
+		if (handoff_signaled)
+			handoffCheck(child, &pid_in_syscall);
+
 
 		DEBUG_PRINT_L(3, "Awaiting stop.\n");
 
 		pid = wait_for_stop(-1, &status, __WALL);
 
+		if (pid < 0 && errno == EINTR)
+			continue;
+
 		DEBUG_PRINT_L(3, "Awaited stop: %i\n", pid);
 
+		interceptor_stats.stops++;
+		affinityNoteStop(pid);
+
+		if (handoff_freezing && handoffStop(child, pid, status, &pid_in_syscall))
+			continue;
+
+		if (!pidMapHas(&pid_in_syscall, pid) && (status >> 16 == PTRACE_EVENT_STOP || (patch_filtered && WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP))) {
+			// Children of tracees attached with PTRACE_SEIZE, like after a handoff, start in a PTRACE_EVENT_STOP, which can come before their parent's fork event.
+			// Leave it stopped, and the fork event will pick it up.
+			// Same for the SIGSTOP other children start with, under the seccomp filter. Detaching them, like below, would make their filtered syscalls fail with ENOSYS.
+			DEBUG_PRINT("New PID %i stopped before its parent's fork event.\n", pid);
+			continue;
+		}
 
 		if (!pidMapHas(&pid_in_syscall, pid)) {
 			// FIXME: This should never happen, but it does (wstatus: 4991).
@@ -75,8 +176,9 @@ static void process_signals(pid_t child, StringReplacer_t replacer) {
 			// Since PTRACE_O_TRACE* is supposed to stop the new process, I suppose QtWebEngine/Chromium possibly has a third process that itself sends signals to the fork, prematurely continuing it?
 			// `strace` doesn't have this issue, so it should be fixable.
 			LOG_PRINT("ERROR: Unexpected PID %i.\n\tWhere did this come from?\n\tDetaching.\n", pid);
+			interceptor_stats.unexpected_pids++;
 			// Attempts to gracefully handle this so far lead to invisible text in QtWebEngine and missing web views in Chromium, so just detach.
-			ptrace(PTRACE_DETACH, pid, 0, 0);
+			trace_backend->resume(pid, PTRACE_DETACH, 0);
 			// pidMapSet(&pid_in_syscall, pid, 0);
 		}
 
@@ -97,17 +199,22 @@ static void process_signals(pid_t child, StringReplacer_t replacer) {
 
 		if (is_fork) {
 			unsigned long fork_pid;
-			ptrace(PTRACE_GETEVENTMSG, pid, 0, &fork_pid);
+			trace_backend->get_event_msg(pid, &fork_pid);
 			LOG_PRINT("%s new PID:\n\t%i → %li\n",
 				fork_logverb,
 				pid,
 				fork_pid
 			);
-			ptrace(PTRACE_SYSCALL, pid, 0, 0);
+			trace_backend->resume(pid, resume_request(pid), 0);
 			if (!pidMapHas(&pid_in_syscall, fork_pid)) {
 				// Check because sometimes child stop is caught before parent clone, so we might have a fallback to already add it in that case. See above.
-				ptrace(PTRACE_SYSCALL, fork_pid, 0, 0);
 				pidMapSet(&pid_in_syscall, fork_pid, 0);
+				trace_backend->resume(fork_pid, resume_request(fork_pid), 0);
+				statsTaskAdded();
+				interceptor_stats.pidmap_capacity = pid_in_syscall.length;
+				ioUringForked(pid, fork_pid);
+				overlayForked(pid, fork_pid);
+				handoffTaskAdded(fork_pid);
 			} else {
 				LOG_PRINT("ERROR: %s PID already recognized!\n\t%li\n",
 					fork_logverb,
@@ -117,10 +224,19 @@ static void process_signals(pid_t child, StringReplacer_t replacer) {
 			continue;
 		}
 
+		if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8))) {
+			// Only asked for with _PATH_INTERCEPTOR_PREFETCH or _PATH_INTERCEPTOR_PATCH. The execve() syscall-exit-stop still follows.
+			prefetchExec(pid);
+			patchExec(pid);
+			trace_backend->resume(pid, resume_request(pid), 0);
+			continue;
+		}
+
 
 		int is_exit = 0;
-		int exit_code;
-		const char* exit_logverb;
+		int is_stop_exit = 0;
+		int exit_code = 0;
+		const char* exit_logverb = NULL;
 
 		if (WIFEXITED(status)) {
 			is_exit = 1;
@@ -137,6 +253,7 @@ static void process_signals(pid_t child, StringReplacer_t replacer) {
 		#define _CHECK_STOPSIG(SIGNAME) \
 			if (!is_exit && stop_sig == SIGNAME) { \
 				is_exit = 1; \
+				is_stop_exit = 1; \
 				exit_code = stop_sig; \
 				exit_logverb = "Killed (" #SIGNAME ")"; \
 			}
@@ -153,51 +270,137 @@ static void process_signals(pid_t child, StringReplacer_t replacer) {
 
 		#undef _CHECK_STOPSIG
 
+		if (is_exit && is_stop_exit && !child) {
+			// The daemon outlives its tracees, so it can't leave them stopped on a fatal signal. Deliver it, and handle the real exit after.
+			LOG_PRINT("%s:\n\t%i %i\n\tDelivering.\n",
+				exit_logverb,
+				pid,
+				exit_code
+			);
+			trace_backend->resume(pid, resume_request(pid), stop_sig);
+			continue;
+		}
+
 		if (is_exit) {
 			LOG_PRINT("%s:\n\t%i %i\n",
 				exit_logverb,
 				pid,
 				exit_code
 			);
-			if (pid == child || pid < 0) {
+			if (child && (pid == child || pid < 0)) {
 				LOG_PRINT("%s main thread.\n",
 					exit_logverb
 				);
 				exit(exit_code);
 			}
+			if (pid < 0 || !pidMapHas(&pid_in_syscall, pid))
+				continue;
+			if (tracer_task_exit_hook)
+				tracer_task_exit_hook(pid, exit_code);
 			pidMapRemove(&pid_in_syscall, pid);
+			statsTaskExited();
+			affinityForget(pid);
+			ioUringForget(pid);
+			pipelineForget(pid);
+			patchForget(pid);
+			manifestForget(pid);
+			overlayForget(pid);
 			continue;
 		}
 
 
-		if ((stop_sig & (SIGTRAP | 0x80)) == (SIGTRAP | 0x80)) {
+		int is_seccomp_stop = status >> 8 == (SIGTRAP | (PTRACE_EVENT_SECCOMP << 8));
+		// Only with _PATH_INTERCEPTOR_PATCH. Stands in for the syscall-enter-stop, which we don't ask for then.
+
+		if (is_seccomp_stop || (stop_sig & (SIGTRAP | 0x80)) == (SIGTRAP | 0x80)) {
 			// Manual says "WSTOPSIG(status) will give the value (SIGTRAP | 0x80)". Apparently other bits can still be set too though.
-			int in_syscall = pidMapGet(&pid_in_syscall, pid);
+			int in_syscall = is_seccomp_stop ? _PID_NOT_IN_SYSCALL : pidMapGet(&pid_in_syscall, pid);
+			int next_in_syscall = _PID_NOT_IN_SYSCALL;
 
 			if (!in_syscall) {
 				DEBUG_PRINT_L(3, "Entering syscall.\n");
-				handle_syscall(
-					ptrace(PTRACE_PEEKUSER, pid, sizeof(long)*ORIG_RAX, 0),
-					pid,
-					replacer
-				);
+				interceptor_stats.syscall_entries++;
+				rax_t rax = trace_backend->peek_user(pid, ORIG_RAX);
+				if (is_seccomp_stop && patchSyscall(pid, rax)) {
+					// Runs again after the injected one.
+					pidMapSet(&pid_in_syscall, pid, _PID_IN_INJECTED_SYSCALL);
+					trace_backend->resume(pid, PTRACE_SYSCALL, 0);
+					continue;
+				}
+				next_in_syscall = entered_syscall_state(rax);
+				if (pipeline_enabled) {
+					if (handle_syscall_pipelined(rax, pid, replacer)) {
+						// Stays stopped until resume_syscall() gets its result.
+						pidMapSet(&pid_in_syscall, pid, next_in_syscall);
+						continue;
+					}
+				} else {
+					handle_syscall(rax, pid, replacer, &inline_job);
+				}
 			} else {
 				DEBUG_PRINT_L(3, "Exiting syscall.\n");
+				if (in_syscall == _PID_IN_INJECTED_SYSCALL) {
+					patchInjected(pid);
+				} else {
+					manifestExit(pid);
+					overlayExit(pid);
+					if (in_syscall >= _PID_IN_SYSCALL_EXITHOOK)
+						InterceptibleCalls[in_syscall - _PID_IN_SYSCALL_EXITHOOK].exit_hook(pid);
+				}
 			}
 
-			pidMapSet(&pid_in_syscall, pid, !in_syscall);
+			pidMapSet(&pid_in_syscall, pid, next_in_syscall);
+		}
+
+		int deliver_sig = 0;
+		if (!child && !is_seccomp_stop && status >> 16 == 0 && stop_sig != (SIGTRAP | 0x80) && stop_sig != SIGTRAP && stop_sig != SIGSTOP && stop_sig != SIGTSTP && stop_sig != SIGTTIN && stop_sig != SIGTTOU) {
+			// A signal-delivery-stop. The daemon's commands get signals forwarded from their clients, like SIGINT for Ctrl-C, so pass it on. Stop signals are left alone, since SIGSTOP is how new children start, and group-stops aren't handled.
+			DEBUG_PRINT("Delivering signal %i to %i.\n", stop_sig, pid);
+			deliver_sig = stop_sig;
 		}
 
+		trace_backend->resume(pid, resume_request(pid), deliver_sig);
+	}
+}
+
 
-		ptrace(PTRACE_SYSCALL, pid, 0, 0);
+static long tracee_ptrace_options() {
+	long ptrace_options = PTRACE_O_TRACESYSGOOD;
+	if (do_trace_threads()) {
+		ptrace_options |=
+			PTRACE_O_TRACECLONE |
+			// PTRACE_O_TRACEEXEC |
+			PTRACE_O_TRACEFORK |
+			PTRACE_O_TRACEVFORK
+		;
 	}
+	if (prefetch_enabled())
+		ptrace_options |= PTRACE_O_TRACEEXEC;
+	if (patch_usable())
+		ptrace_options |= PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC;
+	return ptrace_options;
+}
+
+
+static void start_tracee(pid_t pid) {
+	// Start tracing a new child that did PTRACE_TRACEME and then stopped itself, from inside process_signals().
+	int status;
+	waitpid(pid, &status, __WALL);
+	ptrace(PTRACE_SETOPTIONS, pid, 0, tracee_ptrace_options());
+	pidMapSet(&pid_in_syscall, pid, 0);
+	statsTaskAdded();
+	interceptor_stats.pidmap_capacity = pid_in_syscall.length;
+	trace_backend->resume(pid, resume_request(pid), 0);
 }
 
 
 static pid_t wait_for_stop(pid_t pid, int *wstatus, int options) {
 	pid_t changed_pid;
 	while (1) {
-		changed_pid = waitpid(pid, wstatus, options);
+		changed_pid = trace_backend->wait(pid, wstatus, options);
+		if (changed_pid < 0 && errno == EINTR)
+			return changed_pid;
+			// A signal for the tracer, E.G. a handoff request.
 		#define _CHECK_EVENT(EVENTNAME) (*wstatus >> 8 == (SIGTRAP | (EVENTNAME << 8)))
 		DEBUG_PRINT_L(4, "State change: %i %i %i %i    %i %i %i %i    %i %i %i %i    %i %i %i %i    %i %i %i %i    %i\n",
 			changed_pid,
@@ -231,14 +434,40 @@ static pid_t wait_for_stop(pid_t pid, int *wstatus, int options) {
 		if (WIFSTOPPED(*wstatus)) {
 			return changed_pid;
 		}
-		if (WIFEXITED(*wstatus)) {
+		if (WIFEXITED(*wstatus) || WIFSIGNALED(*wstatus)) {
 			return changed_pid;
 		}
 	}
 }
 
 
-static void handle_syscall(rax_t rax, pid_t pid, StringReplacer_t replacer) {
+static void handle_syscall(rax_t rax, pid_t pid, PathReplacer_t replacer, SyscallJob_t* job) {
+	// Read, match and write back, all at once.
+	if (!decode_syscall(rax, pid, job))
+		return;
+	match_syscall(job, replacer);
+	apply_syscall(job);
+}
+
+
+static int handle_syscall_pipelined(rax_t rax, pid_t pid, PathReplacer_t replacer) {
+	// Returns 1 if the syscall went to the matcher threads. The tracee then must not be resumed until resume_syscall() is called for it.
+	SyscallJob_t* job = pipelineJobAlloc();
+	if (!decode_syscall(rax, pid, job)) {
+		pipelineJobFree(job);
+		return 0;
+	}
+	if (job->args_l && pipelineSubmit(job))
+		return 1;
+	match_syscall(job, replacer);
+	apply_syscall(job);
+	pipelineJobFree(job);
+	return 0;
+}
+
+
+static int decode_syscall(rax_t rax, pid_t pid, SyscallJob_t* job) {
+	// Read the path arguments of a syscall-enter-stop into `job`. Returns 0 if it's not a syscall we intercept.
 	InterceptibleCall_t interceptible_call = get_interceptible_call(rax);
 
 	if (interceptible_call.call_rax < 0) {
@@ -246,7 +475,7 @@ static void handle_syscall(rax_t rax, pid_t pid, StringReplacer_t replacer) {
 			pid,
 			rax
 		);
-		return;
+		return 0;
 	}
 
 	DEBUG_PRINT("Handling syscall '%s' (%i %li).\n",
@@ -255,8 +484,12 @@ static void handle_syscall(rax_t rax, pid_t pid, StringReplacer_t replacer) {
 		interceptible_call.call_rax
 	);
 
+	job->pid = pid;
+	job->call = interceptible_call;
+	job->args_l = 0;
+
 	if (interceptible_call.pre_hook)
-		interceptible_call.pre_hook();
+		interceptible_call.pre_hook(pid);
 
 	for (int i = 0; i < InterceptibleCall_maxargs_l; i++) {
 
@@ -265,14 +498,19 @@ static void handle_syscall(rax_t rax, pid_t pid, StringReplacer_t replacer) {
 		if (!filearg_reg)
 			break;
 
-		/* Find out file and re-direct if appropriate */
+		if (i >= SyscallJob_maxargs) {
+			LOG_PRINT("ERROR: Syscall '%s' has more path arguments than SyscallJob_maxargs. Ignoring REG %i.\n",
+				interceptible_call.name,
+				filearg_reg
+			);
+			continue;
+		}
 
-		char orig_file[PATH_MAX];
+		/* Find out file and re-direct if appropriate */
 
-		if (debug_level())
-			for (int i = 0; i < PATH_MAX; i++) {
-				orig_file[i] = '\0';
-			}
+		SyscallJobArg_t* arg = &job->args[job->args_l++];
+		arg->filearg_register = filearg_reg;
+		arg->new_file_len = PATH_REPLACER_NO_MATCH;
 
 		DEBUG_PRINT("Reading file argument from syscall '%s' (%i %li %i).\n",
 			interceptible_call.name,
@@ -281,133 +519,126 @@ static void handle_syscall(rax_t rax, pid_t pid, StringReplacer_t replacer) {
 			filearg_reg
 		);
 
-		int _errno = read_file(filearg_reg, pid, orig_file);
+		arg->read_errno = read_file(filearg_reg, pid, arg->arena.orig_file, PATH_MAX, &arg->orig_file_len);
+		interceptor_stats.path_reads++;
 
-		if (_errno != 0) {
+		if (arg->read_errno != 0) {
+			interceptor_stats.read_errors++;
 			LOG_PRINT(
-				"ERROR: PTRACE_PEEKTEXT ERROR! (PID %i %s REG %i):\n\t%s\n\tEnable _PATH_INTERCEPTOR_DEBUG=1 for more information.\n\tPlease consider reporting this if it looks like a bug.\n\tMax read out (only accurate if _PATH_INTERCEPTOR_DEBUG=1): %s\n",
+				"ERROR: PTRACE_PEEKTEXT ERROR! (PID %i %s REG %i):\n\t%s\n\tEnable _PATH_INTERCEPTOR_DEBUG=2 for more information.\n\tPlease consider reporting this if it looks like a bug.\n\tMax read out: %s\n",
 				pid,
 				interceptible_call.name,
 				filearg_reg,
-				strerror(_errno),
-				orig_file
+				strerror(arg->read_errno),
+				arg->arena.orig_file
 			);
-			continue;
 		}
+	}
 
-		char *new_file = replacer(orig_file);
+	return 1;
+}
 
-		if (new_file) {
-			LOG_PRINT(
-				"Intercepted and substituted path (PID %i %s REG %i):\n\t%s\n\t→\t%s\n",
-				pid,
-				interceptible_call.name,
-				filearg_reg,
-				orig_file,
-				new_file
-			);
+
+static void match_syscall(SyscallJob_t* job, PathReplacer_t replacer) {
+	// Run the rewrite engine over the paths read by decode_syscall(). No ptrace, so this can run on any thread.
+	for (int i = 0; i < job->args_l; i++) {
+		SyscallJobArg_t* arg = &job->args[i];
+		if (arg->read_errno != 0)
+			continue;
+		path_replacer_last_rule = -1;
+		arg->new_file_len = replacer(arg->arena.orig_file, arg->orig_file_len, arg->arena.new_file, PATH_MAX);
+		arg->rule = path_replacer_last_rule;
+	}
+}
+
+
+static void apply_syscall(SyscallJob_t* job) {
+	// Write back whatever match_syscall() replaced. Must run on the tracer thread.
+	// An emulated syscall never reaches the kernel, so its paths needn't be written back.
+	int emulated = emulate_syscall(job);
+
+	for (int i = 0; i < job->args_l; i++) {
+		SyscallJobArg_t* arg = &job->args[i];
+
+		if (arg->new_file_len != PATH_REPLACER_NO_MATCH) {
+			interceptor_stats.path_rewrites++;
+			unsigned long seen = logSampleRewrite(arg->rule, arg->arena.orig_file, arg->orig_file_len);
+			if (seen) {
+				LOG_PRINT(
+					"Intercepted and substituted path (PID %i %s REG %i):\n\t%s\n\t→\t%s\n%s",
+					job->pid,
+					job->call.name,
+					arg->filearg_register,
+					arg->arena.orig_file,
+					arg->arena.new_file,
+					logSampleNote(seen)
+				);
+			}
+			if (emulated)
+				continue;
 			DEBUG_PRINT("Writing file argument to syscall '%s' (%i %li %i).\n",
-				interceptible_call.name,
-				pid,
-				interceptible_call.call_rax,
-				filearg_reg
+				job->call.name,
+				job->pid,
+				job->call.call_rax,
+				arg->filearg_register
 			);
 
-			redirect_file(filearg_reg, pid, new_file);
-
-			free(new_file);
+			redirect_file(arg->filearg_register, job->pid, arg->arena.new_file, arg->new_file_len);
 		}
 	}
 
-	if (interceptible_call.post_hook)
-		interceptible_call.post_hook();
-}
-
+	if (job->call.post_hook)
+		job->call.post_hook(job->pid);
 
-static int read_file(reg_t filearg_register, pid_t pid, char *file)
-{
-	// Returns `errno` on failure, 0 otherwise.
+	manifestEnter(job);
+	overlayEnter(job);
+	logSampleTick();
+}
 
-	char *child_addr;
-	int i;
 
-	child_addr = (char *) ptrace(PTRACE_PEEKUSER,
-		pid,
-		sizeof(long)*filearg_register,
-		0
-	);
-
-	int debug_loop_i = 0;
+static void resume_syscall(SyscallJob_t* job) {
+	// Pipelined mode: a matcher thread is done with `job`, so finish it and let the tracee go.
+	if (!pipelineJobLanded(job) || !pidMapHas(&pid_in_syscall, job->pid)) {
+		// Its task is gone, and the PID might already be someone else's.
+		DEBUG_PRINT("Dropping result for exited task %i.\n", job->pid);
+		pipelineJobFree(job);
+		return;
+	}
+	apply_syscall(job);
+	trace_backend->resume(job->pid, resume_request(job->pid), 0);
+	pipelineJobFree(job);
+}
 
-	do {
-		long val;
-		char *p;
 
-		val = ptrace(PTRACE_PEEKTEXT,
-			pid,
-			child_addr,
-			NULL
-		);
-		if (val == -1) {
-			// ERROR.
-			DEBUG_PRINT("PTRACE_PEEKTEXT error at word %i (%i %i).\n",
-				debug_loop_i,
-				pid,
-				filearg_register
-			);
-			return errno;
-		}
-		child_addr += sizeof (long);
+static int read_file(reg_t filearg_register, pid_t pid, char *file, size_t file_cap, size_t *file_len)
+{
+	// Returns `errno` on failure, 0 otherwise.
+	// `file` is always left NUL-terminated, with whatever could be read on failure, and `*file_len` is its length.
 
-		p = (char *) &val;
-		for (i = 0; i < sizeof (long); ++i, ++file) {
-			*file = *p++;
-			if (*file == '\0') break;
-		}
+	unsigned long child_addr = trace_backend->peek_user(pid, filearg_register);
 
-		debug_loop_i++;
-	} while (i == sizeof (long));
-	return 0;
+	return trace_backend->read_string(pid, child_addr, file, file_cap, file_len);
 }
 
 
-static void redirect_file(reg_t filearg_register, pid_t pid, const char *file)
+static void redirect_file(reg_t filearg_register, pid_t pid, const char *file, size_t file_len)
 {
 
-	char *stack_addr, *file_addr;
+	unsigned long file_addr;
+	char padded[PATH_MAX + sizeof (long)];
+	size_t padded_len = (file_len + 1 + sizeof (long) - 1) & ~(sizeof (long) - 1);
 
-	stack_addr = (char *) ptrace(PTRACE_PEEKUSER,
-		pid,
-		sizeof(long)*RSP,
-	0);
 	/* Move further of red zone and make sure we have space for the file name */
-	stack_addr -= 128 + PATH_MAX;
-	file_addr = stack_addr;
+	file_addr = trace_backend->peek_user(pid, RSP);
+	file_addr = (file_addr - 128 - PATH_MAX) & ~(sizeof (long) - 1);
 
-	/* Write new file in lower part of the stack */
-	do {
-		int i;
-		char val[sizeof (long)];
-
-		for (i = 0; i < sizeof (long); ++i, ++file) {
-			val[i] = *file;
-			if (*file == '\0') break;
-		}
-
-		ptrace(PTRACE_POKETEXT,
-			pid,
-			stack_addr,
-			*(long *) val
-		);
-		stack_addr += sizeof (long);
-	} while (*file);
+	/* Write new file in lower part of the stack, including its NUL, padded to whole words so nothing around it has to be read first */
+	memcpy(padded, file, file_len + 1);
+	memset(padded + file_len + 1, 0, padded_len - (file_len + 1));
+	trace_backend->write_memory(pid, file_addr, padded, padded_len);
 
 	/* Change argument to open */
-	ptrace(PTRACE_POKEUSER,
-		pid,
-		sizeof(long)*filearg_register,
-		file_addr
-	);
+	trace_backend->poke_user(pid, filearg_register, file_addr);
 }
 
 #endif
@@ -22,23 +22,41 @@
 	.post_hook = POSTHOOK \
 }
 
+#define SYSCALL_WITH_EXIT(PREHOOK, POSTHOOK, EXITHOOK, NAME, ...) { \
+	.name = #NAME, \
+	.call_rax = NAME, \
+	.call_filearg_registers = { __VA_ARGS__ }, \
+	.pre_hook = PREHOOK, \
+	.post_hook = POSTHOOK, \
+	.exit_hook = EXITHOOK \
+}
+
+#define SYSCALL_EMULATED(EMULATION, NAME, ...) { \
+	.name = #NAME, \
+	.call_rax = NAME, \
+	.call_filearg_registers = { __VA_ARGS__ }, \
+	.emulation = EMULATION \
+}
+// See interceptor_emulate.c. Only does anything with _PATH_INTERCEPTOR_EMULATE=1.
+
 const InterceptibleCall_t InterceptibleCalls[] = {
 	// http://blog.rchapman.org/posts/Linux_System_Call_Table_for_x86_64/
 	// https://chromium.googlesource.com/chromiumos/docs/+/HEAD/constants/syscalls.md
 	// Above also includes tables of numbers and names for other CPU architectures.
 
 	// Interestingly, there's no way to list directories here. SYS_readdir is superseded, and both it and SYS_getdents don't directly take path arguments anyway.
+	// Overlay rules get around that by following the FD instead. See SYS_getdents64 below.
 
 	// We rely on zero-initialization to detect early end of the register list. It's technically not part of the C standard until recently, but it seems pretty universal at least in GNU-compatible compilation.
-	SYSCALL(NULL, NULL, SYS_open,
+	SYSCALL_EMULATED(EMULATE_OPEN, SYS_open,
 		RDI),
 	SYSCALL(NULL, NULL, SYS_open,
 		RDI),
-	SYSCALL(NULL, NULL, SYS_stat,
+	SYSCALL_EMULATED(EMULATE_STAT, SYS_stat,
 		RDI),
-	SYSCALL(NULL, NULL, SYS_lstat,
+	SYSCALL_EMULATED(EMULATE_LSTAT, SYS_lstat,
 		RDI),
-	SYSCALL(NULL, NULL, SYS_access,
+	SYSCALL_EMULATED(EMULATE_ACCESS, SYS_access,
 		RDI),
 	// SYSCALL(PREHOOK_clone, NULL, SYS_clone,
 	// 	),
@@ -46,7 +64,7 @@ const InterceptibleCall_t InterceptibleCalls[] = {
 	// 	),
 	// SYSCALL(PREHOOK_vfork, NULL, SYS_vfork,
 	// 	),
-	SYSCALL(NULL/*PREHOOK_execve*/, NULL, SYS_execve,
+	SYSCALL_WITH_EXIT(NULL/*PREHOOK_execve*/, NULL, EXITHOOK_execve, SYS_execve,
 		RDI),
 	SYSCALL(NULL, NULL, SYS_truncate,
 		RDI),
@@ -66,7 +84,7 @@ const InterceptibleCall_t InterceptibleCalls[] = {
 		RDI),
 	SYSCALL(NULL, NULL, SYS_symlink,
 		RDI,RSI),
-	SYSCALL(NULL, NULL, SYS_readlink,
+	SYSCALL_EMULATED(EMULATE_READLINK, SYS_readlink,
 		RDI),
 	SYSCALL(NULL, NULL, SYS_chmod,
 		RDI),
@@ -112,7 +130,7 @@ const InterceptibleCall_t InterceptibleCalls[] = {
 		RDI),
 	SYSCALL(NULL, NULL, SYS_inotify_add_watch,
 		RSI),
-	SYSCALL(NULL, NULL, SYS_openat,
+	SYSCALL_EMULATED(EMULATE_OPENAT, SYS_openat,
 		RSI),
 	SYSCALL(NULL, NULL, SYS_mkdirat,
 		RSI),
@@ -122,7 +140,7 @@ const InterceptibleCall_t InterceptibleCalls[] = {
 		RSI),
 	SYSCALL(NULL, NULL, SYS_futimesat,
 		RSI),
-	SYSCALL(NULL, NULL, SYS_newfstatat,
+	SYSCALL_EMULATED(EMULATE_NEWFSTATAT, SYS_newfstatat,
 		RSI),
 	SYSCALL(NULL, NULL, SYS_unlinkat,
 		RSI),
@@ -132,12 +150,14 @@ const InterceptibleCall_t InterceptibleCalls[] = {
 		RSI,R10),
 	SYSCALL(NULL, NULL, SYS_symlinkat,
 		RDI,RDX),
-	SYSCALL(NULL, NULL, SYS_readlinkat,
+	SYSCALL_EMULATED(EMULATE_READLINKAT, SYS_readlinkat,
 		RSI),
 	SYSCALL(NULL, NULL, SYS_fchmodat,
 		RSI),
-	SYSCALL(NULL, NULL, SYS_faccessat,
+	SYSCALL_EMULATED(EMULATE_FACCESSAT, SYS_faccessat,
 		RSI),
+	SYSCALL_EMULATED(EMULATE_FACCESSAT2, SYS_faccessat2,
+		RSI), // What glibc's faccessat() uses nowadays.
 	SYSCALL(PREHOOK_utimesnat, NULL, SYS_utimensat,
 		RSI),
 	SYSCALL(NULL, NULL, SYS_name_to_handle_at,
@@ -146,20 +166,61 @@ const InterceptibleCall_t InterceptibleCalls[] = {
 		RSI),
 	SYSCALL(NULL, NULL, SYS_renameat2,
 		RSI,R10),
-	SYSCALL(NULL, NULL, SYS_execveat,
+	SYSCALL_WITH_EXIT(NULL, NULL, EXITHOOK_execve, SYS_execveat,
 		RSI), // const char __user *filename?
-	SYSCALL(NULL, NULL, SYS_statx,
+	SYSCALL_EMULATED(EMULATE_STATX, SYS_statx,
 		RSI), // const char *restrict pathname?
+
+	// No path arguments, but needed to find and rewrite paths inside io_uring SQEs. See interceptor_io_uring.c.
+	SYSCALL_WITH_EXIT(PREHOOK_io_uring_setup, NULL, EXITHOOK_io_uring_setup, SYS_io_uring_setup,
+		),
+	SYSCALL_WITH_EXIT(PREHOOK_io_uring_enter, NULL, EXITHOOK_io_uring_enter, SYS_io_uring_enter,
+		),
+	SYSCALL_WITH_EXIT(NULL, NULL, EXITHOOK_mmap, SYS_mmap,
+		),
+	SYSCALL(PREHOOK_close, NULL, SYS_close,
+		),
+
+	// No path arguments either, but needed to merge listings of directories opened through overlay rules. See interceptor_overlay.c.
+	SYSCALL(PREHOOK_getdents64, NULL, SYS_getdents64,
+		),
+	SYSCALL(PREHOOK_lseek, NULL, SYS_lseek,
+		),
 };
 
 const int InterceptibleCalls_l = sizeof(InterceptibleCalls) / sizeof(InterceptibleCalls[0]);
 
-InterceptibleCall_t get_interceptible_call(rax_t rax) {
+#define _INTERCEPTIBLE_CALL_INDEX_L 512
+// More than the highest syscall number on x86_64 for now. Anything above falls back to searching.
+
+static short _interceptible_call_index[_INTERCEPTIBLE_CALL_INDEX_L];
+// Index into InterceptibleCalls[] plus one, by syscall number, since this gets looked up on every syscall-enter-stop. Zero means not interceptible.
+static int _interceptible_call_index_built;
+
+int get_interceptible_call_index(rax_t rax) {
+	// Returns -1 if not found.
+	if (!_interceptible_call_index_built) {
+		for (int i = InterceptibleCalls_l - 1; i >= 0; i--) {
+			// Backwards, so the first entry wins for duplicates, like the search below.
+			if (InterceptibleCalls[i].call_rax >= 0 && InterceptibleCalls[i].call_rax < _INTERCEPTIBLE_CALL_INDEX_L)
+				_interceptible_call_index[InterceptibleCalls[i].call_rax] = i + 1;
+		}
+		_interceptible_call_index_built = 1;
+	}
+	if (rax >= 0 && rax < _INTERCEPTIBLE_CALL_INDEX_L)
+		return _interceptible_call_index[rax] - 1;
 	for (int i = 0; i < InterceptibleCalls_l; i++) {
 		if (InterceptibleCalls[i].call_rax == rax) {
-			return InterceptibleCalls[i];
+			return i;
 		}
 	}
+	return -1;
+}
+
+InterceptibleCall_t get_interceptible_call(rax_t rax) {
+	int i = get_interceptible_call_index(rax);
+	if (i >= 0)
+		return InterceptibleCalls[i];
 	InterceptibleCall_t not_found;
 	not_found.call_rax = -1;
 	return not_found;
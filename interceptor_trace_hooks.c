@@ -3,13 +3,18 @@
 
 #include "interceptor_pragmas.h"
 
+#include <sys/types.h>
+
 #include "interceptor_debug.c"
+#include "interceptor_io_uring.c"
+#include "interceptor_emulate.c"
+#include "interceptor_overlay.c"
 
 
 ////// PTRACE:
 
 #define TEST_LOG_PREHOOK(NAME) \
-	static void NAME() { \
+	static void NAME(pid_t pid) { \
 		LOG_PRINT("Running " #NAME ".\n"); \
 	}
 
@@ -18,10 +23,20 @@ TEST_LOG_PREHOOK(PREHOOK_fork)
 TEST_LOG_PREHOOK(PREHOOK_vfork)
 TEST_LOG_PREHOOK(PREHOOK_execve)
 
-static void PREHOOK_utimesnat() {
+static void PREHOOK_utimesnat(pid_t pid) {
 	DEBUG_PRINT("INFO: SYS_utimensat is known to sometimes cause errors with E.G. `touch ABC`.\n");
 }
 
 TEST_LOG_PREHOOK(TESTHOOK_statx)
 
+static void PREHOOK_close(pid_t pid) {
+	ioUringClosed(pid);
+	overlayClosed(pid);
+}
+
+static void EXITHOOK_execve(pid_t pid) {
+	ioUringExecved(pid);
+	overlayExecved(pid);
+}
+
 #endif
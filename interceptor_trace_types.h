@@ -4,6 +4,7 @@
 #include "interceptor_pragmas.h"
 
 #include <sys/types.h>
+#include <linux/limits.h>
 
 #include "interceptor_replace.h"
 
@@ -15,14 +16,63 @@ typedef long rax_t;
 typedef int reg_t; // There's a register_t in types.h. No idea what it is.
 // <sys/syscall.h>/<asm/unistd_64.h> just has integer literals up to the mid hundreds.
 
+typedef enum {
+	EMULATE_NONE = 0,
+	EMULATE_ACCESS,
+	EMULATE_FACCESSAT,
+	EMULATE_FACCESSAT2,
+	EMULATE_STAT,
+	EMULATE_LSTAT,
+	EMULATE_NEWFSTATAT,
+	EMULATE_STATX,
+	EMULATE_READLINK,
+	EMULATE_READLINKAT,
+	EMULATE_OPEN,
+	EMULATE_OPENAT,
+} SyscallEmulation_t;
+// Which argument layout interceptor_emulate.c should expect, for syscalls it can answer itself.
+
 typedef struct {
 	const char* name;
 	rax_t call_rax;
 	reg_t call_filearg_registers[6];
-	void (*pre_hook) ();
-	void (*post_hook) ();
+	void (*pre_hook) (pid_t pid);
+	void (*post_hook) (pid_t pid);
+	void (*exit_hook) (pid_t pid);
+	// Runs at the syscall-exit-stop, E.G. to look at the return value.
+	SyscallEmulation_t emulation;
 } InterceptibleCall_t;
 
 const int InterceptibleCall_maxargs_l = 6;
 
+typedef struct {
+	// Scratch space for the read → match → write pipeline. One per tracer, reused for every path argument, so handling a syscall doesn't allocate.
+	char orig_file[PATH_MAX];
+	char new_file[PATH_MAX];
+} PathArena_t;
+
+#define SyscallJob_maxargs 2
+// The most path arguments any entry in InterceptibleCalls[] has. Keeps jobs small, since there's one in flight per stopped tracee in pipelined mode.
+
+typedef struct {
+	reg_t filearg_register;
+	int read_errno;
+	size_t orig_file_len;
+	ssize_t new_file_len;
+	int rule;
+	// Number of the rule that rewrote it, or -1.
+	PathArena_t arena;
+} SyscallJobArg_t;
+
+typedef struct SyscallJob_t {
+	// Everything needed to finish handling one syscall-enter-stop, so reading, matching and writing back can happen at different times and on different threads.
+	pid_t pid;
+	InterceptibleCall_t call;
+	int args_l;
+	SyscallJobArg_t args[SyscallJob_maxargs];
+	int _serial;
+	// Set when it's queued for the matcher threads, so a result for a task that has since exited can be told apart.
+	struct SyscallJob_t* _next_free;
+} SyscallJob_t;
+
 #endif